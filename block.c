@@ -0,0 +1,1114 @@
+/* File: block.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif /* __FreeBSD__ */
+
+#include "common.h"
+#include "codec.h"
+#include "block.h"
+
+/* This file contains the block archive container. The node stream is
+   cut into blocks which are compressed independently by a pool of
+   threads and written in order. Each block starts with its compressed
+   and plain sizes, a zero header ends the blocks. It is followed by a
+   table locating each block and a fixed footer pointing to the table,
+   so that a reader may seek to any block.
+
+   Blocks are cut on node boundaries when they are at least half full.
+   Such blocks also carry the directory containing their first node so
+   that a range of blocks may be parsed on its own.
+
+   The level may adapt to the speed of the archive. Each time a block
+   is written, the time spent waiting for the workers is compared with
+   the time spent writing. A slow output raises the level of the next
+   blocks while slow workers lower it, like zstd --adapt.
+
+   container : codec (1) | block size (4)
+   block     : packed size | raw flag (4) | plain size | node flag (4)
+               [ directory size (2) | directory ] | data
+   end       : 0 (4) | 0 (4)
+   table     : { archive offset (8) | plain offset (8) |
+                 packed size | raw flag (4) | plain size | node flag (4) } ...
+   footer    : table offset (8) | number of blocks (4) | magik (4) */
+
+#define BLOCK_RAW   0x80000000 /* block stored without compression */
+#define BLOCK_NODE  0x80000000 /* block starting on a node boundary */
+#define BLOCK_MAGIK 0x42524153 /* "SARB" */
+
+enum block_size { BLOCK_HDR    = 8,
+                  BLOCK_ENTRY  = 24,
+                  BLOCK_FOOTER = 16,
+                  BLOCK_MAX    = 1024 * 1024 * 1024 };
+
+struct block_entry {
+  uint64_t offset;        /* archive offset of the block */
+  uint64_t plain_offset;  /* offset of the block in the node stream */
+  uint32_t packed;        /* packed size and raw flag */
+  uint32_t plain;         /* plain size and node flag */
+};
+
+struct slot {
+  unsigned char *plain;  /* plain data */
+  size_t plain_size;
+  unsigned char *packed; /* compressed data */
+  size_t packed_size;    /* zero when stored raw */
+  bool node;             /* starts on a node boundary */
+  bool raw;              /* stored without compression */
+  int level;             /* compression level of the block */
+  char *context;         /* directory of the first node */
+  uint64_t offset;       /* archive offset of the block */
+  bool done;             /* (de)compressed */
+  bool failed;           /* corrupted block */
+};
+
+struct block {
+  iofile_t file;               /* archive */
+  int fd;                      /* archive descriptor for the table */
+  const struct codec *codec;
+  int level;                   /* level of the next blocks */
+  size_t block_size;           /* plain size of a block */
+  uint64_t offset;             /* archive offset of the next block */
+  uint64_t plain_offset;       /* stream offset of the next block */
+  bool decompress;
+
+  /* Ring of blocks, they are compressed or decompressed by the
+     workers and written or consumed in the order they were
+     submitted. Without workers the blocks are read one by one. */
+  struct slot *slots;
+  unsigned int nb_slots;
+  unsigned long submitted;     /* slots given to the workers */
+  unsigned long taken;         /* slots taken by a worker */
+  unsigned long flushed;       /* slots written or consumed */
+  bool current;                /* consuming a slot */
+  pthread_t *threads;
+  unsigned int nb_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t done;
+  bool quit;
+
+  /* block table */
+  struct block_entry *table;
+  unsigned int nb_entries;
+  unsigned int table_size;
+
+  /* adaptive level */
+  bool adapt;
+  int min_level;
+  int max_level;
+  uint64_t wait_time;          /* smoothed time waiting for the workers */
+  uint64_t write_time;         /* smoothed time writing a block */
+  unsigned long *levels;       /* blocks compressed at each level */
+
+  /* decompression */
+  bool end;                    /* end of the blocks reached */
+  bool range;                  /* only read a range of blocks */
+  uint64_t pos;                /* archive offset of a range */
+  unsigned int next;           /* index of the next block */
+  unsigned int last;           /* end of the range */
+  unsigned char *plain;        /* current plain data */
+  size_t plain_pos;
+  size_t plain_len;
+  unsigned char *buffer;       /* plain data without workers */
+  unsigned char *packed;
+  char context[WP_MAX + 1];    /* directory of the last node block */
+};
+
+static void add_entry(struct block *block, uint64_t offset,
+                      uint64_t plain_offset, uint32_t packed, uint32_t plain)
+{
+  struct block_entry *entry;
+
+  if(block->nb_entries == block->table_size) {
+    block->table_size = block->table_size ? block->table_size * 2 : 64;
+    block->table      = xrealloc(block->table, sizeof(struct block_entry) *
+                                               block->table_size);
+  }
+
+  entry = &block->table[block->nb_entries++];
+  entry->offset       = offset;
+  entry->plain_offset = plain_offset;
+  entry->packed       = packed;
+  entry->plain        = plain;
+}
+
+static void * block_worker(void *arg)
+{
+  struct block *block = arg;
+
+  pthread_mutex_lock(&block->lock);
+
+  while(1) {
+    struct slot *slot;
+
+    while(!block->quit && block->taken == block->submitted)
+      pthread_cond_wait(&block->queued, &block->lock);
+
+    if(block->taken == block->submitted)
+      break;
+
+    slot = &block->slots[block->taken++ % block->nb_slots];
+    pthread_mutex_unlock(&block->lock);
+
+    /* raw blocks are read in place,
+       on creation they are stored raw unless they shrink */
+    if(!block->decompress && slot->raw)
+      slot->packed_size = 0;
+    else if(!block->decompress)
+      slot->packed_size = codec_pack(block->codec, slot->level,
+                                     slot->plain, slot->plain_size,
+                                     slot->packed, slot->plain_size - 1);
+    else if(slot->packed_size)
+      slot->failed = !codec_unpack(block->codec,
+                                   slot->packed, slot->packed_size,
+                                   slot->plain, slot->plain_size);
+
+    pthread_mutex_lock(&block->lock);
+    slot->done = true;
+    pthread_cond_broadcast(&block->done);
+  }
+
+  pthread_mutex_unlock(&block->lock);
+
+  return NULL;
+}
+
+static void start_workers(struct block *block, unsigned int nb_threads)
+{
+  unsigned int i;
+
+  block->nb_threads = nb_threads;
+
+  /* keep the workers busy while the oldest block is written or read */
+  block->nb_slots = nb_threads + 2;
+  block->slots    = xmalloc(sizeof(struct slot) * block->nb_slots);
+  memset(block->slots, 0, sizeof(struct slot) * block->nb_slots);
+
+  for(i = 0 ; i < block->nb_slots ; i++) {
+    block->slots[i].plain   = xmalloc(block->block_size);
+    block->slots[i].packed  = xmalloc(block->block_size);
+    block->slots[i].context = xmalloc(WP_MAX + 1);
+  }
+
+  pthread_mutex_init(&block->lock, NULL);
+  pthread_cond_init(&block->queued, NULL);
+  pthread_cond_init(&block->done, NULL);
+
+  block->threads = xmalloc(sizeof(pthread_t) * nb_threads);
+  for(i = 0 ; i < nb_threads ; i++) {
+    int n = pthread_create(&block->threads[i], NULL, block_worker, block);
+    if(n) {
+      errno = n;
+      err(EXIT_FAILURE, "cannot create thread");
+    }
+  }
+}
+
+static void stop_workers(struct block *block)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&block->lock);
+  block->quit = true;
+  pthread_cond_broadcast(&block->queued);
+  pthread_mutex_unlock(&block->lock);
+
+  for(i = 0 ; i < block->nb_threads ; i++)
+    pthread_join(block->threads[i], NULL);
+
+  for(i = 0 ; i < block->nb_slots ; i++) {
+    free(block->slots[i].plain);
+    free(block->slots[i].packed);
+    free(block->slots[i].context);
+  }
+
+  pthread_mutex_destroy(&block->lock);
+  pthread_cond_destroy(&block->queued);
+  pthread_cond_destroy(&block->done);
+
+  free(block->slots);
+  free(block->threads);
+}
+
+static void submit_slot(struct block *block)
+{
+  struct slot *slot = &block->slots[block->submitted % block->nb_slots];
+
+  if(block->adapt && !slot->raw)
+    block->levels[block->level - block->min_level]++;
+
+  pthread_mutex_lock(&block->lock);
+  slot->level = block->level;
+  block->submitted++;
+  pthread_cond_signal(&block->queued);
+  pthread_mutex_unlock(&block->lock);
+}
+
+static struct slot * wait_slot(struct block *block)
+{
+  struct slot *slot = &block->slots[block->flushed % block->nb_slots];
+
+  pthread_mutex_lock(&block->lock);
+  while(!slot->done)
+    pthread_cond_wait(&block->done, &block->lock);
+  pthread_mutex_unlock(&block->lock);
+
+  return slot;
+}
+
+static struct block * block_writer(iofile_t file, const struct codec *codec,
+                                   int level, size_t block_size,
+                                   unsigned int nb_threads)
+{
+  struct block *block = xmalloc(sizeof(struct block));
+
+  memset(block, 0, sizeof(struct block));
+
+  block->file       = file;
+  block->fd         = -1;
+  block->codec      = codec;
+  block->level      = codec_level(codec, level);
+  block->block_size = block_size;
+
+  start_workers(block, nb_threads);
+
+  return block;
+}
+
+struct block * block_creat(iofile_t file, uint64_t offset,
+                           const struct codec *codec, int level,
+                           size_t block_size, unsigned int nb_threads)
+{
+  assert(codec);
+  assert(block_size > 0 && block_size <= BLOCK_MAX);
+  assert(nb_threads > 0);
+
+  struct block *block = block_writer(file, codec, level, block_size,
+                                     nb_threads);
+  uint32_t s_block_size = htole32(block_size);
+  uint8_t id = codec_id(codec);
+
+  xiobuf_write(file, &id, sizeof(id));
+  xiobuf_write(file, &s_block_size, sizeof(s_block_size));
+  block->offset = offset + sizeof(id) + sizeof(s_block_size);
+
+  return block;
+}
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Move the level of the next blocks by one step. The times are
+   smoothed over a few blocks as the level of a block only shows
+   once the blocks already queued have been written. */
+static void adapt_level(struct block *block, uint64_t wait, uint64_t write)
+{
+  block->wait_time  = (block->wait_time * 3 + wait) / 4;
+  block->write_time = (block->write_time * 3 + write) / 4;
+
+  if(block->wait_time > block->write_time &&
+     block->level > block->min_level)
+    block->level--;
+  else if(block->wait_time * 2 < block->write_time &&
+          block->level < block->max_level)
+    block->level++;
+}
+
+/* write the oldest block once it is compressed */
+static void flush_slot(struct block *block, bool adapt)
+{
+  uint64_t start    = now();
+  struct slot *slot = wait_slot(block);
+  uint64_t ready    = now();
+  uint32_t hdr[2];
+  uint32_t packed, plain;
+  uint64_t offset = block->offset;
+
+  if(slot->packed_size)
+    packed = slot->packed_size;
+  else
+    packed = slot->plain_size | BLOCK_RAW;
+
+  plain = slot->plain_size;
+  if(slot->node)
+    plain |= BLOCK_NODE;
+
+  hdr[0] = htole32(packed);
+  hdr[1] = htole32(plain);
+  xiobuf_write(block->file, hdr, sizeof(hdr));
+  block->offset += sizeof(hdr);
+
+  if(slot->node) {
+    uint16_t size   = strlen(slot->context);
+    uint16_t s_size = htole16(size);
+
+    xiobuf_write(block->file, &s_size, sizeof(s_size));
+    if(size)
+      xiobuf_write(block->file, slot->context, size);
+    block->offset += sizeof(s_size) + size;
+  }
+
+  if(slot->packed_size)
+    xiobuf_write(block->file, slot->packed, slot->packed_size);
+  else
+    xiobuf_write(block->file, slot->plain, slot->plain_size);
+
+  add_entry(block, offset, block->plain_offset, packed, plain);
+  block->offset       += packed & ~BLOCK_RAW;
+  block->plain_offset += slot->plain_size;
+
+  if(block->adapt && adapt)
+    adapt_level(block, ready - start, now() - ready);
+
+  slot->plain_size = 0;
+  slot->node       = false;
+  slot->raw        = false;
+  slot->done       = false;
+  block->flushed++;
+}
+
+/* compress the block being filled */
+static void push_slot(struct block *block)
+{
+  submit_slot(block);
+
+  /* the next slot must be free before it is filled */
+  if(block->submitted - block->flushed == block->nb_slots)
+    flush_slot(block, true);
+}
+
+static void fill_slots(struct block *block, const void *buf, size_t count,
+                       bool raw)
+{
+  assert(!block->decompress);
+
+  while(count) {
+    struct slot *slot = &block->slots[block->submitted % block->nb_slots];
+    size_t n = MIN(count, block->block_size - slot->plain_size);
+
+    /* stored data does not share blocks with compressed data */
+    if(slot->plain_size && slot->raw != raw) {
+      push_slot(block);
+      continue;
+    }
+
+    slot->raw = raw;
+
+    memcpy(slot->plain + slot->plain_size, buf, n);
+    slot->plain_size += n;
+    buf               = (const unsigned char *)buf + n;
+    count            -= n;
+
+    if(slot->plain_size == block->block_size)
+      push_slot(block);
+  }
+}
+
+void block_write(struct block *block, const void *buf, size_t count)
+{
+  fill_slots(block, buf, count, false);
+}
+
+/* write data which is not worth compressing */
+void block_store(struct block *block, const void *buf, size_t count)
+{
+  fill_slots(block, buf, count, true);
+}
+
+/* Check on a sample whether data is worth compressing,
+   it has to shrink by at least 1/16th. */
+bool block_sample(const struct block *block, const void *buf, size_t size)
+{
+  unsigned char *packed = xmalloc(size);
+  size_t n = codec_pack(block->codec, block->level, buf, size,
+                        packed, size - size / 16);
+
+  free(packed);
+
+  return n != 0;
+}
+
+/* let the level move within a range, LEVEL_DEFAULT selects a codec bound */
+void block_adapt(struct block *block, int min_level, int max_level)
+{
+  assert(!block->decompress);
+
+  codec_range(block->codec, &block->min_level, &block->max_level);
+
+  if(min_level != LEVEL_DEFAULT)
+    block->min_level = codec_level(block->codec, min_level);
+  if(max_level != LEVEL_DEFAULT)
+    block->max_level = codec_level(block->codec, max_level);
+  if(block->min_level > block->max_level)
+    errx(EXIT_FAILURE, "invalid range of compression levels");
+
+  block->adapt  = true;
+  block->level  = MIN(MAX(block->level, block->min_level), block->max_level);
+  block->levels = xmalloc(sizeof(unsigned long) *
+                          (block->max_level - block->min_level + 1));
+  memset(block->levels, 0, sizeof(unsigned long) *
+                           (block->max_level - block->min_level + 1));
+}
+
+/* number of blocks submitted at each level of an adaptive range */
+const unsigned long * block_levels(const struct block *block,
+                                   int *min_level, int *max_level)
+{
+  if(!block->adapt)
+    return NULL;
+
+  *min_level = block->min_level;
+  *max_level = block->max_level;
+
+  return block->levels;
+}
+
+/* end the block being filled */
+void block_cut(struct block *block)
+{
+  if(block->slots[block->submitted % block->nb_slots].plain_size)
+    push_slot(block);
+}
+
+/* A node starts here, its parent directory is given as seen by
+   readers. The block is cut early rather than in the next node. */
+void block_node(struct block *block, const char *context)
+{
+  struct slot *slot = &block->slots[block->submitted % block->nb_slots];
+
+  if(slot->plain_size && (slot->raw ||
+                          slot->plain_size >= block->block_size / 2)) {
+    push_slot(block);
+    slot = &block->slots[block->submitted % block->nb_slots];
+  }
+
+  if(!slot->plain_size) {
+    slot->node = true;
+    n_strncpy(slot->context, context, WP_MAX);
+  }
+}
+
+/* flush the pending blocks then write the table and the footer */
+static void close_write(struct block *block)
+{
+  uint32_t end[2] = { 0, 0 };
+  uint64_t table_offset;
+  uint32_t footer[2];
+  unsigned int i;
+
+  if(block->slots[block->submitted % block->nb_slots].plain_size)
+    submit_slot(block);
+  while(block->flushed != block->submitted)
+    flush_slot(block, false);
+
+  stop_workers(block);
+
+  xiobuf_write(block->file, end, sizeof(end));
+  table_offset = htole64(block->offset + sizeof(end));
+
+  for(i = 0 ; i < block->nb_entries ; i++) {
+    struct block_entry *entry = &block->table[i];
+    uint64_t offsets[2] = { htole64(entry->offset),
+                            htole64(entry->plain_offset) };
+    uint32_t sizes[2]   = { htole32(entry->packed),
+                            htole32(entry->plain) };
+
+    xiobuf_write(block->file, offsets, sizeof(offsets));
+    xiobuf_write(block->file, sizes, sizeof(sizes));
+  }
+
+  footer[0] = htole32(block->nb_entries);
+  footer[1] = htole32(BLOCK_MAGIK);
+  xiobuf_write(block->file, &table_offset, sizeof(table_offset));
+  xiobuf_write(block->file, footer, sizeof(footer));
+}
+
+static struct block * block_alloc(const struct codec *codec,
+                                  size_t block_size, int fd)
+{
+  struct block *block = xmalloc(sizeof(struct block));
+
+  memset(block, 0, sizeof(struct block));
+
+  block->fd         = fd;
+  block->codec      = codec;
+  block->block_size = block_size;
+  block->decompress = true;
+  block->buffer     = xmalloc(block_size);
+  block->packed     = xmalloc(block_size);
+  block->plain      = block->buffer;
+
+  return block;
+}
+
+struct block * block_open(iofile_t file, int fd, uint64_t offset)
+{
+  const struct codec *codec;
+  struct block *block;
+  uint32_t block_size;
+  uint8_t id;
+
+  xxiobuf_read(file, &id, sizeof(id));
+  xxiobuf_read(file, &block_size, sizeof(block_size));
+  block_size = le32toh(block_size);
+
+  codec = codec_from_id(id);
+  if(!codec)
+    errx(EXIT_FAILURE, "unsupported codec in block archive (%u)", id);
+
+  if(block_size == 0 || block_size > BLOCK_MAX)
+    errx(EXIT_FAILURE, "invalid block size (%u)", block_size);
+
+  block         = block_alloc(codec, block_size, fd);
+  block->file   = file;
+  block->offset = offset + sizeof(id) + sizeof(block_size);
+
+  return block;
+}
+
+/* read from the archive or from a range with its own offset */
+static void block_input(struct block *block, void *buf, size_t count)
+{
+  if(block->file) {
+    xxiobuf_read(block->file, buf, count);
+    return;
+  }
+
+  while(count) {
+    ssize_t n = pread(block->fd, buf, count, block->pos);
+
+    if(n <= 0)
+      err(EXIT_FAILURE, "IO read error or inconsistent archive");
+
+    buf         = (unsigned char *)buf + n;
+    count      -= n;
+    block->pos += n;
+  }
+}
+
+static void block_input_skip(struct block *block, size_t count)
+{
+  if(block->file)
+    xiobuf_skip(block->file, count);
+  else
+    block->pos += count;
+}
+
+/* Read the header of the next block and register it,
+   returns false at the end of the blocks. */
+static bool read_header(struct block *block, uint32_t *packed, uint32_t *plain)
+{
+  uint32_t hdr[2];
+  uint32_t size, packed_size;
+  uint64_t offset = block->offset;
+
+  if(block->end)
+    return false;
+
+  block_input(block, hdr, sizeof(hdr));
+  *packed = le32toh(hdr[0]);
+  *plain  = le32toh(hdr[1]);
+  block->offset += sizeof(hdr);
+
+  if(!*packed && !*plain) {
+    block->end = true;
+    return false;
+  }
+
+  if(*plain & BLOCK_NODE) {
+    uint16_t len;
+
+    block_input(block, &len, sizeof(len));
+    len = le16toh(len);
+
+    if(len > WP_MAX)
+      errx(EXIT_FAILURE, "inconsistent block at offset %llu",
+           (unsigned long long)offset);
+
+    block_input(block, block->context, len);
+    block->context[len] = '\0';
+    block->offset += sizeof(len) + len;
+  }
+
+  size        = *plain & ~BLOCK_NODE;
+  packed_size = *packed & ~BLOCK_RAW;
+
+  if(size > block->block_size || packed_size > block->block_size ||
+     ((*packed & BLOCK_RAW) && packed_size != size))
+    errx(EXIT_FAILURE, "inconsistent block at offset %llu",
+         (unsigned long long)offset);
+
+  add_entry(block, offset, block->plain_offset, *packed, *plain);
+  block->offset       += packed_size;
+  block->plain_offset += size;
+  block->next++;
+
+  return true;
+}
+
+/* read and decompress the data of a block */
+static void read_data(struct block *block, uint32_t packed, uint32_t plain,
+                      unsigned char *buf)
+{
+  uint32_t size = plain & ~BLOCK_NODE;
+
+  if(packed & BLOCK_RAW) {
+    block_input(block, buf, size);
+    return;
+  }
+
+  block_input(block, block->packed, packed);
+
+  if(!codec_unpack(block->codec, block->packed, packed, buf, size))
+    errx(EXIT_FAILURE, "corrupted block at offset %llu",
+         (unsigned long long)block->table[block->nb_entries - 1].offset);
+}
+
+/* read blocks ahead until the ring is full */
+static void fill_ring(struct block *block)
+{
+  while(block->submitted - block->flushed < block->nb_slots) {
+    struct slot *slot = &block->slots[block->submitted % block->nb_slots];
+    uint32_t packed, plain;
+
+    if(!read_header(block, &packed, &plain))
+      break;
+
+    slot->plain_size  = plain & ~BLOCK_NODE;
+    slot->offset      = block->table[block->nb_entries - 1].offset;
+    slot->failed      = false;
+    slot->done        = false;
+
+    if(packed & BLOCK_RAW) {
+      block_input(block, slot->plain, slot->plain_size);
+      slot->packed_size = 0;
+    }
+    else {
+      block_input(block, slot->packed, packed);
+      slot->packed_size = packed;
+    }
+
+    submit_slot(block);
+  }
+}
+
+/* switch to the plain data of the next block */
+static bool next_plain(struct block *block)
+{
+  struct slot *slot;
+  uint32_t packed, plain;
+
+  if(!block->slots) {
+    if(!read_header(block, &packed, &plain))
+      return false;
+
+    read_data(block, packed, plain, block->buffer);
+
+    block->plain     = block->buffer;
+    block->plain_len = plain & ~BLOCK_NODE;
+    block->plain_pos = 0;
+
+    return true;
+  }
+
+  /* release the slot just consumed */
+  if(block->current) {
+    block->slots[block->flushed % block->nb_slots].done = false;
+    block->flushed++;
+    block->current = false;
+  }
+
+  fill_ring(block);
+
+  if(block->flushed == block->submitted)
+    return false;
+
+  slot = wait_slot(block);
+  if(slot->failed)
+    errx(EXIT_FAILURE, "corrupted block at offset %llu",
+         (unsigned long long)slot->offset);
+
+  block->plain     = slot->plain;
+  block->plain_len = slot->plain_size;
+  block->plain_pos = 0;
+  block->current   = true;
+
+  return true;
+}
+
+/* decompress the following blocks on several threads */
+void block_readahead(struct block *block, unsigned int nb_threads)
+{
+  assert(block->decompress);
+  assert(!block->slots);
+
+  if(nb_threads > 1)
+    start_workers(block, nb_threads);
+}
+
+/* read plain data, returns zero at the end of the blocks */
+size_t block_read(struct block *block, void *buf, size_t count)
+{
+  size_t n;
+
+  assert(block->decompress);
+
+  /* empty blocks are not written */
+  if(block->plain_pos == block->plain_len && !next_plain(block))
+    return 0;
+
+  n = MIN(count, block->plain_len - block->plain_pos);
+  memcpy(buf, block->plain + block->plain_pos, n);
+  block->plain_pos += n;
+
+  return n;
+}
+
+/* skip plain data, whole blocks are skipped without decompression */
+void block_skip(struct block *block, uint64_t size)
+{
+  assert(block->decompress);
+
+  while(size) {
+    size_t n;
+
+    if(block->plain_pos == block->plain_len) {
+      uint32_t packed, plain;
+
+      if(block->slots) {
+        if(!next_plain(block))
+          errx(EXIT_FAILURE, "IO read error or inconsistent archive");
+      }
+      else if(!read_header(block, &packed, &plain))
+        errx(EXIT_FAILURE, "IO read error or inconsistent archive");
+      else if((plain & ~BLOCK_NODE) <= size) {
+        block_input_skip(block, packed & ~BLOCK_RAW);
+        size -= plain & ~BLOCK_NODE;
+        continue;
+      }
+      else {
+        read_data(block, packed, plain, block->buffer);
+
+        block->plain     = block->buffer;
+        block->plain_len = plain & ~BLOCK_NODE;
+        block->plain_pos = 0;
+      }
+    }
+
+    n = MIN(size, block->plain_len - block->plain_pos);
+    block->plain_pos += n;
+    size             -= n;
+  }
+}
+
+/* load the block table through the footer, the archive must be seekable */
+bool block_table(struct block *block)
+{
+  unsigned char footer[BLOCK_FOOTER];
+  uint64_t table_offset;
+  uint32_t nb_blocks, magik;
+  unsigned char *table;
+  struct stat st;
+  unsigned int i;
+
+  if(fstat(block->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+     st.st_size < BLOCK_FOOTER)
+    return false;
+
+  if(pread(block->fd, footer, BLOCK_FOOTER,
+           st.st_size - BLOCK_FOOTER) != BLOCK_FOOTER)
+    return false;
+
+  memcpy(&table_offset, footer, sizeof(table_offset));
+  memcpy(&nb_blocks, footer + 8, sizeof(nb_blocks));
+  memcpy(&magik, footer + 12, sizeof(magik));
+  table_offset = le64toh(table_offset);
+  nb_blocks    = le32toh(nb_blocks);
+
+  if(le32toh(magik) != BLOCK_MAGIK ||
+     table_offset + (uint64_t)nb_blocks * BLOCK_ENTRY + BLOCK_FOOTER !=
+     (uint64_t)st.st_size)
+    return false;
+
+  table = xmalloc((size_t)nb_blocks * BLOCK_ENTRY + 1);
+  if(pread(block->fd, table, (size_t)nb_blocks * BLOCK_ENTRY,
+           table_offset) != (ssize_t)nb_blocks * BLOCK_ENTRY) {
+    free(table);
+    return false;
+  }
+
+  block->nb_entries = 0;
+  for(i = 0 ; i < nb_blocks ; i++) {
+    const unsigned char *e = table + i * BLOCK_ENTRY;
+    uint64_t offset, plain_offset;
+    uint32_t packed, plain;
+
+    memcpy(&offset, e, sizeof(offset));
+    memcpy(&plain_offset, e + 8, sizeof(plain_offset));
+    memcpy(&packed, e + 16, sizeof(packed));
+    memcpy(&plain, e + 20, sizeof(plain));
+
+    add_entry(block, le64toh(offset), le64toh(plain_offset),
+              le32toh(packed), le32toh(plain));
+  }
+
+  free(table);
+
+  return true;
+}
+
+/* Split the blocks in ranges of roughly equal plain size, each range
+   starts on a node boundary. Blocks before the first node only hold
+   headers. Returns the number of ranges, the end of the last range
+   follows their starts. */
+unsigned int block_split(struct block *block, unsigned int nb_ranges,
+                         unsigned int *starts)
+{
+  uint64_t total = 0;
+  unsigned int n = 0;
+  unsigned int i;
+
+  for(i = 0 ; i < block->nb_entries ; i++)
+    total += block->table[i].plain & ~BLOCK_NODE;
+
+  for(i = 0 ; i < block->nb_entries && n < nb_ranges ; i++) {
+    if(!(block->table[i].plain & BLOCK_NODE))
+      continue;
+
+    if(!n || block->table[i].plain_offset >= total / nb_ranges * n)
+      starts[n++] = i;
+  }
+
+  if(n)
+    starts[n] = block->nb_entries;
+
+  return n;
+}
+
+/* Open a range of blocks from the table, the range starts with a node
+   and the directory containing it is returned. */
+struct block * block_range(struct block *block, unsigned int first,
+                           unsigned int last, char *context)
+{
+  assert(first < last && last <= block->nb_entries);
+  assert(block->table[first].plain & BLOCK_NODE);
+
+  struct block *range = block_alloc(block->codec, block->block_size,
+                                    block->fd);
+
+  range->range        = true;
+  range->pos          = block->table[first].offset;
+  range->offset       = block->table[first].offset;
+  range->plain_offset = block->table[first].plain_offset;
+  range->next         = first;
+  range->last         = last;
+
+  /* the first block gives the context */
+  if(!next_plain(range))
+    errx(EXIT_FAILURE, "inconsistent block at offset %llu",
+         (unsigned long long)range->offset);
+
+  strcpy(context, range->context);
+
+  return range;
+}
+
+/* Open a reader at any plain offset through the table, it goes on
+   until the end of the blocks. Returns NULL past the last block. */
+struct block * block_at(struct block *block, uint64_t plain_offset)
+{
+  struct block *range;
+  unsigned int lo = 0, hi = block->nb_entries;
+
+  /* the last block starting before the offset */
+  while(hi - lo > 1) {
+    unsigned int mid = (lo + hi) / 2;
+
+    if(block->table[mid].plain_offset <= plain_offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  if(!block->nb_entries ||
+     plain_offset >= block->table[lo].plain_offset +
+                     (block->table[lo].plain & ~BLOCK_NODE))
+    return NULL;
+
+  range = block_alloc(block->codec, block->block_size, block->fd);
+
+  range->range        = true;
+  range->pos          = block->table[lo].offset;
+  range->offset       = block->table[lo].offset;
+  range->plain_offset = block->table[lo].plain_offset;
+  range->next         = lo;
+  range->last         = block->nb_entries;
+
+  block_skip(range, plain_offset - block->table[lo].plain_offset);
+
+  return range;
+}
+
+/* Resume the blocks of an archive opened for reading, the node stream
+   is cut at a plain offset. The block holding this offset is written
+   again up to it, so the archive is truncated where it started. The
+   blocks before it are kept along with their entries in the table. */
+struct block * block_append(struct block *reader, iofile_t file, int fd,
+                            uint64_t plain_offset, int level,
+                            unsigned int nb_threads)
+{
+  assert(reader->decompress);
+  assert(nb_threads > 0);
+
+  struct block_entry last;
+  struct block *block, *at;
+  unsigned char *prefix;
+  size_t size, n = 0;
+  unsigned int i;
+
+  /* sequential reads may have added entries to the table */
+  if(!block_table(reader) || !reader->nb_entries)
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+
+  for(i = 0 ; i + 1 < reader->nb_entries &&
+              reader->table[i + 1].plain_offset <= plain_offset ; i++);
+  last = reader->table[i];
+  size = plain_offset - last.plain_offset;
+
+  if(plain_offset < last.plain_offset || size > reader->block_size)
+    errx(EXIT_FAILURE, "inconsistent block at offset %llu",
+         (unsigned long long)last.offset);
+
+  /* the block is read before the archive is truncated */
+  prefix = xmalloc(size + 1);
+  at     = block_at(reader, last.plain_offset);
+
+  while(at && n < size) {
+    size_t r = block_read(at, prefix + n, size - n);
+
+    if(!r)
+      break;
+    n += r;
+  }
+
+  if(!at || n != size)
+    errx(EXIT_FAILURE, "inconsistent block at offset %llu",
+         (unsigned long long)last.offset);
+
+  if(ftruncate(fd, last.offset) < 0 ||
+     lseek(fd, last.offset, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot truncate archive");
+
+  block = block_writer(file, reader->codec, level, reader->block_size,
+                       nb_threads);
+
+  for(i = 0 ; reader->table[i].offset < last.offset ; i++)
+    add_entry(block, reader->table[i].offset, reader->table[i].plain_offset,
+              reader->table[i].packed, reader->table[i].plain);
+
+  block->offset       = last.offset;
+  block->plain_offset = last.plain_offset;
+
+  if(size && (last.plain & BLOCK_NODE))
+    block_node(block, at->context);
+  fill_slots(block, prefix, size, last.packed & BLOCK_RAW);
+
+  block_close(at);
+  free(prefix);
+
+  return block;
+}
+
+/* check whether a range was consumed, it ends before a node boundary */
+bool block_done(const struct block *block)
+{
+  return block->range && block->next >= block->last &&
+         block->plain_pos == block->plain_len;
+}
+
+void block_stat(struct block *block, struct block_stat *stat)
+{
+  unsigned int i;
+
+  /* without a seekable archive, walk the remaining block headers */
+  if(block->decompress && !block_table(block)) {
+    uint32_t packed, plain;
+
+    while(read_header(block, &packed, &plain))
+      block_input_skip(block, packed & ~BLOCK_RAW);
+  }
+
+  stat->codec      = block->codec;
+  stat->block_size = block->block_size;
+  stat->nb_blocks  = block->nb_entries;
+  stat->packed     = 0;
+  stat->plain      = 0;
+
+  for(i = 0 ; i < block->nb_entries ; i++) {
+    stat->packed += block->table[i].packed & ~BLOCK_RAW;
+    stat->plain  += block->table[i].plain & ~BLOCK_NODE;
+  }
+}
+
+void block_close(struct block *block)
+{
+  if(!block->decompress)
+    close_write(block);
+  else if(block->slots)
+    stop_workers(block);
+
+  free(block->table);
+  free(block->levels);
+  free(block->buffer);
+  free(block->packed);
+  free(block);
+}
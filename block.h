@@ -0,0 +1,79 @@
+/* File: block.h
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <gawen/iobuf.h>
+
+#include "codec.h"
+
+struct block;
+
+struct block_stat {
+  const struct codec *codec; /* codec of the blocks */
+  size_t block_size;         /* plain size of each block */
+  unsigned int nb_blocks;    /* number of blocks */
+  uint64_t packed;           /* compressed size of all blocks */
+  uint64_t plain;            /* plain size of all blocks */
+};
+
+struct block * block_creat(iofile_t file, uint64_t offset,
+                           const struct codec *codec, int level,
+                           size_t block_size, unsigned int nb_threads);
+void block_write(struct block *block, const void *buf, size_t count);
+void block_store(struct block *block, const void *buf, size_t count);
+bool block_sample(const struct block *block, const void *buf, size_t size);
+void block_adapt(struct block *block, int min_level, int max_level);
+const unsigned long * block_levels(const struct block *block,
+                                   int *min_level, int *max_level);
+void block_cut(struct block *block);
+void block_node(struct block *block, const char *context);
+struct block * block_open(iofile_t file, int fd, uint64_t offset);
+void block_readahead(struct block *block, unsigned int nb_threads);
+size_t block_read(struct block *block, void *buf, size_t count);
+void block_skip(struct block *block, uint64_t size);
+bool block_table(struct block *block);
+unsigned int block_split(struct block *block, unsigned int nb_ranges,
+                         unsigned int *starts);
+struct block * block_range(struct block *block, unsigned int first,
+                           unsigned int last, char *context);
+struct block * block_at(struct block *block, uint64_t plain_offset);
+struct block * block_append(struct block *reader, iofile_t file, int fd,
+                            uint64_t plain_offset, int level,
+                            unsigned int nb_threads);
+bool block_done(const struct block *block);
+void block_stat(struct block *block, struct block_stat *stat);
+void block_close(struct block *block);
+
+#endif /* _BLOCK_H_ */
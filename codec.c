@@ -0,0 +1,1116 @@
+/* File: codec.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <err.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif /* HAVE_LZMA */
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif /* HAVE_ZSTD */
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#include <lz4frame.h>
+#endif /* HAVE_LZ4 */
+
+#include "common.h"
+#include "codec.h"
+
+/* This file contains the in-process compression codecs. Each codec
+   produces the same stream as its external program so that archives
+   may still be decompressed with the usual tools and the other way
+   around.
+
+   A codec works step by step on a window of input and a window of
+   output, the stream buffers the plain data so that small header
+   writes do not reach the codec one by one. Codecs also compress
+   whole buffers at once for block archives.
+
+   Decompression may resume at checkpoints saved while a stream was
+   read once, that is between deflate blocks with the window preceding
+   them, or between xz streams and zstd or lz4 frames. */
+
+enum cstream_size { CS_BUF_SZ = 256 * 1024 }; /* plain and packed buffers */
+
+struct cbuf {
+  unsigned char *data;
+  size_t size;
+  size_t pos;
+};
+
+struct codec {
+  uint8_t id;        /* identifier stored in block archives */
+  const char *name;  /* external program producing the same stream */
+  int min_level;     /* lowest compression level */
+  int max_level;     /* highest compression level */
+  int default_level; /* level used when none is given */
+
+  void * (*open)(int level, unsigned int threads, bool long_window,
+                 bool decompress);
+
+  /* Consume input and produce output. When finish is set no more input
+     will follow, it returns true once the stream is complete. */
+  bool (*step)(void *ctx, struct cbuf *in, struct cbuf *out, bool finish);
+  void (*close)(void *ctx);
+
+  /* Compress a whole buffer, returns the compressed size
+     or zero when it does not fit in the destination. */
+  size_t (*pack)(int level, const void *src, size_t size,
+                 void *dst, size_t max);
+
+  /* decompress a whole buffer of known size */
+  bool (*unpack)(const void *src, size_t size, void *dst, size_t dst_size);
+
+  /* A tracked decoder stops where it could resume later, boundary
+     tells whether it stands there and saves what resuming needs.
+     The input of resume starts at the checkpoint, or at the byte
+     before it when bits are left, no checkpoint restarts the stream. */
+  void (*track)(void *ctx);
+  bool (*boundary)(void *ctx, struct cpoint *cp);
+  void (*resume)(void *ctx, const struct cpoint *cp, struct cbuf *in);
+};
+
+struct cstream {
+  const struct codec *codec;
+  void *ctx;
+  iofile_t file;       /* compressed archive */
+  bool decompress;     /* direction of the stream */
+  bool eof;            /* no more compressed input */
+  bool end;            /* stream complete */
+
+  unsigned char *plain;  /* plain data */
+  size_t plain_pos;      /* plain data consumed */
+  size_t plain_len;      /* plain data available */
+
+  unsigned char *packed; /* compressed data */
+  struct cbuf in;        /* compressed data to decompress */
+
+  uint64_t in_offset;    /* archive offset of the compressed data */
+  uint64_t plain_offset; /* stream offset of the plain data */
+  uint64_t span;         /* plain data between two tracked checkpoints */
+  struct cpoint *cps;    /* checkpoints of the stream */
+  unsigned int nb_cps;
+  unsigned int cps_size;
+};
+
+#ifdef HAVE_ZLIB
+struct zlib_ctx {
+  z_stream z;
+  bool decompress;
+  bool member;       /* inside a gzip member */
+  bool track;        /* stop after each deflate block */
+  bool raw;          /* member resumed as raw deflate data */
+  unsigned int trailer; /* trailer of the member left to skip */
+};
+
+static void * zlib_open(int level, unsigned int threads, bool long_window,
+                        bool decompress)
+{
+  struct zlib_ctx *ctx = xmalloc(sizeof(struct zlib_ctx));
+  int ret;
+
+  memset(ctx, 0, sizeof(struct zlib_ctx));
+  ctx->decompress = decompress;
+
+  /* 16 selects the gzip wrapper, 32 detects it */
+  if(decompress)
+    ret = inflateInit2(&ctx->z, 15 + 32);
+  else
+    ret = deflateInit2(&ctx->z, level, Z_DEFLATED, 15 + 16, 8,
+                       Z_DEFAULT_STRATEGY);
+
+  if(ret != Z_OK)
+    errx(EXIT_FAILURE, "zlib: cannot initialize stream (%d)", ret);
+
+  return ctx;
+}
+
+static bool zlib_step(void *p, struct cbuf *in, struct cbuf *out, bool finish)
+{
+  struct zlib_ctx *ctx = p;
+  size_t avail_in;
+  int ret;
+
+  /* the trailer of a resumed member is not checked */
+  if(ctx->trailer) {
+    size_t n = MIN(ctx->trailer, in->size - in->pos);
+
+    in->pos      += n;
+    ctx->trailer -= n;
+
+    if(ctx->trailer) {
+      if(finish)
+        errx(EXIT_FAILURE, "zlib: truncated stream");
+      return false;
+    }
+
+    inflateReset2(&ctx->z, 15 + 32);
+    ctx->member = false;
+  }
+
+  /* nothing left between two members */
+  if(ctx->decompress && finish && !ctx->member && in->pos == in->size)
+    return true;
+
+  avail_in = in->size - in->pos;
+
+  ctx->z.next_in   = in->data + in->pos;
+  ctx->z.avail_in  = avail_in;
+  ctx->z.next_out  = out->data + out->pos;
+  ctx->z.avail_out = out->size - out->pos;
+
+  if(ctx->decompress)
+    ret = inflate(&ctx->z, ctx->track ? Z_BLOCK : Z_NO_FLUSH);
+  else
+    ret = deflate(&ctx->z, finish ? Z_FINISH : Z_NO_FLUSH);
+
+  in->pos  = in->size - ctx->z.avail_in;
+  out->pos = out->size - ctx->z.avail_out;
+
+  switch(ret) {
+  case(Z_OK):
+    if(ctx->decompress && ctx->z.avail_in != avail_in)
+      ctx->member = true;
+    return false;
+  case(Z_STREAM_END):
+    if(!ctx->decompress)
+      return true;
+
+    /* raw deflate data ends before the crc and size of the member */
+    if(ctx->raw) {
+      ctx->raw     = false;
+      ctx->trailer = 8;
+      return false;
+    }
+
+    /* concatenated members are decompressed as one stream */
+    inflateReset(&ctx->z);
+    ctx->member = false;
+    return false;
+  case(Z_BUF_ERROR):
+    if(finish && ctx->decompress)
+      errx(EXIT_FAILURE, "zlib: truncated stream");
+    return false;
+  default:
+    errx(EXIT_FAILURE, "zlib: %s", ctx->z.msg ? ctx->z.msg : "corrupted stream");
+  }
+}
+
+static void zlib_track(void *p)
+{
+  struct zlib_ctx *ctx = p;
+
+  ctx->track = true;
+}
+
+/* between two deflate blocks of a member, after the last one there
+   is nothing left to resume */
+static bool zlib_boundary(void *p, struct cpoint *cp)
+{
+  struct zlib_ctx *ctx = p;
+  unsigned char window[32768];
+  uInt size = sizeof(window);
+
+  if(!ctx->member || ctx->trailer || (ctx->z.data_type & 0xc0) != 0x80)
+    return false;
+
+  if(inflateGetDictionary(&ctx->z, window, &size) != Z_OK)
+    return false;
+
+  cp->bits        = ctx->z.data_type & 7;
+  cp->window_size = size;
+
+  if(size) {
+    cp->window = xmalloc(size);
+    memcpy(cp->window, window, size);
+  }
+
+  return true;
+}
+
+static void zlib_resume(void *p, const struct cpoint *cp, struct cbuf *in)
+{
+  struct zlib_ctx *ctx = p;
+
+  ctx->trailer = 0;
+  ctx->raw     = cp != NULL;
+  ctx->member  = cp != NULL;
+
+  if(!cp) {
+    inflateReset2(&ctx->z, 15 + 32);
+    return;
+  }
+
+  /* the rest of the member is raw deflate data */
+  inflateReset2(&ctx->z, -15);
+
+  if(cp->bits) {
+    if(in->pos == in->size)
+      errx(EXIT_FAILURE, "zlib: truncated stream");
+    inflatePrime(&ctx->z, cp->bits, in->data[in->pos++] >> (8 - cp->bits));
+  }
+
+  if(cp->window_size)
+    inflateSetDictionary(&ctx->z, cp->window, cp->window_size);
+}
+
+static void zlib_close(void *p)
+{
+  struct zlib_ctx *ctx = p;
+
+  if(ctx->decompress)
+    inflateEnd(&ctx->z);
+  else
+    deflateEnd(&ctx->z);
+
+  free(ctx);
+}
+
+static size_t zlib_pack(int level, const void *src, size_t size,
+                        void *dst, size_t max)
+{
+  uLongf n = max;
+
+  if(compress2(dst, &n, src, size, level) != Z_OK)
+    return 0;
+  return n;
+}
+
+static bool zlib_unpack(const void *src, size_t size,
+                        void *dst, size_t dst_size)
+{
+  uLongf n = dst_size;
+
+  return uncompress(dst, &n, src, size) == Z_OK && n == dst_size;
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_LZMA
+struct lzma_ctx {
+  lzma_stream s;
+  bool track;        /* decode streams one by one */
+  bool fresh;        /* before a stream */
+};
+
+static const char * lzma_message(lzma_ret ret)
+{
+  switch(ret) {
+  case(LZMA_MEM_ERROR):
+    return "out of memory";
+  case(LZMA_MEMLIMIT_ERROR):
+    return "memory limit reached";
+  case(LZMA_FORMAT_ERROR):
+    return "not a xz stream";
+  case(LZMA_OPTIONS_ERROR):
+    return "unsupported options";
+  case(LZMA_DATA_ERROR):
+    return "corrupted stream";
+  case(LZMA_BUF_ERROR):
+    return "truncated stream";
+  default:
+    return "internal error";
+  }
+}
+
+/* (re)start the decoder before a stream */
+static void lzma_decoder(struct lzma_ctx *ctx)
+{
+  lzma_ret ret;
+
+  ret = lzma_stream_decoder(&ctx->s, UINT64_MAX,
+                            ctx->track ? 0 : LZMA_CONCATENATED);
+  if(ret != LZMA_OK)
+    errx(EXIT_FAILURE, "xz: %s", lzma_message(ret));
+
+  ctx->fresh = true;
+}
+
+static void * lzma_open(int level, unsigned int threads, bool long_window,
+                        bool decompress)
+{
+  struct lzma_ctx *ctx = xmalloc(sizeof(struct lzma_ctx));
+  lzma_stream init = LZMA_STREAM_INIT;
+  lzma_ret ret;
+
+  ctx->s     = init;
+  ctx->track = false;
+  ctx->fresh = false;
+
+  if(decompress) {
+    lzma_decoder(ctx);
+    return ctx;
+  }
+  else if(threads > 1) {
+    lzma_mt mt;
+
+    memset(&mt, 0, sizeof(lzma_mt));
+    mt.threads = threads;
+    mt.preset  = level;
+    mt.check   = LZMA_CHECK_CRC64;
+
+    ret = lzma_stream_encoder_mt(&ctx->s, &mt);
+  }
+  else
+    ret = lzma_easy_encoder(&ctx->s, level, LZMA_CHECK_CRC64);
+
+  if(ret != LZMA_OK)
+    errx(EXIT_FAILURE, "xz: %s", lzma_message(ret));
+
+  return ctx;
+}
+
+static bool lzma_step(void *p, struct cbuf *in, struct cbuf *out, bool finish)
+{
+  struct lzma_ctx *ctx = p;
+  lzma_ret ret;
+
+  /* streams may be followed by padding */
+  if(ctx->fresh) {
+    while(in->pos < in->size && !in->data[in->pos])
+      in->pos++;
+
+    if(in->pos == in->size)
+      return finish;
+    ctx->fresh = false;
+  }
+
+  ctx->s.next_in   = in->data + in->pos;
+  ctx->s.avail_in  = in->size - in->pos;
+  ctx->s.next_out  = out->data + out->pos;
+  ctx->s.avail_out = out->size - out->pos;
+
+  ret = lzma_code(&ctx->s, finish ? LZMA_FINISH : LZMA_RUN);
+
+  in->pos  = in->size - ctx->s.avail_in;
+  out->pos = out->size - ctx->s.avail_out;
+
+  switch(ret) {
+  case(LZMA_OK):
+    return false;
+  case(LZMA_STREAM_END):
+    /* a tracked decoder goes on with the next stream */
+    if(ctx->track) {
+      lzma_decoder(ctx);
+      return false;
+    }
+    return true;
+  case(LZMA_BUF_ERROR):
+    if(!finish)
+      return false;
+  default:
+    errx(EXIT_FAILURE, "xz: %s", lzma_message(ret));
+  }
+}
+
+static void lzma_track(void *p)
+{
+  struct lzma_ctx *ctx = p;
+
+  ctx->track = true;
+}
+
+/* the state of a xz stream cannot be saved, only its start */
+static bool lzma_boundary(void *p, struct cpoint *cp)
+{
+  struct lzma_ctx *ctx = p;
+
+  return ctx->fresh;
+}
+
+static void lzma_resume(void *p, const struct cpoint *cp, struct cbuf *in)
+{
+  lzma_decoder(p);
+}
+
+static void lzma_close(void *p)
+{
+  struct lzma_ctx *ctx = p;
+
+  lzma_end(&ctx->s);
+  free(ctx);
+}
+
+static size_t lzma_pack(int level, const void *src, size_t size,
+                        void *dst, size_t max)
+{
+  size_t n = 0;
+
+  /* the archive has its own checksums */
+  if(lzma_easy_buffer_encode(level, LZMA_CHECK_NONE, NULL, src, size,
+                             dst, &n, max) != LZMA_OK)
+    return 0;
+  return n;
+}
+
+static bool lzma_unpack(const void *src, size_t size,
+                        void *dst, size_t dst_size)
+{
+  uint64_t limit = UINT64_MAX;
+  size_t in = 0;
+  size_t out = 0;
+
+  return lzma_stream_buffer_decode(&limit, 0, NULL, src, &in, size,
+                                   dst, &out, dst_size) == LZMA_OK &&
+         out == dst_size;
+}
+#endif /* HAVE_LZMA */
+
+#ifdef HAVE_ZSTD
+struct zstd_ctx {
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+  bool frame;        /* inside a frame */
+};
+
+static void zstd_check(size_t ret)
+{
+  if(ZSTD_isError(ret))
+    errx(EXIT_FAILURE, "zstd: %s", ZSTD_getErrorName(ret));
+}
+
+static void * zstd_open(int level, unsigned int threads, bool long_window,
+                        bool decompress)
+{
+  struct zstd_ctx *ctx = xmalloc(sizeof(struct zstd_ctx));
+
+  memset(ctx, 0, sizeof(struct zstd_ctx));
+
+  if(decompress) {
+    ctx->dctx = ZSTD_createDCtx();
+    if(!ctx->dctx)
+      errx(EXIT_FAILURE, "zstd: cannot create context");
+
+    /* accept long range windows */
+    zstd_check(ZSTD_DCtx_setParameter(ctx->dctx, ZSTD_d_windowLogMax, 31));
+
+    return ctx;
+  }
+
+  ctx->cctx = ZSTD_createCCtx();
+  if(!ctx->cctx)
+    errx(EXIT_FAILURE, "zstd: cannot create context");
+
+  zstd_check(ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+                                    level));
+
+  if(long_window) {
+    zstd_check(ZSTD_CCtx_setParameter(ctx->cctx,
+                                      ZSTD_c_enableLongDistanceMatching, 1));
+    zstd_check(ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_windowLog, 27));
+  }
+
+  /* the library may be built without threads */
+  if(threads > 1 &&
+     ZSTD_isError(ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_nbWorkers,
+                                         threads)))
+    warnx("zstd: threads not supported, compressing on one thread");
+
+  return ctx;
+}
+
+static bool zstd_step(void *p, struct cbuf *in, struct cbuf *out, bool finish)
+{
+  struct zstd_ctx *ctx = p;
+  ZSTD_inBuffer  zin  = { in->data, in->size, in->pos };
+  ZSTD_outBuffer zout = { out->data, out->size, out->pos };
+  size_t ret;
+
+  if(ctx->cctx) {
+    ret = ZSTD_compressStream2(ctx->cctx, &zout, &zin,
+                               finish ? ZSTD_e_end : ZSTD_e_continue);
+    zstd_check(ret);
+
+    in->pos  = zin.pos;
+    out->pos = zout.pos;
+
+    return finish && ret == 0;
+  }
+
+  /* nothing left between two frames */
+  if(finish && !ctx->frame && in->pos == in->size)
+    return true;
+
+  ret = ZSTD_decompressStream(ctx->dctx, &zout, &zin);
+  zstd_check(ret);
+
+  if(finish && zin.pos == in->pos && zout.pos == out->pos)
+    errx(EXIT_FAILURE, "zstd: truncated stream");
+
+  in->pos  = zin.pos;
+  out->pos = zout.pos;
+
+  /* zero when a frame is complete and flushed */
+  ctx->frame = ret != 0;
+
+  return false;
+}
+
+static bool zstd_boundary(void *p, struct cpoint *cp)
+{
+  struct zstd_ctx *ctx = p;
+
+  return !ctx->frame;
+}
+
+static void zstd_resume(void *p, const struct cpoint *cp, struct cbuf *in)
+{
+  struct zstd_ctx *ctx = p;
+
+  zstd_check(ZSTD_DCtx_reset(ctx->dctx, ZSTD_reset_session_only));
+  ctx->frame = false;
+}
+
+static void zstd_close(void *p)
+{
+  struct zstd_ctx *ctx = p;
+
+  if(ctx->cctx)
+    ZSTD_freeCCtx(ctx->cctx);
+  if(ctx->dctx)
+    ZSTD_freeDCtx(ctx->dctx);
+
+  free(ctx);
+}
+
+static size_t zstd_pack(int level, const void *src, size_t size,
+                        void *dst, size_t max)
+{
+  size_t n = ZSTD_compress(dst, max, src, size, level);
+
+  if(ZSTD_isError(n))
+    return 0;
+  return n;
+}
+
+static bool zstd_unpack(const void *src, size_t size,
+                        void *dst, size_t dst_size)
+{
+  return ZSTD_decompress(dst, dst_size, src, size) == dst_size;
+}
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+enum lz4_size { LZ4_CHUNK = 64 * 1024 }; /* input given at once */
+
+struct lz4_ctx {
+  LZ4F_cctx *cctx;
+  LZ4F_dctx *dctx;
+  LZ4F_preferences_t prefs;
+  bool started;      /* frame header written */
+  bool frame;        /* inside a frame */
+};
+
+static size_t lz4_check(size_t ret)
+{
+  if(LZ4F_isError(ret))
+    errx(EXIT_FAILURE, "lz4: %s", LZ4F_getErrorName(ret));
+  return ret;
+}
+
+static void * lz4_open(int level, unsigned int threads, bool long_window,
+                       bool decompress)
+{
+  struct lz4_ctx *ctx = xmalloc(sizeof(struct lz4_ctx));
+
+  memset(ctx, 0, sizeof(struct lz4_ctx));
+
+  if(decompress) {
+    lz4_check(LZ4F_createDecompressionContext(&ctx->dctx, LZ4F_VERSION));
+    return ctx;
+  }
+
+  ctx->prefs.frameInfo.blockSizeID         = LZ4F_max64KB;
+  ctx->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+  ctx->prefs.compressionLevel              = level;
+
+  lz4_check(LZ4F_createCompressionContext(&ctx->cctx, LZ4F_VERSION));
+
+  /* one step must always fit in the packed buffer */
+  assert(LZ4F_compressBound(LZ4_CHUNK, &ctx->prefs) + 32 <= CS_BUF_SZ);
+
+  return ctx;
+}
+
+static bool lz4_step(void *p, struct cbuf *in, struct cbuf *out, bool finish)
+{
+  struct lz4_ctx *ctx = p;
+  size_t src_sz = in->size - in->pos;
+  size_t dst_sz = out->size - out->pos;
+
+  if(ctx->cctx) {
+    if(!ctx->started) {
+      out->pos += lz4_check(LZ4F_compressBegin(ctx->cctx, out->data + out->pos,
+                                               dst_sz, &ctx->prefs));
+      ctx->started = true;
+    }
+
+    if(src_sz) {
+      size_t n = MIN(src_sz, LZ4_CHUNK);
+
+      out->pos += lz4_check(LZ4F_compressUpdate(ctx->cctx,
+                                                out->data + out->pos,
+                                                out->size - out->pos,
+                                                in->data + in->pos, n, NULL));
+      in->pos += n;
+    }
+    else if(finish) {
+      out->pos += lz4_check(LZ4F_compressEnd(ctx->cctx, out->data + out->pos,
+                                             out->size - out->pos, NULL));
+      return true;
+    }
+
+    return false;
+  }
+
+  /* nothing left between two frames */
+  if(finish && !ctx->frame && !src_sz)
+    return true;
+
+  ctx->frame = lz4_check(LZ4F_decompress(ctx->dctx, out->data + out->pos,
+                                         &dst_sz, in->data + in->pos,
+                                         &src_sz, NULL)) != 0;
+
+  if(finish && !src_sz && !dst_sz)
+    errx(EXIT_FAILURE, "lz4: truncated stream");
+
+  in->pos  += src_sz;
+  out->pos += dst_sz;
+
+  return false;
+}
+
+static bool lz4_boundary(void *p, struct cpoint *cp)
+{
+  struct lz4_ctx *ctx = p;
+
+  return !ctx->frame;
+}
+
+static void lz4_resume(void *p, const struct cpoint *cp, struct cbuf *in)
+{
+  struct lz4_ctx *ctx = p;
+
+  LZ4F_resetDecompressionContext(ctx->dctx);
+  ctx->frame = false;
+}
+
+static void lz4_close(void *p)
+{
+  struct lz4_ctx *ctx = p;
+
+  if(ctx->cctx)
+    LZ4F_freeCompressionContext(ctx->cctx);
+  if(ctx->dctx)
+    LZ4F_freeDecompressionContext(ctx->dctx);
+
+  free(ctx);
+}
+
+static size_t lz4_pack(int level, const void *src, size_t size,
+                       void *dst, size_t max)
+{
+  /* high compression starts at level 3 like the lz4 program */
+  if(level >= 3)
+    return LZ4_compress_HC(src, dst, size, max, level);
+  return LZ4_compress_fast(src, dst, size, max, 1);
+}
+
+static bool lz4_unpack(const void *src, size_t size,
+                       void *dst, size_t dst_size)
+{
+  return LZ4_decompress_safe(src, dst, size, dst_size) == (int)dst_size;
+}
+#endif /* HAVE_LZ4 */
+
+static const struct codec codecs[] = {
+#ifdef HAVE_ZLIB
+  { 1, "gzip", 1, 9,  6, zlib_open, zlib_step, zlib_close,
+    zlib_pack, zlib_unpack, zlib_track, zlib_boundary, zlib_resume },
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_LZMA
+  { 2, "xz",   0, 9,  6, lzma_open, lzma_step, lzma_close,
+    lzma_pack, lzma_unpack, lzma_track, lzma_boundary, lzma_resume },
+#endif /* HAVE_LZMA */
+#ifdef HAVE_ZSTD
+  { 3, "zstd", 1, 22, 3, zstd_open, zstd_step, zstd_close,
+    zstd_pack, zstd_unpack, NULL, zstd_boundary, zstd_resume },
+#endif /* HAVE_ZSTD */
+#ifdef HAVE_LZ4
+  { 4, "lz4",  1, 12, 1, lz4_open,  lz4_step,  lz4_close,
+    lz4_pack, lz4_unpack, NULL, lz4_boundary, lz4_resume },
+#endif /* HAVE_LZ4 */
+  { 0 }
+};
+
+/* find the codec replacing an external program */
+const struct codec * codec_find(const char *program)
+{
+  const struct codec *codec;
+
+  for(codec = codecs ; codec->name ; codec++)
+    if(strtest(codec->name, program))
+      return codec;
+
+  return NULL;
+}
+
+/* iterate over the built-in codecs, starting with NULL */
+const struct codec * codec_next(const struct codec *codec)
+{
+  codec = codec ? codec + 1 : codecs;
+
+  return codec->name ? codec : NULL;
+}
+
+/* find the codec of a block archive */
+const struct codec * codec_from_id(uint8_t id)
+{
+  const struct codec *codec;
+
+  for(codec = codecs ; codec->name ; codec++)
+    if(codec->id == id)
+      return codec;
+
+  return NULL;
+}
+
+const char * codec_name(const struct codec *codec)
+{
+  return codec->name;
+}
+
+uint8_t codec_id(const struct codec *codec)
+{
+  return codec->id;
+}
+
+/* check a compression level, LEVEL_DEFAULT selects the default one */
+int codec_level(const struct codec *codec, int level)
+{
+  if(level == LEVEL_DEFAULT)
+    return codec->default_level;
+  else if(level < codec->min_level || level > codec->max_level)
+    errx(EXIT_FAILURE, "compression level for %s must be within %d and %d",
+         codec->name, codec->min_level, codec->max_level);
+
+  return level;
+}
+
+void codec_range(const struct codec *codec, int *min_level, int *max_level)
+{
+  *min_level = codec->min_level;
+  *max_level = codec->max_level;
+}
+
+size_t codec_pack(const struct codec *codec, int level,
+                  const void *src, size_t size, void *dst, size_t max)
+{
+  return codec->pack(level, src, size, dst, max);
+}
+
+bool codec_unpack(const struct codec *codec, const void *src, size_t size,
+                  void *dst, size_t dst_size)
+{
+  return codec->unpack(src, size, dst, dst_size);
+}
+
+struct cstream * cstream_open(const struct codec *codec, iofile_t file,
+                              int level, unsigned int threads,
+                              bool long_window, bool decompress)
+{
+  assert(codec);
+
+  struct cstream *cs = xmalloc(sizeof(struct cstream));
+
+  memset(cs, 0, sizeof(struct cstream));
+
+  level = codec_level(codec, level);
+
+  cs->codec      = codec;
+  cs->file       = file;
+  cs->decompress = decompress;
+  cs->plain      = xmalloc(CS_BUF_SZ);
+  cs->packed     = xmalloc(CS_BUF_SZ);
+  cs->ctx        = codec->open(level, threads, long_window, decompress);
+
+  return cs;
+}
+
+/* compress plain data and write it to the archive */
+static void deflate_plain(struct cstream *cs, const void *buf, size_t count,
+                          bool finish)
+{
+  struct cbuf in = { (unsigned char *)buf, count, 0 };
+  bool done;
+
+  do {
+    struct cbuf out = { cs->packed, CS_BUF_SZ, 0 };
+
+    done = cs->codec->step(cs->ctx, &in, &out, finish);
+
+    if(out.pos)
+      xiobuf_write(cs->file, cs->packed, out.pos);
+  } while(in.pos < in.size || (finish && !done));
+}
+
+void cstream_write(struct cstream *cs, const void *buf, size_t count)
+{
+  assert(!cs->decompress);
+
+  /* large writes skip the plain buffer */
+  if(!cs->plain_len && count >= CS_BUF_SZ) {
+    deflate_plain(cs, buf, count, false);
+    return;
+  }
+
+  while(count) {
+    size_t n = MIN(count, CS_BUF_SZ - cs->plain_len);
+
+    memcpy(cs->plain + cs->plain_len, buf, n);
+    cs->plain_len += n;
+    buf            = (const unsigned char *)buf + n;
+    count         -= n;
+
+    if(cs->plain_len == CS_BUF_SZ) {
+      deflate_plain(cs, cs->plain, cs->plain_len, false);
+      cs->plain_len = 0;
+    }
+  }
+}
+
+/* save a checkpoint once enough plain data was decompressed */
+static void track_checkpoint(struct cstream *cs)
+{
+  uint64_t plain = cs->plain_offset + cs->plain_len;
+  uint64_t last  = cs->nb_cps ? cs->cps[cs->nb_cps - 1].plain : 0;
+  struct cpoint cp;
+
+  if(plain - last < cs->span)
+    return;
+
+  memset(&cp, 0, sizeof(struct cpoint));
+  if(!cs->codec->boundary(cs->ctx, &cp))
+    return;
+
+  cp.packed = cs->in_offset + cs->in.pos;
+  cp.plain  = plain;
+
+  if(cs->nb_cps == cs->cps_size) {
+    cs->cps_size = cs->cps_size ? cs->cps_size * 2 : 64;
+    cs->cps      = xrealloc(cs->cps, sizeof(struct cpoint) * cs->cps_size);
+  }
+
+  cs->cps[cs->nb_cps++] = cp;
+}
+
+/* read the next compressed data */
+static void read_packed(struct cstream *cs)
+{
+  ssize_t n = xiobuf_read(cs->file, cs->packed, CS_BUF_SZ);
+
+  cs->in_offset += cs->in.size;
+  cs->in.data    = cs->packed;
+  cs->in.size    = n;
+  cs->in.pos     = 0;
+  cs->eof        = n == 0;
+}
+
+/* decompress the next plain data, false at the end of the stream */
+static bool inflate_plain(struct cstream *cs)
+{
+  cs->plain_offset += cs->plain_len;
+  cs->plain_pos     = 0;
+  cs->plain_len     = 0;
+
+  while(!cs->plain_len && !cs->end) {
+    struct cbuf out = { cs->plain, CS_BUF_SZ, 0 };
+
+    if(cs->in.pos == cs->in.size && !cs->eof)
+      read_packed(cs);
+
+    cs->end = cs->codec->step(cs->ctx, &cs->in, &out,
+                              cs->eof && cs->in.pos == cs->in.size);
+    cs->plain_len = out.pos;
+
+    if(cs->span)
+      track_checkpoint(cs);
+  }
+
+  return cs->plain_len != 0;
+}
+
+/* read plain data, returns zero at the end of the stream */
+size_t cstream_read(struct cstream *cs, void *buf, size_t count)
+{
+  size_t n;
+
+  assert(cs->decompress);
+
+  if(cs->plain_pos == cs->plain_len && !inflate_plain(cs))
+    return 0;
+
+  n = MIN(count, cs->plain_len - cs->plain_pos);
+  memcpy(buf, cs->plain + cs->plain_pos, n);
+  cs->plain_pos += n;
+
+  return n;
+}
+
+const struct cpoint * cstream_checkpoints(const struct cstream *cs,
+                                          unsigned int *nb)
+{
+  *nb = cs->nb_cps;
+
+  return cs->cps;
+}
+
+/* seek through the checkpoints given, the stream now owns them */
+void cstream_index(struct cstream *cs, struct cpoint *cps, unsigned int nb)
+{
+  assert(cs->decompress);
+  assert(!cs->nb_cps);
+
+  free(cs->cps);
+
+  cs->cps      = cps;
+  cs->nb_cps   = nb;
+  cs->cps_size = nb;
+}
+
+/* resume decompression at a checkpoint or at the start of the stream */
+static void resume(struct cstream *cs, const struct cpoint *cp)
+{
+  uint64_t packed = cp ? cp->packed - (cp->bits ? 1 : 0) : 0;
+
+  if(iobuf_lseek(cs->file, packed, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek archive");
+
+  cs->in_offset = packed;
+  cs->in.size   = 0;
+  cs->eof       = false;
+  cs->end       = false;
+  read_packed(cs);
+
+  cs->codec->resume(cs->ctx, cp, &cs->in);
+
+  cs->plain_offset = cp ? cp->plain : 0;
+  cs->plain_pos    = 0;
+  cs->plain_len    = 0;
+}
+
+/* Move to a plain offset of the stream. Decompression resumes at the
+   last checkpoint before it unless the current position is already
+   on the way. Returns false past the end of the stream. */
+bool cstream_seek(struct cstream *cs, uint64_t offset)
+{
+  const struct cpoint *cp = NULL;
+  unsigned int lo = 0, hi = cs->nb_cps;
+  uint64_t pos;
+
+  assert(cs->decompress);
+
+  /* the last checkpoint before the offset */
+  while(lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+
+    if(cs->cps[mid].plain <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo)
+    cp = &cs->cps[lo - 1];
+
+  pos = cs->plain_offset + cs->plain_pos;
+  if(offset < pos || (cp && cp->plain > pos)) {
+    resume(cs, cp);
+    pos = cs->plain_offset;
+  }
+
+  while(pos < offset) {
+    size_t n;
+
+    if(cs->plain_pos == cs->plain_len && !inflate_plain(cs))
+      return false;
+
+    n = MIN(offset - pos, cs->plain_len - cs->plain_pos);
+    cs->plain_pos += n;
+    pos           += n;
+  }
+
+  return true;
+}
+
+/* save checkpoints every span of plain data at least */
+void cstream_track(struct cstream *cs, uint64_t span)
+{
+  uint64_t pos = cs->plain_offset + cs->plain_pos;
+
+  assert(cs->decompress);
+
+  cs->span = MAX(span, 1);
+
+  if(cs->codec->track)
+    cs->codec->track(cs->ctx);
+
+  /* the stream is tracked from its start */
+  resume(cs, NULL);
+  cstream_seek(cs, pos);
+}
+
+/* end the stream, the archive itself is left open */
+void cstream_close(struct cstream *cs)
+{
+  unsigned int i;
+
+  if(!cs->decompress) {
+    deflate_plain(cs, cs->plain, cs->plain_len, true);
+    cs->plain_len = 0;
+  }
+
+  cs->codec->close(cs->ctx);
+
+  for(i = 0 ; i < cs->nb_cps ; i++)
+    free(cs->cps[i].window);
+  free(cs->cps);
+
+  free(cs->plain);
+  free(cs->packed);
+  free(cs);
+}
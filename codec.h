@@ -0,0 +1,79 @@
+/* File: codec.h
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <gawen/iobuf.h>
+
+struct codec;
+struct cstream;
+
+/* point where decompression may resume in the middle of a stream */
+struct cpoint {
+  uint64_t packed;         /* offset in the compressed archive */
+  uint64_t plain;          /* offset in the plain stream */
+  uint8_t bits;            /* bits of the previous byte not decoded yet */
+  uint16_t window_size;    /* plain data preceding the checkpoint */
+  unsigned char *window;
+};
+
+/* level chosen by the codec when none is requested */
+#define LEVEL_DEFAULT (-1)
+
+const struct codec * codec_find(const char *program);
+const struct codec * codec_from_id(uint8_t id);
+const struct codec * codec_next(const struct codec *codec);
+const char * codec_name(const struct codec *codec);
+uint8_t codec_id(const struct codec *codec);
+int codec_level(const struct codec *codec, int level);
+void codec_range(const struct codec *codec, int *min_level, int *max_level);
+
+size_t codec_pack(const struct codec *codec, int level,
+                  const void *src, size_t size, void *dst, size_t max);
+bool codec_unpack(const struct codec *codec, const void *src, size_t size,
+                  void *dst, size_t dst_size);
+
+struct cstream * cstream_open(const struct codec *codec, iofile_t file,
+                              int level, unsigned int threads,
+                              bool long_window, bool decompress);
+void cstream_write(struct cstream *cs, const void *buf, size_t count);
+size_t cstream_read(struct cstream *cs, void *buf, size_t count);
+void cstream_track(struct cstream *cs, uint64_t span);
+const struct cpoint * cstream_checkpoints(const struct cstream *cs,
+                                          unsigned int *nb);
+void cstream_index(struct cstream *cs, struct cpoint *cps, unsigned int nb);
+bool cstream_seek(struct cstream *cs, uint64_t offset);
+void cstream_close(struct cstream *cs);
+
+#endif /* _CODEC_H_ */
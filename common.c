@@ -30,12 +30,16 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <stdio.h>
 #include <utime.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <err.h>
 
 #include <gawen/iobuf.h>
@@ -74,6 +78,7 @@
 SAFE_CALL0(fork, < 0, "cannot fork", int)
 
 SAFE_CALL1(pipe, < 0, "cannot create pipe", int, int *)
+SAFE_CALL1(dup, < 0, "cannot duplicate file descriptors", int, int)
 SAFE_CALL1(malloc, == NULL, "out of memory", void *, size_t)
 SAFE_CALL1(chdir, < 0, "cannot change directory", int, const char *)
 
@@ -122,6 +127,34 @@ char * readlink_malloc_n(const char *filename, ssize_t *n)
   }
 }
 
+/* put back the times a file had before it was read */
+void restore_time(const char *path, const struct stat *st)
+{
+#ifdef __FreeBSD__
+  /* FreeBSD doesn't seems to support nanosecond timestamp
+     therefore we use a microsecond timestamp instead */
+  struct timeval times[2];
+
+  times[0].tv_sec  = st->st_atime;
+  times[0].tv_usec = st->st_atim.tv_nsec / 1000;
+
+  times[1].tv_sec  = st->st_mtime;
+  times[1].tv_usec = st->st_mtim.tv_nsec / 1000;
+
+  lutimes(path, times);
+#else
+  struct timespec times[2];
+
+  times[0].tv_sec  = st->st_atime;
+  times[0].tv_nsec = st->st_atim.tv_nsec;
+
+  times[1].tv_sec  = st->st_mtime;
+  times[1].tv_nsec = st->st_mtim.tv_nsec;
+
+  utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+#endif /* __FreeBSD__ */
+}
+
 size_t n_strncpy(char *dest, const char *src, size_t n)
 {
   size_t i;
@@ -151,6 +184,29 @@ ssize_t xxiobuf_read(iofile_t file, void *buf, size_t count)
   return index;
 }
 
+/* create an anonymous temporary file */
+int xtmpfd(void)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  int fd;
+
+  if(!tmpdir)
+    tmpdir = "/tmp";
+
+  snprintf(path, PATH_MAX, "%s/sarXXXXXX", tmpdir);
+
+  fd = mkstemp(path);
+  if(fd < 0)
+    err(EXIT_FAILURE, "cannot create temporary file in \"%s\"", tmpdir);
+  unlink(path);
+
+  /* do not leak into compressor children */
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  return fd;
+}
+
 /* exact comparison between two strings */
 bool strtest(const char *a, const char *b)
 {
@@ -54,12 +54,15 @@
 
 char * readlink_malloc_n(const char *filename, ssize_t *n);
 size_t n_strncpy(char *dest, const char *src, size_t n);
+void restore_time(const char *path, const struct stat *st);
 bool strtest(const char *a, const char *b);
 int iobuf_skip(iofile_t file, off_t size);
 
 int xfork();
 int xpipe(int pipefd[2]);
+int xdup(int oldfd);
 int xdup2(int oldfd, int newfd);
+int xtmpfd(void);
 char * xgetcwd(char *buf, size_t size);
 void * xmalloc(size_t size);
 void * xrealloc(void *ptr, size_t size);
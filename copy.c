@@ -0,0 +1,600 @@
+/* File: copy.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#ifdef __linux__
+/* copy_file_range(), splice() and tee() */
+# define _GNU_SOURCE 1
+#endif /* __linux__ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <err.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif /* __linux__ */
+
+#include "common.h"
+#include "copy.h"
+
+/* this file contains the copy mode which materializes the nodes
+   found by the archive walker directly in a destination directory */
+
+enum copy_size { COPY_QUEUE_SZ = 1024,        /* pending small files */
+                 COPY_SMALL    = 256 * 1024,  /* small file size limit */
+                 COPY_DIRS_SZ  = 256 };       /* initial directory list */
+
+struct copy_job {
+  char *src;          /* source path */
+  char *dst;          /* destination path */
+  struct stat stat;   /* source stat information */
+};
+
+struct copy_dir {
+  char *path;         /* destination path */
+  struct stat stat;   /* source stat information */
+};
+
+struct sar_copy {
+  char *dst;                   /* destination directory */
+
+  /* small files worker pool */
+  pthread_t *workers;          /* worker threads */
+  unsigned int nb_workers;     /* number of workers */
+  struct copy_job *queue;      /* circular queue of small files */
+  unsigned int head;           /* next job to take */
+  unsigned int nb_jobs;        /* jobs in the queue */
+  bool closing;                /* no more jobs will come */
+  pthread_mutex_t lock;
+  pthread_cond_t  not_empty;
+  pthread_cond_t  not_full;
+
+  /* directories attributes are restored at the end */
+  struct copy_dir *dirs;
+  size_t nb_dirs;
+  size_t dirs_sz;
+};
+
+/* copy len bytes at the same offset of two files,
+   in the kernel when possible
+   return  0 on success,
+          -1 on error    */
+static int copy_range(int in, int out, off_t offset, off_t len)
+{
+  char *iobuf;
+  ssize_t n = 0;
+
+#ifdef __linux__
+  while(len > 0) {
+    loff_t from = offset, to = offset;
+
+    n = copy_file_range(in, &from, out, &to, len, 0);
+
+    if(n < 0) {
+      /* not supported across these files, use a plain copy */
+      if(errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+         errno == EOPNOTSUPP)
+        break;
+      return -1;
+    }
+    else if(n == 0)
+      return 0;
+
+    offset += n;
+    len    -= n;
+  }
+
+  if(len <= 0)
+    return 0;
+#endif /* __linux__ */
+
+  iobuf = xmalloc(IO_SZ);
+
+  while(len > 0) {
+    n = pread(in, iobuf, MIN(len, IO_SZ), offset);
+
+    if(n <= 0)
+      break;
+    if(pwrite(out, iobuf, n, offset) != n) {
+      n = -1;
+      break;
+    }
+
+    offset += n;
+    len    -= n;
+  }
+
+  free(iobuf);
+  return n < 0 ? -1 : 0;
+}
+
+/* copy size bytes between two files,
+   try to share extents first then to copy the data extents only
+   so that holes are kept
+   return  0 on success,
+          -1 on error    */
+int copy_data(int in, int out, off_t size)
+{
+  off_t offset = 0, data, hole;
+
+#ifdef FICLONE
+  /* reflink the whole file (btrfs, XFS) */
+  if(ioctl(out, FICLONE, in) == 0)
+    return 0;
+#endif /* FICLONE */
+
+  while(offset < size) {
+    switch(seek_data(in, offset, &data, &hole)) {
+    case(0):
+      /* a hole up to the end */
+      data = hole = size;
+      break;
+    case(-1):
+      /* the file system cannot tell, copy everything */
+      data = offset;
+      hole = size;
+      break;
+    }
+
+    data = MIN(data, size);
+    hole = MIN(hole, size);
+
+    if(copy_range(in, out, data, hole - data) < 0)
+      return -1;
+
+    offset = hole;
+  }
+
+  /* the output ends with the last hole */
+  return ftruncate(out, size);
+}
+
+/* Copy a range of a file to a lower offset within the same file, the
+   two ranges must not overlap. Returns 0 on success, -1 on error. */
+int move_data(int fd, off_t from, off_t to, off_t size)
+{
+  char *iobuf;
+  ssize_t n;
+
+  assert(to + size <= from);
+
+#ifdef __linux__
+  while(size > 0) {
+    loff_t in = from, out = to;
+
+    n = copy_file_range(fd, &in, fd, &out, size, 0);
+
+    if(n < 0) {
+      if(errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+         errno == EOPNOTSUPP)
+        break;
+      return -1;
+    }
+    else if(n == 0)
+      return -1;
+
+    from += n;
+    to   += n;
+    size -= n;
+  }
+
+  if(size <= 0)
+    return 0;
+#endif /* __linux__ */
+
+  iobuf = xmalloc(IO_SZ);
+
+  while(size > 0) {
+    n = pread(fd, iobuf, MIN(size, IO_SZ), from);
+
+    if(n <= 0 || pwrite(fd, iobuf, n, to) != n) {
+      free(iobuf);
+      return -1;
+    }
+
+    from += n;
+    to   += n;
+    size -= n;
+  }
+
+  free(iobuf);
+  return 0;
+}
+
+/* Find the data of a file from an offset and the hole ending it.
+   Returns 1 when found, 0 when a hole runs up to the end of the file
+   and -1 when the file system cannot tell. */
+int seek_data(int fd, off_t offset, off_t *data, off_t *hole)
+{
+#ifdef SEEK_DATA
+  *data = lseek(fd, offset, SEEK_DATA);
+  if(*data < 0)
+    return errno == ENXIO ? 0 : -1;
+
+  *hole = lseek(fd, *data, SEEK_HOLE);
+  return *hole < 0 ? -1 : 1;
+#else
+  return -1;
+#endif /* SEEK_DATA */
+}
+
+/* Share the extents holding size bytes from the offset of a file with
+   the start of another file, as far as the block size allows. The
+   input moves past the bytes shared, which are read back when a
+   checksum is given. Returns the bytes left to copy, which may be all
+   of them when the file system cannot share extents, or -1 on error. */
+off_t clone_data(int in, int out, off_t size,
+                 uint32_t (*f_crc)(const unsigned char *s,
+                                   unsigned long len,
+                                   uint32_t crc),
+                 uint32_t *crc)
+{
+#ifdef FICLONERANGE
+  struct file_clone_range range;
+  unsigned char *iobuf;
+  struct stat st;
+  off_t from, len, n;
+
+  from = lseek(in, 0, SEEK_CUR);
+  if(from < 0 || fstat(in, &st) < 0 || st.st_blksize <= 0)
+    return size;
+
+  len = size - size % st.st_blksize;
+  if(!len || from % st.st_blksize)
+    return size;
+
+  range.src_fd      = in;
+  range.src_offset  = from;
+  range.src_length  = len;
+  range.dest_offset = 0;
+  if(ioctl(out, FICLONERANGE, &range) < 0)
+    return size;
+
+  if(f_crc) {
+    iobuf = xmalloc(IO_SZ);
+
+    for(n = 0 ; n < len ;) {
+      ssize_t r = pread(in, iobuf, MIN(len - n, IO_SZ), from + n);
+
+      if(r <= 0) {
+        free(iobuf);
+        return -1;
+      }
+
+      *crc = f_crc(iobuf, r, *crc);
+      n   += r;
+    }
+
+    free(iobuf);
+  }
+
+  if(lseek(in, from + len, SEEK_SET) < 0 || lseek(out, len, SEEK_SET) < 0)
+    return -1;
+
+  return size - len;
+#else
+  return size;
+#endif /* FICLONERANGE */
+}
+
+/* Move size bytes from the offset of a file to a pipe without copying
+   them through user space. Returns the bytes left to move, which may
+   be all of them when the files cannot be spliced, or -1 on error. */
+off_t splice_data(int in, int out, off_t size)
+{
+#ifdef __linux__
+  struct stat st;
+
+  if(fstat(out, &st) < 0 || !S_ISFIFO(st.st_mode))
+    return size;
+
+  while(size > 0) {
+    ssize_t n = splice(in, NULL, out, NULL, size, SPLICE_F_MORE);
+
+    if(n < 0)
+      return errno == EINVAL ? size : -1;
+    else if(n == 0)
+      break;
+
+    size -= n;
+  }
+#endif /* __linux__ */
+
+  return size;
+}
+
+static void copy_attributes(const char *path, const struct stat *stat)
+{
+  struct timespec times[2];
+
+  if(lchown(path, stat->st_uid, stat->st_gid) < 0 && errno != EPERM)
+    warn("cannot change owner of \"%s\"", path);
+
+  /* avoid dereference symbolic links */
+  if(!S_ISLNK(stat->st_mode) && chmod(path, stat->st_mode & 07777) < 0)
+    warn("cannot change mode of \"%s\"", path);
+
+  times[0] = stat->st_atim;
+  times[1] = stat->st_mtim;
+  utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static void copy_regular(const char *src, const char *dst,
+                         const struct stat *stat)
+{
+  int in, out;
+
+  in = open(src, O_RDONLY);
+  if(in < 0) {
+    warn("cannot open \"%s\"", src);
+    return;
+  }
+
+  out = open(dst, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  if(out < 0) {
+    warn("could not open output file \"%s\"", dst);
+    close(in);
+    return;
+  }
+
+  if(copy_data(in, out, stat->st_size) < 0)
+    warn("cannot copy \"%s\" to \"%s\"", src, dst);
+
+  close(in);
+  close(out);
+
+  copy_attributes(dst, stat);
+}
+
+static void * copy_worker(void *arg)
+{
+  struct sar_copy *copy = arg;
+
+  while(1) {
+    struct copy_job job;
+
+    pthread_mutex_lock(&copy->lock);
+
+    while(!copy->nb_jobs && !copy->closing)
+      pthread_cond_wait(&copy->not_empty, &copy->lock);
+
+    if(!copy->nb_jobs) {
+      pthread_mutex_unlock(&copy->lock);
+      return NULL;
+    }
+
+    job = copy->queue[copy->head];
+    copy->head = (copy->head + 1) % COPY_QUEUE_SZ;
+    copy->nb_jobs--;
+
+    pthread_cond_signal(&copy->not_full);
+    pthread_mutex_unlock(&copy->lock);
+
+    copy_regular(job.src, job.dst, &job.stat);
+
+    /* the walker has moved on since */
+    restore_time(job.src, &job.stat);
+
+    free(job.src);
+    free(job.dst);
+  }
+}
+
+static void queue_regular(struct sar_copy *copy, const char *src,
+                          const char *dst, const struct stat *stat)
+{
+  struct copy_job *job;
+
+  pthread_mutex_lock(&copy->lock);
+
+  while(copy->nb_jobs == COPY_QUEUE_SZ)
+    pthread_cond_wait(&copy->not_full, &copy->lock);
+
+  job = &copy->queue[(copy->head + copy->nb_jobs) % COPY_QUEUE_SZ];
+  job->src  = strdup(src);
+  job->dst  = strdup(dst);
+  job->stat = *stat;
+  copy->nb_jobs++;
+
+  pthread_cond_signal(&copy->not_empty);
+  pthread_mutex_unlock(&copy->lock);
+}
+
+/* destination of a path found by the walker,
+   the path is rooted in the destination as on extraction */
+static void copy_path(const struct sar_copy *copy, char *dst,
+                      const char *path)
+{
+  while(*path == '/')
+    path++;
+
+  if(snprintf(dst, PATH_MAX, "%s/%s", copy->dst, path) >= PATH_MAX)
+    errx(EXIT_FAILURE, "path too long for \"%s\"", path);
+}
+
+struct sar_copy * copy_open(const char *dst, unsigned int nb_workers)
+{
+  assert(dst);
+  assert(nb_workers > 0);
+
+  struct sar_copy *copy = xmalloc(sizeof(struct sar_copy));
+  unsigned int i;
+
+  memset(copy, 0, sizeof(struct sar_copy));
+
+  /* We do not complain when the destination already exists. */
+  if(mkdir(dst, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+    err(EXIT_FAILURE, "cannot create directory \"%s\"", dst);
+
+  /* the walker may change its working directory */
+  copy->dst = realpath(dst, NULL);
+  if(!copy->dst)
+    err(EXIT_FAILURE, "cannot resolve \"%s\"", dst);
+
+  copy->nb_workers = nb_workers;
+  copy->queue      = xmalloc(sizeof(struct copy_job) * COPY_QUEUE_SZ);
+  copy->workers    = xmalloc(sizeof(pthread_t) * nb_workers);
+
+  pthread_mutex_init(&copy->lock, NULL);
+  pthread_cond_init(&copy->not_empty, NULL);
+  pthread_cond_init(&copy->not_full, NULL);
+
+  for(i = 0 ; i < nb_workers ; i++) {
+    int n = pthread_create(&copy->workers[i], NULL, copy_worker, copy);
+
+    if(n) {
+      errno = n;
+      err(EXIT_FAILURE, "cannot create thread");
+    }
+  }
+
+  return copy;
+}
+
+/* Materialize a node in the destination. Small files are copied by
+   the worker pool while the walker goes on, other nodes are created
+   right away. The first file of a hard link group is always copied
+   by the walker so that the following links may point to it.
+   Directories are created writable, their attributes are restored
+   once everything else is done. */
+void copy_node(struct sar_copy *copy, const char *path,
+               const struct stat *stat, const char *hardlink)
+{
+  char dst[PATH_MAX];
+
+  copy_path(copy, dst, path);
+
+  if(hardlink) {
+    char target[PATH_MAX];
+
+    copy_path(copy, target, hardlink);
+    if(link(target, dst) < 0)
+      warn("cannot create hardlink \"%s\" to \"%s\"", dst, target);
+    return;
+  }
+
+  switch(stat->st_mode & S_IFMT) {
+    char *symlink_dst;
+    ssize_t n;
+
+  case(S_IFDIR):
+    if(mkdir(dst, S_IRWXU) < 0 && errno != EEXIST) {
+      warn("cannot create directory \"%s\"", dst);
+      return;
+    }
+
+    if(copy->nb_dirs == copy->dirs_sz) {
+      copy->dirs_sz = copy->dirs_sz ? copy->dirs_sz * 2 : COPY_DIRS_SZ;
+      copy->dirs    = xrealloc(copy->dirs,
+                               sizeof(struct copy_dir) * copy->dirs_sz);
+    }
+
+    copy->dirs[copy->nb_dirs].path = strdup(dst);
+    copy->dirs[copy->nb_dirs].stat = *stat;
+    copy->nb_dirs++;
+    return;
+  case(S_IFREG):
+    if(stat->st_size < COPY_SMALL && stat->st_nlink < 2)
+      queue_regular(copy, path, dst, stat);
+    else
+      copy_regular(path, dst, stat);
+    return;
+  case(S_IFLNK):
+    symlink_dst = readlink_malloc_n(path, &n);
+    if(!symlink_dst) {
+      warn("cannot read \"%s\"", path);
+      return;
+    }
+
+    if(symlink(symlink_dst, dst) < 0)
+      warn("cannot create symlink \"%s\" to \"%s\"", dst, symlink_dst);
+    free(symlink_dst);
+    break;
+  case(S_IFIFO):
+    if(mkfifo(dst, stat->st_mode) < 0)
+      warn("cannot create fifo \"%s\"", dst);
+    break;
+  case(S_IFCHR):
+  case(S_IFBLK):
+    if(mknod(dst, stat->st_mode, stat->st_rdev) < 0)
+      warn("cannot create device \"%s\"", dst);
+    break;
+  default:
+    warnx("ignored \"%s\", not copied", path);
+    return;
+  }
+
+  copy_attributes(dst, stat);
+}
+
+void copy_close(struct sar_copy *copy)
+{
+  assert(copy);
+
+  unsigned int i;
+
+  /* wait for the remaining small files */
+  pthread_mutex_lock(&copy->lock);
+  copy->closing = true;
+  pthread_cond_broadcast(&copy->not_empty);
+  pthread_mutex_unlock(&copy->lock);
+
+  for(i = 0 ; i < copy->nb_workers ; i++)
+    pthread_join(copy->workers[i], NULL);
+
+  /* children first so that parents keep their times */
+  while(copy->nb_dirs--) {
+    struct copy_dir *dir = &copy->dirs[copy->nb_dirs];
+
+    copy_attributes(dir->path, &dir->stat);
+    free(dir->path);
+  }
+
+  pthread_mutex_destroy(&copy->lock);
+  pthread_cond_destroy(&copy->not_empty);
+  pthread_cond_destroy(&copy->not_full);
+
+  free(copy->dst);
+  free(copy->dirs);
+  free(copy->queue);
+  free(copy->workers);
+  free(copy);
+}
@@ -0,0 +1,54 @@
+/* File: copy.h
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#ifndef _COPY_H_
+#define _COPY_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+struct sar_copy;
+
+struct sar_copy * copy_open(const char *dst, unsigned int nb_workers);
+void copy_node(struct sar_copy *copy, const char *path,
+               const struct stat *stat, const char *hardlink);
+void copy_close(struct sar_copy *copy);
+int copy_data(int in, int out, off_t size);
+int move_data(int fd, off_t from, off_t to, off_t size);
+int seek_data(int fd, off_t offset, off_t *data, off_t *hole);
+off_t clone_data(int in, int out, off_t size,
+                 uint32_t (*f_crc)(const unsigned char *s,
+                                   unsigned long len,
+                                   uint32_t crc),
+                 uint32_t *crc);
+off_t splice_data(int in, int out, off_t size);
+
+#endif /* _COPY_H_ */
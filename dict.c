@@ -0,0 +1,208 @@
+/* File: dict.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif /* HAVE_ZSTD */
+
+#include "common.h"
+#include "codec.h"
+#include "dict.h"
+
+/* This file contains the zstd dictionaries used to compress small
+   files one by one. The dictionary is trained on a sample of the
+   files and stored in the archive. Frames do not repeat the content
+   size nor the dictionary identifier as the archive knows both. */
+
+#ifdef HAVE_ZSTD
+enum dict_size { DICT_MAX = 112 * 1024 }; /* trained dictionary size */
+
+struct dict {
+  void *buffer;
+  size_t size;
+  ZSTD_CDict *cdict;
+  ZSTD_DDict *ddict;
+};
+
+struct dict_ctx {
+  struct dict *dict;
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+};
+
+bool dict_supported(void)
+{
+  return true;
+}
+
+struct dict * dict_train(const void *samples, const size_t *sizes,
+                         unsigned int nb_samples, int level)
+{
+  void *buffer = xmalloc(DICT_MAX);
+  size_t size  = ZDICT_trainFromBuffer(buffer, DICT_MAX, samples,
+                                       sizes, nb_samples);
+  struct dict *dict;
+
+  /* too few or too small samples */
+  if(ZDICT_isError(size)) {
+    free(buffer);
+    return NULL;
+  }
+
+  dict = dict_load(buffer, size, level);
+  free(buffer);
+
+  return dict;
+}
+
+struct dict * dict_load(const void *buf, size_t size, int level)
+{
+  struct dict *dict = xmalloc(sizeof(struct dict));
+
+  dict->buffer = xmalloc(size);
+  dict->size   = size;
+  memcpy(dict->buffer, buf, size);
+
+  if(level == LEVEL_DEFAULT)
+    level = ZSTD_CLEVEL_DEFAULT;
+
+  dict->cdict = ZSTD_createCDict(dict->buffer, size, level);
+  dict->ddict = ZSTD_createDDict(dict->buffer, size);
+  if(!dict->cdict || !dict->ddict)
+    errx(EXIT_FAILURE, "zstd: invalid dictionary");
+
+  return dict;
+}
+
+const void * dict_buffer(const struct dict *dict, size_t *size)
+{
+  *size = dict->size;
+  return dict->buffer;
+}
+
+void dict_free(struct dict *dict)
+{
+  ZSTD_freeCDict(dict->cdict);
+  ZSTD_freeDDict(dict->ddict);
+  free(dict->buffer);
+  free(dict);
+}
+
+struct dict_ctx * dict_ctx_new(struct dict *dict)
+{
+  struct dict_ctx *ctx = xmalloc(sizeof(struct dict_ctx));
+
+  ctx->dict = dict;
+  ctx->cctx = ZSTD_createCCtx();
+  ctx->dctx = ZSTD_createDCtx();
+  if(!ctx->cctx || !ctx->dctx)
+    errx(EXIT_FAILURE, "zstd: cannot create context");
+
+  ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_contentSizeFlag, 0);
+  ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_dictIDFlag, 0);
+  ZSTD_CCtx_refCDict(ctx->cctx, dict->cdict);
+  ZSTD_DCtx_refDDict(ctx->dctx, dict->ddict);
+
+  return ctx;
+}
+
+/* returns zero when the frame does not fit */
+size_t dict_pack(struct dict_ctx *ctx, const void *src, size_t size,
+                 void *dst, size_t max)
+{
+  size_t n = ZSTD_compress2(ctx->cctx, dst, max, src, size);
+
+  if(ZSTD_isError(n))
+    return 0;
+  return n;
+}
+
+bool dict_unpack(struct dict_ctx *ctx, const void *src, size_t size,
+                 void *dst, size_t dst_size)
+{
+  return ZSTD_decompressDCtx(ctx->dctx, dst, dst_size, src, size) == dst_size;
+}
+
+void dict_ctx_free(struct dict_ctx *ctx)
+{
+  ZSTD_freeCCtx(ctx->cctx);
+  ZSTD_freeDCtx(ctx->dctx);
+  free(ctx);
+}
+#else
+bool dict_supported(void)
+{
+  return false;
+}
+
+struct dict * dict_train(const void *samples, const size_t *sizes,
+                         unsigned int nb_samples, int level)
+{
+  return NULL;
+}
+
+struct dict * dict_load(const void *buf, size_t size, int level)
+{
+  errx(EXIT_FAILURE, "dictionaries need zstd support");
+}
+
+const void * dict_buffer(const struct dict *dict, size_t *size)
+{
+  *size = 0;
+  return NULL;
+}
+
+void dict_free(struct dict *dict) {}
+
+struct dict_ctx * dict_ctx_new(struct dict *dict)
+{
+  return NULL;
+}
+
+size_t dict_pack(struct dict_ctx *ctx, const void *src, size_t size,
+                 void *dst, size_t max)
+{
+  return 0;
+}
+
+bool dict_unpack(struct dict_ctx *ctx, const void *src, size_t size,
+                 void *dst, size_t dst_size)
+{
+  return false;
+}
+
+void dict_ctx_free(struct dict_ctx *ctx) {}
+#endif /* HAVE_ZSTD */
@@ -0,0 +1,54 @@
+/* File: dict.h
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#ifndef _DICT_H_
+#define _DICT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct dict;
+struct dict_ctx;
+
+bool dict_supported(void);
+struct dict * dict_train(const void *samples, const size_t *sizes,
+                         unsigned int nb_samples, int level);
+struct dict * dict_load(const void *buf, size_t size, int level);
+const void * dict_buffer(const struct dict *dict, size_t *size);
+void dict_free(struct dict *dict);
+
+struct dict_ctx * dict_ctx_new(struct dict *dict);
+size_t dict_pack(struct dict_ctx *ctx, const void *src, size_t size,
+                 void *dst, size_t max);
+bool dict_unpack(struct dict_ctx *ctx, const void *src, size_t size,
+                 void *dst, size_t dst_size);
+void dict_ctx_free(struct dict_ctx *ctx);
+
+#endif /* _DICT_H_ */
@@ -0,0 +1,247 @@
+/* File: fifo.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#ifdef __linux__
+/* vmsplice() and F_SETPIPE_SZ */
+# define _GNU_SOURCE 1
+#endif /* __linux__ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "common.h"
+#include "fifo.h"
+
+/* This file contains the pipes between the archive and an external
+   compressor. The pipe is grown so that the child wakes up less often
+   and the archive is written in large chunks.
+
+   On Linux the pages of the output buffers are given to the pipe with
+   vmsplice() instead of being copied. A buffer must not change while
+   its pages are still in the pipe. So the buffers are as large as the
+   pipe and used in turn. Once a buffer has been spliced entirely, the
+   pipe does not hold anything from the other one anymore. The buffers
+   are mapped rather than allocated, since the allocator may write into
+   a freed buffer whose last pages the child has not read yet. */
+
+#define PIPE_MAX_SIZE "/proc/sys/fs/pipe-max-size"
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif /* MAP_ANONYMOUS */
+
+struct fifo {
+  int fd;
+  bool write;
+  bool splice;              /* feed the pipe with vmsplice() */
+
+  unsigned char *buf[2];    /* page aligned buffers used in turn */
+  unsigned int cur;         /* buffer being filled */
+  size_t size;              /* size of each buffer */
+  size_t pos;               /* position in the current buffer */
+  size_t len;               /* bytes available when reading */
+};
+
+#ifdef F_SETPIPE_SZ
+static long pipe_max_size(void)
+{
+  long max = 0;
+  FILE *fp;
+
+  fp = fopen(PIPE_MAX_SIZE, "r");
+  if(!fp)
+    return IO_SZ;
+
+  if(fscanf(fp, "%ld", &max) != 1)
+    max = IO_SZ;
+
+  fclose(fp);
+
+  return max;
+}
+#endif /* F_SETPIPE_SZ */
+
+/* grow a pipe up to the system limit and return its size */
+size_t fifo_grow(int fd)
+{
+#ifdef F_SETPIPE_SZ
+  long size = MIN(pipe_max_size(), IO_SZ);
+
+  /* unprivileged users may be limited below the maximum */
+  for(; size > 0 ; size /= 2)
+    if(fcntl(fd, F_SETPIPE_SZ, size) >= 0)
+      break;
+
+  size = fcntl(fd, F_GETPIPE_SZ);
+  if(size > 0)
+    return size;
+#endif /* F_SETPIPE_SZ */
+
+  return IO_SZ;
+}
+
+struct fifo * fifo_open(int fd, bool write)
+{
+  struct fifo *fifo = xmalloc(sizeof(struct fifo));
+  int i;
+
+  memset(fifo, 0, sizeof(struct fifo));
+
+  fifo->fd    = fd;
+  fifo->write = write;
+  fifo->size  = fifo_grow(fd);
+
+#ifdef __linux__
+  fifo->splice = write;
+#endif /* __linux__ */
+
+  /* reading only needs one buffer */
+  for(i = 0 ; i < (write ? 2 : 1) ; i++) {
+    fifo->buf[i] = mmap(NULL, fifo->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(fifo->buf[i] == MAP_FAILED)
+      err(EXIT_FAILURE, "cannot allocate pipe buffer");
+  }
+
+  return fifo;
+}
+
+static void fifo_flush(struct fifo *fifo)
+{
+  unsigned char *p = fifo->buf[fifo->cur];
+  size_t size      = fifo->pos;
+
+#ifdef __linux__
+  while(fifo->splice && size) {
+    struct iovec iov = { .iov_base = p, .iov_len = size };
+    ssize_t n = vmsplice(fifo->fd, &iov, 1, 0);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+
+      /* not a pipe or not supported, copy the remaining bytes */
+      if(errno == EINVAL || errno == ENOSYS) {
+        fifo->splice = false;
+        break;
+      }
+
+      err(EXIT_FAILURE, "cannot write to the compressor");
+    }
+
+    p    += n;
+    size -= n;
+  }
+#endif /* __linux__ */
+
+  while(size) {
+    ssize_t n = write(fifo->fd, p, size);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      err(EXIT_FAILURE, "cannot write to the compressor");
+    }
+
+    p    += n;
+    size -= n;
+  }
+
+  fifo->cur ^= 1;
+  fifo->pos  = 0;
+}
+
+void fifo_write(struct fifo *fifo, const void *buf, size_t count)
+{
+  while(count) {
+    size_t n = MIN(count, fifo->size - fifo->pos);
+
+    memcpy(fifo->buf[fifo->cur] + fifo->pos, buf, n);
+    fifo->pos += n;
+
+    if(fifo->pos == fifo->size)
+      fifo_flush(fifo);
+
+    buf    = (const char *)buf + n;
+    count -= n;
+  }
+}
+
+/* read at most count bytes, return 0 at the end of the stream */
+size_t fifo_read(struct fifo *fifo, void *buf, size_t count)
+{
+  size_t n;
+
+  if(fifo->pos == fifo->len) {
+    ssize_t r;
+
+    do
+      r = read(fifo->fd, fifo->buf[0], fifo->size);
+    while(r < 0 && errno == EINTR);
+
+    if(r < 0)
+      err(EXIT_FAILURE, "cannot read from the decompressor");
+    if(r == 0)
+      return 0;
+
+    fifo->pos = 0;
+    fifo->len = r;
+  }
+
+  n = MIN(count, fifo->len - fifo->pos);
+  memcpy(buf, fifo->buf[0] + fifo->pos, n);
+  fifo->pos += n;
+
+  return n;
+}
+
+/* flush and close the pipe so that the child sees the end of stream */
+void fifo_close(struct fifo *fifo)
+{
+  if(fifo->write && fifo->pos)
+    fifo_flush(fifo);
+
+  close(fifo->fd);
+
+  /* the pages still in the pipe are kept until the child reads them */
+  munmap(fifo->buf[0], fifo->size);
+  if(fifo->write)
+    munmap(fifo->buf[1], fifo->size);
+  free(fifo);
+}
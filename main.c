@@ -41,13 +41,22 @@
 #include <gawen/help.h>
 
 #include "sar.h"
+#include "codec.h"
+#include "dict.h"
 #include "common.h"
 
 enum mode { MD_NONE = 0,
             MD_INFORMATION,
             MD_CREATE,
             MD_EXTRACT,
-            MD_LIST };
+            MD_LIST,
+            MD_COPY,
+            MD_TRANSCODE,
+            MD_INDEX,
+            MD_CAT,
+            MD_APPEND,
+            MD_DELETE,
+            MD_COMPACT };
 
 struct opts_val {
   unsigned int verbose;
@@ -56,12 +65,20 @@ struct opts_val {
   bool use_file;
   bool no_crc;
   bool no_nano;
+  unsigned int shards;
+  uint64_t budget;     /* bytes moved by a compaction */
+  bool ranged;         /* nodes read from the markers of a range */
+  uint64_t range_start;
+  uint64_t range_end;
+  bool salvage;        /* damaged regions skipped */
 
   char *cwd;           /* original cwd */
   const char *tmp_cwd; /* new cwd */
-  const char *compress;
+  struct sar_compress compress;
   const char *file;
-  const char *source;
+  const char *destination;
+  char * const *sources;
+  unsigned int nb_sources;
 };
 
 static struct opts_val *opt_value;
@@ -81,41 +98,84 @@ static void version()
   exit(EXIT_SUCCESS);
 }
 
+/* use an external compressor or the in-process codec replacing it */
+static void use_compressor(struct opts_val *val, const char *program)
+{
+  val->compress.program   = program;
+  val->compress.codec     = codec_find(program);
+  val->compress.automatic = false;
+}
+
+/* the archive name may be followed by paths or patterns to select */
 static void except_archive(int argc, int optind, char *argv[],
                            struct opts_val *val)
 {
   if(val->use_file) {
-    if(argc - optind != 1)
+    if(argc - optind < 1)
       errx(EXIT_FAILURE, "except archive name");
-    val->file = argv[optind];
+    val->file = argv[optind++];
   }
-  else if(argc - optind)
-    errx(EXIT_FAILURE, "except no arguments");
   else
     val->file = NULL;
+
+  val->sources    = argv + optind;
+  val->nb_sources = argc - optind;
 }
 
 static void except_more(int argc, int optind, char *argv[],
                         struct opts_val *val)
 {
   if(val->use_file) {
-    if(argc - optind != 2)
-      errx(EXIT_FAILURE, "except archive name and a path to archive");
-    val->file   = argv[optind++];
-    val->source = argv[optind];
-  }
-  else if(argc - optind != 1)
-    errx(EXIT_FAILURE, "except a path to archive");
-  else {
-    val->file   = NULL;
-    val->source = argv[optind];
+    if(argc - optind < 2)
+      errx(EXIT_FAILURE, "except archive name and paths to archive");
+    val->file = argv[optind++];
   }
+  else if(argc - optind < 1)
+    errx(EXIT_FAILURE, "except paths to archive");
+  else
+    val->file = NULL;
+
+  val->sources    = argv + optind;
+  val->nb_sources = argc - optind;
+}
+
+/* the nodes may be read from the markers of the archive */
+static void read_markers(struct sar_file *f, const struct opts_val *val)
+{
+  if(val->ranged)
+    sar_range(f, val->range_start, val->range_end);
+  else if(val->salvage)
+    sar_salvage(f);
 }
 
 static void cmdline(int argc, char *argv[], struct opts_val *val)
 {
   int exit_status = EXIT_FAILURE;
   enum opt { OPT_COMPRESS,
+             OPT_SHARDS,
+             OPT_COPY,
+             OPT_TRANSCODE,
+             OPT_INDEX,
+             OPT_CAT,
+             OPT_DELETE,
+             OPT_COMPACT,
+             OPT_COMPRESS_JOBS,
+             OPT_COMPRESS_LEVEL,
+             OPT_COMPRESS_THREADS,
+             OPT_COMPRESS_LONG,
+             OPT_COMPRESS_ADAPT,
+             OPT_BLOCK_SIZE,
+             OPT_DICTIONARY,
+             OPT_GROUP,
+             OPT_COLUMNS,
+             OPT_TOC,
+             OPT_SYNC,
+             OPT_ALIGN,
+             OPT_SPARSE,
+             OPT_RANGE,
+             OPT_SALVAGE,
+             OPT_ZSTD,
+             OPT_LZ4,
              OPT_LZMA,
              OPT_LZIP,
              OPT_LZOP,
@@ -132,6 +192,7 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
              OPT_VERBOSE     = 'v',
              OPT_INFORMATION = 'i',
              OPT_CREATE      = 'c',
+             OPT_APPEND      = 'r',
              OPT_EXTRACT     = 'x',
              OPT_LIST        = 't',
              OPT_FILE        = 'f',
@@ -146,7 +207,7 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
     { 'h', "help",        "Print this message" },
     { 'v', "verbose",     "Be verbose (may be used multiple times)" },
     { 'd', "directory",   "Change to directory DIR" },
-    { 0  , "compress",    "Compress using the specified executable" },
+    { 0  , "compress",    "Compress using an executable or auto[:MiB/s]" },
     { 'Z', "lzw",         "Alias for '--compress compress'" },
     { 'z', "gzip",        "Alias for '--compress gzip'" },
     { 'j', "bzip2",       "Alias for '--compress bzip2'" },
@@ -154,13 +215,38 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
     { 0  , "lzma",        "Alias for '--compress lzma'" },
     { 0  , "lzip",        "Alias for '--compress lzip'" },
     { 0  , "lzop",        "Alias for '--compress lzop'" },
+    { 0  , "zstd",        "Alias for '--compress zstd'" },
+    { 0  , "lz4",         "Alias for '--compress lz4'" },
+    { 0  , "compress-jobs", "Run N compressors on segments of the archive" },
+    { 0  , "compress-level", "Compression level of built-in codecs" },
+    { 0  , "compress-threads", "Threads used by built-in codecs" },
+    { 0  , "compress-long", "Long range matching for built-in zstd" },
+    { 0  , "compress-adapt", "Adapt the level of blocks to the output [MIN:MAX]" },
+    { 0  , "block-size",  "Compress independent blocks of N MiB" },
+    { 0  , "dictionary",  "Compress small files alone with a zstd dictionary" },
+    { 0  , "group",       "Group files by extension and size in directories" },
+    { 0  , "columns",     "Store metadata in columns, paths walked in turn" },
+    { 0  , "toc",         "Append a table of contents for random access" },
+    { 0  , "sync",        "Write markers every N MiB, paths walked in turn [4]" },
+    { 0  , "align",       "Align large payloads on N KiB, paths walked in turn [4]" },
+    { 0  , "sparse",      "Store the data of sparse files, or with N KiB of zeros" },
+    { 0  , "range",       "Read the nodes from the markers within START:END" },
+    { 0  , "salvage",     "Skip the damaged regions between markers" },
     { 'i', "information", "Display basic informations about an archive" },
     { 'c', "create",      "Create a new archive" },
+    { 'r', "append",      "Append paths to an uncompressed or block archive" },
     { 'x', "extract",     "Extract all files from an archive" },
     { 't',  "list",       "List all files in an archive" },
+    { 0,    "copy",       "Copy paths into the last directory given" },
+    { 0,    "transcode",  "Rewrite an archive into another one" },
+    { 0,    "index",      "Index the nodes of an archive in a sidecar file" },
+    { 0,    "cat",        "Write the selected files to the standard output" },
+    { 0,    "delete",     "Delete the selected files of an uncompressed archive" },
+    { 0,    "compact",    "Give back the space of deleted files [MiB moved]" },
     { 'f',  "file",       "Use a file instead of standard input/output" },
     { 'C',  "no-crc",     "Disable integrity checks" },
     { 'N',  "no-nano",    "Disable timestamps precision (upto nanoseconds)" },
+    { 0,    "shards",     "Split the archive in N files of equal size" },
     { 0, NULL, NULL }
   };
 
@@ -180,13 +266,38 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
     { "lzma", no_argument, NULL, OPT_LZMA },
     { "lzip", no_argument, NULL, OPT_LZIP },
     { "lzop", no_argument, NULL, OPT_LZOP },
+    { "zstd", no_argument, NULL, OPT_ZSTD },
+    { "lz4", no_argument, NULL, OPT_LZ4 },
+    { "compress-jobs", required_argument, NULL, OPT_COMPRESS_JOBS },
+    { "compress-level", required_argument, NULL, OPT_COMPRESS_LEVEL },
+    { "compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS },
+    { "compress-long", no_argument, NULL, OPT_COMPRESS_LONG },
+    { "compress-adapt", optional_argument, NULL, OPT_COMPRESS_ADAPT },
+    { "block-size", required_argument, NULL, OPT_BLOCK_SIZE },
+    { "dictionary", no_argument, NULL, OPT_DICTIONARY },
+    { "group", no_argument, NULL, OPT_GROUP },
+    { "columns", no_argument, NULL, OPT_COLUMNS },
+    { "toc", no_argument, NULL, OPT_TOC },
+    { "sync", optional_argument, NULL, OPT_SYNC },
+    { "align", optional_argument, NULL, OPT_ALIGN },
+    { "sparse", optional_argument, NULL, OPT_SPARSE },
+    { "range", required_argument, NULL, OPT_RANGE },
+    { "salvage", no_argument, NULL, OPT_SALVAGE },
     { "information", no_argument, NULL, OPT_INFORMATION },
     { "create", no_argument, NULL, OPT_CREATE },
+    { "append", no_argument, NULL, OPT_APPEND },
     { "extract", no_argument, NULL, OPT_EXTRACT },
     { "list", no_argument, NULL, OPT_LIST },
+    { "copy", no_argument, NULL, OPT_COPY },
+    { "transcode", no_argument, NULL, OPT_TRANSCODE },
+    { "index", no_argument, NULL, OPT_INDEX },
+    { "cat", no_argument, NULL, OPT_CAT },
+    { "delete", no_argument, NULL, OPT_DELETE },
+    { "compact", optional_argument, NULL, OPT_COMPACT },
     { "file", no_argument, NULL, OPT_FILE },
     { "no-crc", no_argument, NULL, OPT_NO_CRC },
     { "no-nano", no_argument, NULL, OPT_NO_NANO },
+    { "shards", required_argument, NULL, OPT_SHARDS },
     { NULL, 0, NULL, 0 }
   };
 
@@ -195,7 +306,7 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
   pgn = pgn ? (pgn + 1) : argv[0];
 
   while(1) {
-    int c = getopt_long(argc, argv, "Vhvd:ZzjJicxtfCN", opts, NULL);
+    int c = getopt_long(argc, argv, "Vhvd:ZzjJicrxtfCN", opts, NULL);
 
     if(c == -1)
       break;
@@ -205,7 +316,23 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
       val->verbose++;
       break;
     case OPT_COMPRESS:
-      val->compress = optarg;
+      val->compress.program   = optarg;
+      val->compress.codec     = NULL;
+      val->compress.automatic = false;
+
+      /* auto[:target] samples the sources to choose a codec */
+      if(!strncmp(optarg, "auto", 4) &&
+         (optarg[4] == '\0' || optarg[4] == ':')) {
+        val->compress.program   = NULL;
+        val->compress.automatic = true;
+        val->compress.target    = 0;
+
+        if(optarg[4] == ':') {
+          val->compress.target = atoi(optarg + 5);
+          if(val->compress.target == 0)
+            errx(EXIT_FAILURE, "invalid target speed");
+        }
+      }
       break;
     case OPT_DIRECTORY:
       val->cwd     = xmalloc(PATH_MAX);
@@ -213,25 +340,31 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
       val->tmp_cwd = optarg;
       break;
     case OPT_GZIP:
-      val->compress = "gzip";
+      use_compressor(val, "gzip");
       break;
     case OPT_BZIP2:
-      val->compress = "bzip2";
+      use_compressor(val, "bzip2");
       break;
     case OPT_XZ:
-      val->compress = "xz";
+      use_compressor(val, "xz");
+      break;
+    case OPT_ZSTD:
+      use_compressor(val, "zstd");
+      break;
+    case OPT_LZ4:
+      use_compressor(val, "lz4");
       break;
     case OPT_LZMA:
-      val->compress = "lzma";
+      use_compressor(val, "lzma");
       break;
     case OPT_LZIP:
-      val->compress = "lzip";
+      use_compressor(val, "lzip");
       break;
     case OPT_LZOP:
-      val->compress = "lzop";
+      use_compressor(val, "lzop");
       break;
     case OPT_LZW:
-      val->compress = "compress";
+      use_compressor(val, "compress");
       break;
     case OPT_INFORMATION:
       val->mode = MD_INFORMATION;
@@ -239,6 +372,9 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
     case OPT_CREATE:
       val->mode = MD_CREATE;
       break;
+    case OPT_APPEND:
+      val->mode = MD_APPEND;
+      break;
     case OPT_EXTRACT:
       val->mode = MD_EXTRACT;
       break;
@@ -246,6 +382,30 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
       val->mode = MD_LIST;
       val->verbose++;
       break;
+    case OPT_COPY:
+      val->mode = MD_COPY;
+      break;
+    case OPT_TRANSCODE:
+      val->mode = MD_TRANSCODE;
+      break;
+    case OPT_INDEX:
+      val->mode = MD_INDEX;
+      break;
+    case OPT_CAT:
+      val->mode = MD_CAT;
+      break;
+    case OPT_DELETE:
+      val->mode = MD_DELETE;
+      break;
+    case OPT_COMPACT:
+      val->mode = MD_COMPACT;
+      if(optarg) {
+        val->budget = atoi(optarg);
+        if(val->budget == 0)
+          errx(EXIT_FAILURE, "invalid compaction budget");
+        val->budget *= 1024 * 1024;
+      }
+      break;
     case OPT_FILE:
       val->use_file = true;
       break;
@@ -255,6 +415,100 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
     case OPT_NO_NANO:
       val->no_nano    = true;
       break;
+    case OPT_COMPRESS_JOBS:
+      val->compress.jobs = atoi(optarg);
+      if(val->compress.jobs == 0)
+        errx(EXIT_FAILURE, "invalid number of compressor jobs");
+      break;
+    case OPT_COMPRESS_LEVEL: {
+      char *end;
+
+      /* zero is a level of its own for some codecs */
+      val->compress.level = strtol(optarg, &end, 10);
+      if(end == optarg || *end || val->compress.level < 0)
+        errx(EXIT_FAILURE, "invalid compression level");
+      break;
+    }
+    case OPT_COMPRESS_THREADS:
+      val->compress.threads = atoi(optarg);
+      if(val->compress.threads == 0)
+        errx(EXIT_FAILURE, "invalid number of compression threads");
+      break;
+    case OPT_COMPRESS_LONG:
+      val->compress.long_window = true;
+      break;
+    case OPT_COMPRESS_ADAPT:
+      val->compress.adapt = true;
+      if(optarg &&
+         (sscanf(optarg, "%d:%d", &val->compress.adapt_min,
+                 &val->compress.adapt_max) != 2 ||
+          val->compress.adapt_min < 0 ||
+          val->compress.adapt_max < val->compress.adapt_min))
+        errx(EXIT_FAILURE, "invalid range of compression levels");
+      break;
+    case OPT_DICTIONARY:
+      val->compress.dictionary = true;
+      break;
+    case OPT_GROUP:
+      val->compress.group = true;
+      break;
+    case OPT_COLUMNS:
+      val->compress.columns = true;
+      break;
+    case OPT_TOC:
+      val->compress.toc = true;
+      break;
+    case OPT_SYNC:
+      val->compress.sync = SYNC_SPAN / (1024 * 1024);
+      if(optarg) {
+        val->compress.sync = atoi(optarg);
+        if(val->compress.sync == 0)
+          errx(EXIT_FAILURE, "invalid span of synchronization markers");
+      }
+      break;
+    case OPT_ALIGN:
+      val->compress.align = ALIGN_SIZE / 1024;
+      if(optarg) {
+        val->compress.align = atoi(optarg);
+        if(val->compress.align == 0 ||
+           val->compress.align > ALIGN_MAX / 1024)
+          errx(EXIT_FAILURE, "invalid alignment of payloads");
+      }
+      break;
+    case OPT_SPARSE:
+      val->compress.sparse = true;
+      if(optarg) {
+        val->compress.zero_block = atoi(optarg);
+        if(val->compress.zero_block == 0 ||
+           val->compress.zero_block > IO_SZ / 1024)
+          errx(EXIT_FAILURE, "invalid size of zero blocks");
+      }
+      break;
+    case OPT_RANGE: {
+      unsigned long long start, end;
+
+      if(sscanf(optarg, "%llu:%llu", &start, &end) != 2 || start >= end)
+        errx(EXIT_FAILURE, "invalid range");
+
+      val->ranged      = true;
+      val->range_start = start;
+      val->range_end   = end;
+      break;
+    }
+    case OPT_SALVAGE:
+      val->salvage = true;
+      break;
+    case OPT_BLOCK_SIZE:
+      val->compress.block_size = atoi(optarg);
+      if(val->compress.block_size == 0 || val->compress.block_size > 1024)
+        errx(EXIT_FAILURE, "invalid block size");
+      val->compress.block_size *= 1024 * 1024;
+      break;
+    case OPT_SHARDS:
+      val->shards = atoi(optarg);
+      if(val->shards == 0)
+        errx(EXIT_FAILURE, "invalid number of shards");
+      break;
 #ifdef COMMIT
     case OPT_COMMIT:
       printf("Commit-Id SHA1 : " COMMIT "\n");
@@ -274,7 +528,7 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
   /* consider remaining arguments */
   switch(val->mode) {
   case(MD_NONE):
-    errx(EXIT_SUCCESS, "You must specify one of the 'cxti' options\n"
+    errx(EXIT_SUCCESS, "You must specify one of the 'crxti', 'copy', 'transcode', 'index', 'cat', 'delete' or 'compact' options\n"
          "Try '%s --help'", pgn);
   case(MD_INFORMATION):
     if(val->use_file) {
@@ -290,61 +544,296 @@ static void cmdline(int argc, char *argv[], struct opts_val *val)
   case(MD_CREATE):
     except_more(argc, optind, argv, val);
     break;
+  case(MD_APPEND):
+    /* the archive is cut and written in place */
+    if(!val->use_file)
+      errx(EXIT_FAILURE, "Option 'r' is only available with 'f' option\n"
+           "Try '%s --help'", pgn);
+    except_more(argc, optind, argv, val);
+    break;
   case(MD_LIST):
   case(MD_EXTRACT):
     except_archive(argc, optind, argv, val);
     break;
+  case(MD_COPY):
+    if(val->use_file || val->compress.program)
+      errx(EXIT_FAILURE, "Options 'f' and compression are not available "
+           "with 'copy' option\n"
+           "Try '%s --help'", pgn);
+    if(argc - optind < 2)
+      errx(EXIT_FAILURE, "except paths to copy and a destination");
+    val->sources     = argv + optind;
+    val->nb_sources  = argc - optind - 1;
+    val->destination = argv[argc - 1];
+    break;
+  case(MD_TRANSCODE):
+    /* '-' stands for the standard input or output */
+    if(val->use_file || argc - optind != 2)
+      errx(EXIT_FAILURE, "except source and destination archives");
+    val->file        = strcmp(argv[optind], "-") ? argv[optind] : NULL;
+    val->destination = strcmp(argv[optind + 1], "-") ? argv[optind + 1] : NULL;
+    break;
+  case(MD_INDEX):
+    /* the index is written beside the archive */
+    if(argc - optind != 1)
+      errx(EXIT_FAILURE, "except archive name");
+    val->file = argv[optind];
+    break;
+  case(MD_CAT):
+    except_archive(argc, optind, argv, val);
+    if(!val->nb_sources)
+      errx(EXIT_FAILURE, "except paths to write out");
+    break;
+  case(MD_DELETE):
+    /* the archive is written in place */
+    if(argc - optind < 2)
+      errx(EXIT_FAILURE, "except archive name and paths to delete");
+    val->file       = argv[optind];
+    val->sources    = argv + optind + 1;
+    val->nb_sources = argc - optind - 1;
+    break;
+  case(MD_COMPACT):
+    if(argc - optind != 1)
+      errx(EXIT_FAILURE, "except archive name");
+    val->file = argv[optind];
+    break;
   }
 
   if((val->no_crc || val->no_nano) &&
-     !(val->mode == MD_CREATE))
+     !(val->mode == MD_CREATE || val->mode == MD_TRANSCODE))
     errx(EXIT_FAILURE, "Options 'CN' are only availables with 'c' option\n"
          "Try '%s --help'", pgn);
+
+  /* several compressor children are always external */
+  if(val->compress.jobs > 1)
+    val->compress.codec = NULL;
+
+  /* only the zstd stream has a long window */
+  if(val->compress.long_window &&
+     (!val->compress.codec || strcmp(codec_name(val->compress.codec), "zstd") ||
+      val->compress.block_size))
+    errx(EXIT_FAILURE, "Option 'compress-long' is only available with the "
+         "built-in zstd codec without blocks\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.automatic && val->mode != MD_CREATE)
+    errx(EXIT_FAILURE, "Automatic compression is only available with 'c' "
+         "option\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.block_size &&
+     !((val->mode == MD_CREATE || val->mode == MD_TRANSCODE) &&
+       (val->compress.codec || val->compress.automatic)))
+    errx(EXIT_FAILURE, "Option 'block-size' is only available with 'c' option "
+         "and a built-in codec\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.adapt && !val->compress.block_size)
+    errx(EXIT_FAILURE, "Option 'compress-adapt' is only available with "
+         "'block-size' option\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.dictionary && val->mode != MD_CREATE)
+    errx(EXIT_FAILURE, "Option 'dictionary' is only available with 'c' option\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.group &&
+     !(val->mode == MD_CREATE || val->mode == MD_APPEND))
+    errx(EXIT_FAILURE, "Option 'group' is only available with 'cr' options\n"
+         "Try '%s --help'", pgn);
+
+  /* the compression of the archive is kept */
+  if(val->compress.program && val->mode == MD_APPEND)
+    errx(EXIT_FAILURE, "Compression is not available with 'r' option\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.columns &&
+     !(val->mode == MD_CREATE || val->mode == MD_TRANSCODE))
+    errx(EXIT_FAILURE, "Option 'columns' is only available with 'c' option\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.toc &&
+     !(val->mode == MD_CREATE || val->mode == MD_TRANSCODE))
+    errx(EXIT_FAILURE, "Option 'toc' is only available with 'c' option\n"
+         "Try '%s --help'", pgn);
+
+  /* the table of contents is found by seeking to the end */
+  if(val->compress.toc &&
+     (((val->compress.program || val->compress.automatic) &&
+       !val->compress.block_size) || val->compress.columns))
+    errx(EXIT_FAILURE, "Option 'toc' is only available with uncompressed "
+         "or block archives without columns\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.sync &&
+     !(val->mode == MD_CREATE || val->mode == MD_APPEND ||
+       val->mode == MD_TRANSCODE))
+    errx(EXIT_FAILURE, "Option 'sync' is only available with 'cr' options\n"
+         "Try '%s --help'", pgn);
+
+  /* markers give the offset of the nodes in the archive stream */
+  if(val->compress.sync && val->compress.columns)
+    errx(EXIT_FAILURE, "Option 'sync' is not available with 'columns' "
+         "option\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.align &&
+     !(val->mode == MD_CREATE || val->mode == MD_APPEND ||
+       val->mode == MD_TRANSCODE))
+    errx(EXIT_FAILURE, "Option 'align' is only available with 'cr' options\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.sparse &&
+     !(val->mode == MD_CREATE || val->mode == MD_APPEND))
+    errx(EXIT_FAILURE, "Option 'sparse' is only available with 'cr' options\n"
+         "Try '%s --help'", pgn);
+
+  /* the payloads must stay where they were written */
+  if(val->compress.align &&
+     (val->compress.program || val->compress.codec ||
+      val->compress.automatic || val->compress.block_size ||
+      val->compress.columns))
+    errx(EXIT_FAILURE, "Option 'align' is only available with uncompressed "
+         "archives without columns\n"
+         "Try '%s --help'", pgn);
+
+  if((val->ranged || val->salvage) &&
+     !(val->mode == MD_EXTRACT || val->mode == MD_LIST ||
+       val->mode == MD_CAT))
+    errx(EXIT_FAILURE, "Options 'range' and 'salvage' are only available "
+         "with 'xt' and 'cat' options\n"
+         "Try '%s --help'", pgn);
+
+  if(val->ranged && val->salvage)
+    errx(EXIT_FAILURE, "Options 'range' and 'salvage' cannot be used "
+         "together\n"
+         "Try '%s --help'", pgn);
+
+  if(val->compress.dictionary && !dict_supported())
+    errx(EXIT_FAILURE, "dictionaries need zstd support");
+
+  if(val->shards && !(val->mode == MD_CREATE && val->file))
+    errx(EXIT_FAILURE, "Option 'shards' is only available with 'cf' options\n"
+         "Try '%s --help'", pgn);
 }
 
 int main(int argc, char *argv[])
 {
   struct opts_val val = {0};
   struct sar_file *f  = NULL;
+  int status          = EXIT_SUCCESS;
 
   opt_value = &val;
   atexit(clean_exit);
 
+  val.compress.level     = LEVEL_DEFAULT;
+  val.compress.adapt_min = LEVEL_DEFAULT;
+  val.compress.adapt_max = LEVEL_DEFAULT;
+
   cmdline(argc, argv, &val);
 
   switch(val.mode) {
   case(MD_NONE):
     break;
   case(MD_INFORMATION):
-    f = sar_read(val.file, val.compress, val.verbose);
+    f = sar_read(val.file, &val.compress, val.verbose);
     sar_info(f);
     break;
   case(MD_CREATE):
-    f = sar_creat(val.file,
-                  val.compress,
-                  !val.no_crc,
-                  !val.no_nano,
-                  val.verbose);
+    /* the sources are relative to the directory given */
+    if(val.compress.automatic) {
+      if(val.tmp_cwd)
+        xchdir(val.tmp_cwd);
+      sar_auto(&val.compress, val.sources, val.nb_sources);
+      if(val.tmp_cwd)
+        xchdir(val.cwd);
+    }
+
+    if(val.shards)
+      f = sar_creat_shards(val.file,
+                           val.shards,
+                           &val.compress,
+                           !val.no_crc,
+                           !val.no_nano,
+                           val.verbose);
+    else
+      f = sar_creat(val.file,
+                    &val.compress,
+                    !val.no_crc,
+                    !val.no_nano,
+                    val.verbose);
+    if(val.tmp_cwd)
+      xchdir(val.tmp_cwd);
+    sar_add(f, val.sources, val.nb_sources);
+    break;
+  case(MD_APPEND):
+    f = sar_append(val.file, &val.compress, val.verbose);
     if(val.tmp_cwd)
       xchdir(val.tmp_cwd);
-    sar_add(f, val.source);
+    sar_add(f, val.sources, val.nb_sources);
     break;
   case(MD_EXTRACT):
-    f = sar_read(val.file, val.compress, val.verbose);
+    f = sar_read(val.file, &val.compress, val.verbose);
     if(val.tmp_cwd)
       xchdir(val.tmp_cwd);
+    sar_select(f, val.sources, val.nb_sources);
+    read_markers(f, &val);
     sar_extract(f);
     break;
   case(MD_LIST):
-    f = sar_read(val.file, val.compress, val.verbose);
+    f = sar_read(val.file, &val.compress, val.verbose);
     if(val.tmp_cwd)
       xchdir(val.tmp_cwd);
+    sar_select(f, val.sources, val.nb_sources);
+    read_markers(f, &val);
     sar_list(f);
     break;
+  case(MD_TRANSCODE): {
+    /* the compression of the source is recognized on read */
+    struct sar_compress source = { .threads = val.compress.threads };
+    struct sar_file *in = sar_read(val.file, &source, 0);
+
+    f = sar_creat(val.destination,
+                  &val.compress,
+                  !val.no_crc,
+                  !val.no_nano,
+                  val.verbose);
+    sar_transcode(in, f);
+    sar_close(in);
+    break;
+  }
+  case(MD_INDEX):
+    f = sar_read(val.file, &val.compress, val.verbose);
+    sar_index(f);
+    break;
+  case(MD_CAT):
+    f = sar_read(val.file, &val.compress, val.verbose);
+    sar_select(f, val.sources, val.nb_sources);
+    read_markers(f, &val);
+    sar_cat(f);
+    break;
+  case(MD_DELETE):
+    f = sar_rewrite(val.file, val.verbose);
+    sar_select(f, val.sources, val.nb_sources);
+    sar_delete(f);
+    break;
+  case(MD_COMPACT):
+    f = sar_rewrite(val.file, val.verbose);
+    sar_compact(f, val.budget);
+    break;
+  case(MD_COPY):
+    f = sar_copy(val.destination, val.verbose);
+    if(val.tmp_cwd)
+      xchdir(val.tmp_cwd);
+    sar_add(f, val.sources, val.nb_sources);
+    break;
   }
 
-  if(val.mode != MD_NONE)
+  if(val.mode != MD_NONE) {
+    if(sar_failed(f))
+      status = EXIT_FAILURE;
     sar_close(f);
+  }
 
-  exit(EXIT_SUCCESS);
+  exit(status);
 }
@@ -0,0 +1,476 @@
+/* File: parallel.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <err.h>
+
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif /* __FreeBSD__ */
+
+#include "common.h"
+#include "parallel.h"
+
+/* This file contains the parallel external compression. The serialized
+   stream is cut into segments, each segment is compressed by its own
+   compressor child and the members are concatenated in order. Gzip,
+   bzip2, xz, lzip and zstd all decompress such a concatenation.
+
+   Gzip and zstd members are annotated with their size, in a gzip extra
+   field or in a zstd skippable frame, so that the decompression may be
+   split in the same way. Other streams are decompressed sequentially. */
+
+#define GZIP_ID1    0x1f
+#define GZIP_ID2    0x8b
+#define GZIP_FEXTRA 0x4
+#define ZSTD_SKIP   0x184d2a5a /* skippable frame magic (user defined) */
+#define ZSTD_MAGIK  0xfd2fb528
+
+enum psize { SEGMENT_SZ = 8 * 1024 * 1024, /* uncompressed segment size */
+             GZIP_HDR   = 10,              /* gzip fixed header */
+             GZIP_SA    = 14,              /* xlen and 'SA' subfield */
+             ZSTD_HDR   = 16 };            /* annotation skippable frame */
+
+struct slot {
+  pid_t pid;  /* compressor child */
+  int in;     /* segment to (de)compress */
+  int out;    /* (de)compressed segment */
+};
+
+struct parallel {
+  pthread_t thread;
+  const char *compress;  /* compressor executable */
+  unsigned int nb_jobs;  /* number of compressor children */
+  struct slot *slots;    /* one slot per child */
+  int in;                /* stream to read */
+  int out;               /* stream to write */
+  int status;            /* non zero on failure */
+};
+
+/* compressors known to decompress concatenated members */
+static const char *concat_compressors[] = { "gzip", "pigz", "bzip2",
+                                            "pbzip2", "lbzip2", "xz",
+                                            "pixz", "lzip", "plzip",
+                                            "zstd", "pzstd", NULL };
+
+/* execute a compressor reading from in and writing to out */
+static pid_t spawn_compressor(const char *compress, bool decompress,
+                       int in, int out)
+{
+  pid_t pid = xfork();
+
+  if(!pid) /* child */ {
+    xdup2(in, STDIN_FILENO);
+    xdup2(out, STDOUT_FILENO);
+
+    if(decompress)
+      execlp(compress, compress, "-d", NULL);
+    else
+      execlp(compress, compress, NULL);
+    err(EXIT_FAILURE, "cannot execute \"%s\"", compress);
+  }
+
+  return pid;
+}
+
+bool parallel_supported(const char *compress)
+{
+  const char **c;
+  const char *name = strrchr(compress, '/');
+
+  name = name ? (name + 1) : compress;
+
+  for(c = concat_compressors ; *c ; c++)
+    if(strtest(*c, name))
+      return true;
+
+  return false;
+}
+
+/* read until count bytes or the end of file */
+static size_t read_full(int fd, void *buf, size_t count)
+{
+  size_t index = 0;
+
+  while(index < count) {
+    ssize_t n = xread(fd, (char *)buf + index, count - index);
+
+    if(n == 0)
+      break;
+
+    index += n;
+  }
+
+  return index;
+}
+
+static void write_full(int fd, const void *buf, size_t count)
+{
+  while(count) {
+    ssize_t n = write(fd, buf, count);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      err(EXIT_FAILURE, "IO write error");
+    }
+
+    buf    = (const char *)buf + n;
+    count -= n;
+  }
+}
+
+/* copy a file from its start to fd */
+static void copy_file(int from, int fd, off_t size)
+{
+  char *iobuf = xmalloc(IO_SZ);
+
+  while(size > 0) {
+    size_t n = read_full(from, iobuf, MIN(size, IO_SZ));
+
+    if(n == 0)
+      errx(EXIT_FAILURE, "truncated temporary file");
+
+    write_full(fd, iobuf, n);
+    size -= n;
+  }
+
+  free(iobuf);
+}
+
+static void rewind_slot(struct slot *slot)
+{
+  if(ftruncate(slot->in, 0) < 0 || ftruncate(slot->out, 0) < 0 ||
+     lseek(slot->in, 0, SEEK_SET) < 0 || lseek(slot->out, 0, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot reset temporary files");
+}
+
+/* start a compressor on the segment stored in this slot */
+static void dispatch(struct parallel *p, struct slot *slot, bool decompress)
+{
+  if(lseek(slot->in, 0, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek temporary file");
+
+  slot->pid = spawn_compressor(p->compress, decompress, slot->in, slot->out);
+}
+
+/* wait for the compressor of this slot
+   and return the size of its output */
+static off_t wait_slot(struct parallel *p, struct slot *slot)
+{
+  int status;
+  off_t size;
+
+  if(waitpid(slot->pid, &status, 0) < 0 || status)
+    p->status = 1;
+  slot->pid = 0;
+
+  size = lseek(slot->out, 0, SEEK_END);
+  if(size < 0 || lseek(slot->out, 0, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek temporary file");
+
+  return size;
+}
+
+/* write a compressed member annotated with its size */
+static void retire_compress(struct parallel *p, struct slot *slot)
+{
+  unsigned char hdr[GZIP_HDR];
+  off_t size = wait_slot(p, slot);
+  size_t n   = read_full(slot->out, hdr, MIN(size, GZIP_HDR));
+
+  if(n == GZIP_HDR && hdr[0] == GZIP_ID1 && hdr[1] == GZIP_ID2 &&
+     !(hdr[3] & GZIP_FEXTRA)) {
+    /* XLEN, SI1, SI2, LEN and the member size */
+    unsigned char extra[GZIP_SA];
+    uint16_t xlen    = htole16(GZIP_SA - 2);
+    uint16_t len     = htole16(sizeof(uint64_t));
+    uint64_t s_size  = htole64(size + GZIP_SA);
+
+    memcpy(extra, &xlen, sizeof(xlen));
+    extra[2] = 'S';
+    extra[3] = 'A';
+    memcpy(extra + 4, &len, sizeof(len));
+    memcpy(extra + 6, &s_size, sizeof(s_size));
+
+    hdr[3] |= GZIP_FEXTRA;
+    write_full(p->out, hdr, n);
+    write_full(p->out, extra, GZIP_SA);
+  }
+  else if(n >= sizeof(uint32_t) &&
+          le32toh(*(uint32_t *)hdr) == ZSTD_MAGIK) {
+    unsigned char skip[ZSTD_HDR];
+    uint32_t magik  = htole32(ZSTD_SKIP);
+    uint32_t len    = htole32(sizeof(uint64_t));
+    uint64_t s_size = htole64(size);
+
+    memcpy(skip, &magik, sizeof(magik));
+    memcpy(skip + 4, &len, sizeof(len));
+    memcpy(skip + 8, &s_size, sizeof(s_size));
+
+    write_full(p->out, skip, ZSTD_HDR);
+    write_full(p->out, hdr, n);
+  }
+  else
+    write_full(p->out, hdr, n);
+
+  copy_file(slot->out, p->out, size - n);
+  rewind_slot(slot);
+}
+
+static void retire_decompress(struct parallel *p, struct slot *slot)
+{
+  off_t size = wait_slot(p, slot);
+
+  copy_file(slot->out, p->out, size);
+  rewind_slot(slot);
+}
+
+static void * compress_thread(void *arg)
+{
+  struct parallel *p = arg;
+  char *segment = xmalloc(SEGMENT_SZ);
+  unsigned int i, k;
+
+  for(k = 0 ;; k++) {
+    struct slot *slot = &p->slots[k % p->nb_jobs];
+    size_t n = read_full(p->in, segment, SEGMENT_SZ);
+
+    if(n == 0)
+      break;
+
+    /* the slot holds the oldest member in flight */
+    if(slot->pid)
+      retire_compress(p, slot);
+
+    write_full(slot->in, segment, n);
+    dispatch(p, slot, false);
+  }
+
+  for(i = 0 ; i < p->nb_jobs ; i++) {
+    struct slot *slot = &p->slots[(k + i) % p->nb_jobs];
+
+    if(slot->pid)
+      retire_compress(p, slot);
+  }
+
+  close(p->in);
+  close(p->out);
+
+  free(segment);
+  return NULL;
+}
+
+/* decompress the remaining of the stream with a single compressor,
+   the bytes already read are given first */
+static void decompress_tail(struct parallel *p, const void *head, size_t n)
+{
+  char *iobuf = xmalloc(IO_SZ);
+  ssize_t size;
+  int status;
+  int fd[2];
+  pid_t pid;
+
+  xpipe(fd);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  pid = spawn_compressor(p->compress, true, fd[0], p->out);
+  close(fd[0]);
+
+  write_full(fd[1], head, n);
+  while((size = xread(p->in, iobuf, IO_SZ)))
+    write_full(fd[1], iobuf, size);
+  close(fd[1]);
+
+  if(waitpid(pid, &status, 0) < 0 || status)
+    p->status = 1;
+
+  free(iobuf);
+}
+
+/* size of the next annotated member
+   or zero when there is no annotation */
+static off_t member_size(const unsigned char *hdr, size_t n, size_t *skip)
+{
+  if(n >= GZIP_HDR + GZIP_SA && hdr[0] == GZIP_ID1 && hdr[1] == GZIP_ID2 &&
+     (hdr[3] & GZIP_FEXTRA) && hdr[12] == 'S' && hdr[13] == 'A') {
+    *skip = 0;
+    return le64toh(*(uint64_t *)(hdr + 16));
+  }
+  else if(n >= ZSTD_HDR && le32toh(*(uint32_t *)hdr) == ZSTD_SKIP &&
+          le32toh(*(uint32_t *)(hdr + 4)) == sizeof(uint64_t)) {
+    *skip = ZSTD_HDR;
+    return le64toh(*(uint64_t *)(hdr + 8)) + ZSTD_HDR;
+  }
+
+  return 0;
+}
+
+static void * decompress_thread(void *arg)
+{
+  struct parallel *p = arg;
+  unsigned char hdr[GZIP_HDR + GZIP_SA];
+  unsigned int i, k;
+
+  for(k = 0 ;; k++) {
+    struct slot *slot = &p->slots[k % p->nb_jobs];
+    size_t skip;
+    size_t n = read_full(p->in, hdr, sizeof(hdr));
+    off_t size = member_size(hdr, n, &skip);
+
+    /* members are retired in order before anything else */
+    if(slot->pid)
+      retire_decompress(p, slot);
+
+    if(size == 0) {
+      for(i = 1 ; i < p->nb_jobs ; i++) {
+        struct slot *next = &p->slots[(k + i) % p->nb_jobs];
+
+        if(next->pid)
+          retire_decompress(p, next);
+      }
+
+      if(n)
+        decompress_tail(p, hdr, n);
+      break;
+    }
+
+    if(size < n)
+      errx(EXIT_FAILURE, "inconsistent compressed member");
+
+    write_full(slot->in, hdr + skip, n - skip);
+    copy_file(p->in, slot->in, size - n);
+    dispatch(p, slot, true);
+  }
+
+  /* the reader waits for the end of the stream */
+  close(p->in);
+  close(p->out);
+
+  return NULL;
+}
+
+static struct parallel * parallel_open(const char *compress,
+                                       unsigned int nb_jobs,
+                                       void * (*thread)(void *),
+                                       int in, int out)
+{
+  struct parallel *p = xmalloc(sizeof(struct parallel));
+  unsigned int i;
+  int n;
+
+  /* reader may close the stream before its end */
+  signal(SIGPIPE, SIG_IGN);
+
+  p->compress = compress;
+  p->nb_jobs  = nb_jobs;
+  p->in       = in;
+  p->out      = out;
+  p->status   = 0;
+  p->slots    = xmalloc(sizeof(struct slot) * nb_jobs);
+
+  for(i = 0 ; i < nb_jobs ; i++) {
+    p->slots[i].pid = 0;
+    p->slots[i].in  = xtmpfd();
+    p->slots[i].out = xtmpfd();
+  }
+
+  n = pthread_create(&p->thread, NULL, thread, p);
+  if(n) {
+    errno = n;
+    err(EXIT_FAILURE, "cannot create thread");
+  }
+
+  return p;
+}
+
+/* start compressing to out, the stream is written to in */
+struct parallel * parallel_compress(const char *compress,
+                                    unsigned int nb_jobs,
+                                    int out, int *in)
+{
+  int fd[2];
+
+  xpipe(fd);
+  fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+
+  *in = fd[1];
+  return parallel_open(compress, nb_jobs, compress_thread, fd[0], out);
+}
+
+/* start decompressing from in, the stream is read from out */
+struct parallel * parallel_decompress(const char *compress,
+                                      unsigned int nb_jobs,
+                                      int in, int *out)
+{
+  int fd[2];
+
+  xpipe(fd);
+  fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+
+  *out = fd[0];
+  return parallel_open(compress, nb_jobs, decompress_thread, in, fd[1]);
+}
+
+/* wait for the end of the stream
+   return the exit status of the compressors */
+int parallel_wait(struct parallel *p)
+{
+  unsigned int i;
+  int status;
+
+  pthread_join(p->thread, NULL);
+
+  for(i = 0 ; i < p->nb_jobs ; i++) {
+    close(p->slots[i].in);
+    close(p->slots[i].out);
+  }
+
+  status = p->status;
+
+  free(p->slots);
+  free(p);
+
+  return status;
+}
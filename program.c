@@ -0,0 +1,176 @@
+/* File: program.c
+
+   Copyright (c) 2011 David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE. */
+
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "codec.h"
+#include "program.h"
+
+/* This file contains the external compressor programs. They are
+   recognized on read from the magic number of their stream. When a
+   parallel implementation is installed it replaces the program, the
+   number of threads and the compression level are passed along. */
+
+struct program {
+  const char *name;      /* program given by the user */
+  const char *magic;     /* magic number of its stream */
+  size_t magic_size;
+  bool levels;           /* accepts -1 .. -9 */
+
+  /* parallel implementation */
+  const char *parallel;  /* program used instead when installed */
+  const char *threads;   /* option giving the number of threads */
+  bool attached;         /* number attached to the option */
+  const char *all;       /* number using every processor if not default */
+  bool decompress;       /* threads used on decompression too */
+};
+
+static const struct program programs[] = {
+  { "compress", "\x1f\x9d", 2, false, NULL, NULL, false, NULL, false },
+  { "gzip", "\x1f\x8b", 2, true, "pigz", "-p", false, NULL, true },
+  { "bzip2", "BZh", 3, true, "pbzip2", "-p", true, NULL, true },
+  { "xz", "\xfd" "7zXZ\0", 6, true, "xz", "-T", true, "0", true },
+  { "lzma", "\x5d\0\0", 3, true, NULL, NULL, false, NULL, false },
+  { "lzip", "LZIP", 4, true, "plzip", "-n", false, NULL, true },
+  { "lzop", "\x89LZO", 4, true, NULL, NULL, false, NULL, false },
+  { "zstd", "\x28\xb5\x2f\xfd", 4, true, "zstd", "-T", true, "0", false },
+  { "lz4", "\x04\x22\x4d\x18", 4, true, NULL, NULL, false, NULL, false },
+  { NULL }
+};
+
+static const struct program * find_program(const char *name)
+{
+  const struct program *p;
+  const char *s = strrchr(name, '/');
+
+  if(s)
+    name = s + 1;
+
+  for(p = programs ; p->name ; p++)
+    if(!strcmp(p->name, name))
+      return p;
+
+  return NULL;
+}
+
+/* check whether a program may be found in the path */
+static bool installed(const char *program)
+{
+  const char *path = getenv("PATH");
+
+  if(!path)
+    path = "/bin:/usr/bin";
+
+  while(*path) {
+    char file[PATH_MAX];
+    size_t n = strcspn(path, ":");
+
+    snprintf(file, PATH_MAX, "%.*s/%s", (int)n, path, program);
+    if(!access(file, X_OK))
+      return true;
+
+    path += n;
+    if(*path == ':')
+      path++;
+  }
+
+  return false;
+}
+
+/* returns the program producing the stream or NULL if unknown */
+const char * program_sniff(const void *buf, size_t size)
+{
+  const struct program *p;
+  const unsigned char *s = buf;
+
+  /* zstd streams may start with a skippable frame
+     such as the annotation of parallel members */
+  if(size >= 4 && (s[0] & 0xf0) == 0x50 && !memcmp(s + 1, "\x2a\x4d\x18", 3))
+    return "zstd";
+
+  for(p = programs ; p->name ; p++)
+    if(size >= p->magic_size && !memcmp(buf, p->magic, p->magic_size))
+      return p->name;
+
+  return NULL;
+}
+
+/* replace the process by the compressor, LEVEL_DEFAULT and zero threads
+   keep the default values */
+void program_exec(const char *program, int level, unsigned int threads,
+                  bool decompress)
+{
+  const struct program *p = find_program(program);
+  bool parallel = p && p->parallel && installed(p->parallel);
+  char s_level[16], s_value[16], s_threads[32];
+  const char *argv[6];
+  int argc = 0;
+
+  if(parallel)
+    program = p->parallel;
+
+  argv[argc++] = program;
+  if(decompress)
+    argv[argc++] = "-d";
+
+  if(p && p->levels && level != LEVEL_DEFAULT && !decompress) {
+    snprintf(s_level, sizeof(s_level), "-%d", level);
+    argv[argc++] = s_level;
+  }
+
+  if(parallel && (threads || p->all) && (!decompress || p->decompress)) {
+    const char *n = p->all;
+
+    if(threads) {
+      snprintf(s_value, sizeof(s_value), "%u", threads);
+      n = s_value;
+    }
+
+    if(p->attached) {
+      snprintf(s_threads, sizeof(s_threads), "%s%s", p->threads, n);
+      argv[argc++] = s_threads;
+    }
+    else {
+      argv[argc++] = p->threads;
+      argv[argc++] = n;
+    }
+  }
+
+  argv[argc] = NULL;
+
+  execvp(program, (char * const *)argv);
+  err(EXIT_FAILURE, "cannot execute \"%s\"", program);
+}
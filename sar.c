@@ -41,7 +41,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <utime.h>
+#include <fnmatch.h>
 #include <time.h>
 #include <err.h>
 #include <pwd.h>
@@ -57,6 +60,13 @@
 
 #include "crc32-legacy.h"
 #include "translation.h"
+#include "parallel.h"
+#include "program.h"
+#include "fifo.h"
+#include "codec.h"
+#include "block.h"
+#include "dict.h"
+#include "copy.h"
 #include "common.h"
 #include "sar.h"
 
@@ -64,15 +74,65 @@
    - use *at system calls */
 
 static struct sar_file * create_sar_file(void);
+static void stream_write(struct sar_file *out, const void *buf, size_t count);
+static void xstream_read(struct sar_file *out, void *buf, size_t count);
+static void xstream_skip(struct sar_file *out, off_t size);
 static void crc_write(struct sar_file *out, const void *buf, size_t count);
 static void xcrc_read(struct sar_file *out, void *buf, size_t count);
 static int add_node(struct sar_file *out, mode_t *mode, const char *name);
+static void write_node(struct sar_file *out, const char *name);
+static void mark_node(struct sar_file *out);
+static void write_sync(struct sar_file *out);
+static void write_padding(struct sar_file *out, const char *name);
+static void read_sync(struct sar_file *out, uint64_t node, size_t idx);
+static bool check_sync(struct sar_file *out, uint64_t pos, char *path);
+static void inconsistent(struct sar_file *out);
+static void leave_node(struct sar_file *out);
+static void raise_version(struct sar_file *out);
 static void reupdate_time(const struct sar_file *out);
+static void add_root(struct sar_file *out, const char *path);
+static void add_units(struct sar_file *out,
+                      const struct sar_unit *units, unsigned long nb_units);
+static void add_shards(struct sar_file *out,
+                       char * const *paths, unsigned int nb_paths);
+static bool scan_tree(const char *path,
+                      bool (*f)(const char *, const struct stat *, void *),
+                      void *data);
 static void rec_add(struct sar_file *out, const char *node);
+static void add_child(struct sar_file *out, const char *name);
+static void add_grouped(struct sar_file *out, DIR *dp);
 static enum isclass get_id_size_class(uid_t uid, gid_t gid);
 static enum tsclass get_time_size_class(time_t atime, time_t mtime);
 static int rec_extract(struct sar_file *out, size_t idx);
-static void write_regular(struct sar_file *out);
+static bool selected(struct sar_file *out, const char *path);
+static bool is_parent(const char *dir, const char *path);
+static void report_missed(struct sar_file *out);
+static void transcode_node(struct sar_file *in, uint16_t mode,
+                           const char *name);
+static void * list_range(void *arg);
+static void write_regular(struct sar_file *out, bool raw);
+static size_t read_payload(struct sar_file *out, int fd,
+                           void *buf, size_t count);
+static bool sample_regular(const struct sar_file *out);
+static void write_small(struct sar_file *out, int fd);
+static void read_small(struct sar_file *out, mode_t mode);
+static bool scan_extents(struct sar_file *out);
+static void write_extents(struct sar_file *out);
+static void write_sparse(struct sar_file *out, int fd);
+static void read_extents(struct sar_file *out);
+static off_t check_extents(struct sar_file *out);
+static void read_sparse(struct sar_file *out, mode_t mode);
+static void read_dict(struct sar_file *out);
+static void report_levels(const struct sar_file *file);
+static void write_columns(struct sar_file *out);
+static bool stop_columns(struct sar_file *out);
+static void merge_toc(struct sar_file *out, struct sar_file *spool,
+                      uint64_t offset);
+static void write_toc(struct sar_file *out);
+static void free_toc(struct sar_file *out);
+static void write_index(struct sar_file *out);
+static size_t sniff_archive(int fd, unsigned char *buf, bool *consumed);
+static int unread_archive(int fd, const unsigned char *head, size_t size);
 static void write_link(struct sar_file *out);
 static void write_dev(struct sar_file *out);
 static void write_control(struct sar_file *out, uint16_t id);
@@ -84,6 +144,10 @@ static void read_fifo(struct sar_file *out, mode_t mode);
 static void read_device(struct sar_file *out, mode_t mode);
 static void read_hardlink(struct sar_file *out, mode_t mode);
 static char * watch_inode(struct sar_file *out);
+static void print_file(const struct sar_file *out, const char *path,
+                       const char *link, mode_t mode, uint16_t sar_mode,
+                       uid_t uid, gid_t gid, off_t size, time_t atime,
+                       time_t mtime, uint32_t crc, bool display_crc);
 static void show_file(const struct sar_file *out, const char *path,
                       const char *link, mode_t mode, uint16_t sar_mode,
                       uid_t uid, gid_t gid, off_t size, time_t atime,
@@ -159,7 +223,10 @@ static void hl_destroy(void *data)
 
 static const char * temporary_archive(void)
 {
-  static char template[] = "sarXXXXXX";
+  static char template[sizeof("sarXXXXXX")];
+
+  /* mktemp() replaces the template in place */
+  strcpy(template, "sarXXXXXX");
   return mktemp(template);
 }
 
@@ -180,21 +247,30 @@ static uint32_t f_crc_c(const unsigned char *s,
 /* create a new archive from scratch and doesn't
    bother if it was already created we trunc it */
 struct sar_file * sar_creat(const char *path,
-                            const char *compress,
+                            const struct sar_compress *compress,
                             bool use_crc,
                             bool use_ntime,
                             unsigned int verbose)
 {
   const char *real_path = path;
-  path = temporary_archive();
 
-  uint32_t magik = MAGIK;
+  /* the standard output has no temporary archive */
+  if(path)
+    path = temporary_archive();
+
+  uint32_t magik;
   uint32_t s_magik;
 
   struct sar_file *out = create_sar_file();
 
+  /* older readers still read archives without the new controls */
   out->verbose = verbose;
-  out->version = MAGIK_VERSION;
+  out->version = MAGIK_BASE;
+  out->creat   = true;
+
+  if(compress->align || compress->sparse)
+    out->version = MAGIK_VERSION;
+  magik = MAGIK_OF(out->version);
 
   if(use_crc)
     out->flags |= A_ICRC;
@@ -205,20 +281,57 @@ struct sar_file * sar_creat(const char *path,
   out->flags |= A_ICRC32_C;
   out->f_crc  = f_crc_c;
 
+  if(compress->block_size)
+    out->flags |= A_IBLOCK;
+
+  if(compress->dictionary)
+    out->flags |= A_IDICT;
+  if(compress->toc)
+    out->flags |= A_ITOC;
+  if(compress->sync) {
+    out->flags    |= A_ISYNC;
+    out->sync_span = (uint64_t)compress->sync * 1024 * 1024;
+    out->next_sync = out->sync_span;
+  }
+  out->align      = compress->align * 1024;
+  out->sparse     = compress->sparse;
+  out->zero_block = compress->zero_block * 1024;
+  out->dict_level = compress->level;
+  out->group      = compress->group;
+
+  /* payloads wait in a spool until the metadata is written */
+  if(compress->columns) {
+    out->flags   |= A_ICOLUMN;
+    out->spool_fd = xtmpfd();
+    out->spool    = iobuf_dopen(xdup(out->spool_fd));
+  }
+
   if(!path)
     out->fd = STDOUT_FILENO;
   else {
-    out->fd = open(path, O_CREAT | O_RDWR | O_TRUNC,
+    out->fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC,
                    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
     if(out->fd < 0)
       err(EXIT_FAILURE, "could not open file \"%s\"", path);
   }
 
-  if(compress) {
+  /* a codec works on top of the iobuf opened below */
+  if(!compress->codec && compress->program && compress->jobs > 1) {
+    if(!parallel_supported(compress->program))
+      errx(EXIT_FAILURE, "\"%s\" cannot decompress concatenated members",
+           compress->program);
+
+    out->parallel = parallel_compress(compress->program, compress->jobs,
+                                      out->fd, &out->fd);
+  }
+  else if(!compress->codec && compress->program) {
     int fd[2];
     pid_t pid;
 
+    /* other compressors must not inherit this pipe */
     xpipe(fd);
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
     pid = xfork();
 
     if(!pid) /* child */ {
@@ -228,27 +341,112 @@ struct sar_file * sar_creat(const char *path,
       xdup2(out->fd, STDOUT_FILENO);
 
       close(fd[0]);
-      close(out->fd);
+      if(out->fd != STDOUT_FILENO)
+        close(out->fd);
 
-      execlp(compress, compress, NULL);
-      err(EXIT_FAILURE, "cannot execute \"%s\"", compress);
+      program_exec(compress->program, compress->level, compress->threads,
+                   false);
     }
 
     close(fd[0]);
-    out->fd = fd[1];
+    out->fd   = fd[1];
+    out->pid  = pid;
+    out->fifo = fifo_open(out->fd, true);
   }
 
-  out->file = iobuf_dopen(out->fd);
+  if(!out->fifo)
+    out->file = iobuf_dopen(out->fd);
+
+  if(compress->codec && !compress->block_size)
+    out->cs = cstream_open(compress->codec, out->file, compress->level,
+                           compress->threads, compress->long_window, false);
 
   /* write magik number and flags
      notice we convert magik to little endian first
      flags which is 1 byte wide is not converted though */
   s_magik = htole32(magik);
-  xiobuf_write(out->file, &s_magik, sizeof(s_magik));
-  xiobuf_write(out->file, &out->flags, sizeof(out->flags));
+  stream_write(out, &s_magik, sizeof(s_magik));
+  stream_write(out, &out->flags, sizeof(out->flags));
+
+  /* block archives keep their header uncompressed */
+  if(compress->block_size) {
+    unsigned int nb_threads = compress->threads;
+
+    if(!nb_threads)
+      nb_threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    out->block = block_creat(out->file, sizeof(s_magik) + sizeof(out->flags),
+                             compress->codec, compress->level,
+                             compress->block_size, nb_threads);
+
+    if(compress->adapt)
+      block_adapt(out->block, compress->adapt_min, compress->adapt_max);
+  }
 
   /* now we may move the temporary archive to the real one */
-  rename(path, real_path);
+  if(path)
+    rename(path, real_path);
+
+  /* for debugging purpose */
+  UNPTR(out->wp);
+  UNPTR(out->hl_tbl);
+
+  return out;
+}
+
+/* create one archive per shard, each with its own compressor and
+   walker, the returned archive only splits the roots among them */
+struct sar_file * sar_creat_shards(const char *path,
+                                   unsigned int nb_shards,
+                                   const struct sar_compress *compress,
+                                   bool use_crc,
+                                   bool use_ntime,
+                                   unsigned int verbose)
+{
+  assert(path);
+  assert(nb_shards > 0);
+
+  struct sar_file *out = create_sar_file();
+  unsigned int i;
+
+  out->verbose   = verbose;
+  out->nb_shards = nb_shards;
+  out->shards    = xmalloc(sizeof(struct sar_file *) * nb_shards);
+
+  for(i = 0 ; i < nb_shards ; i++) {
+    char shard_path[PATH_MAX];
+
+    snprintf(shard_path, PATH_MAX, "%s.%u", path, i);
+    out->shards[i] = sar_creat(shard_path, compress, use_crc,
+                               use_ntime, verbose);
+  }
+
+  /* the walker uses the same format as its shards */
+  out->version    = out->shards[0]->version;
+  out->flags      = out->shards[0]->flags;
+  out->f_crc      = out->shards[0]->f_crc;
+  out->dict_level = out->shards[0]->dict_level;
+  out->group      = out->shards[0]->group;
+
+  /* for debugging purpose */
+  UNPTR(out->wp);
+  UNPTR(out->hl_tbl);
+
+  return out;
+}
+
+/* Copy trees directly to a destination directory. The archive walker
+   and its hard link detection are reused but nodes are materialized
+   right away instead of being serialized. */
+struct sar_file * sar_copy(const char *dst, unsigned int verbose)
+{
+  assert(dst);
+
+  struct sar_file *out = create_sar_file();
+  long nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  out->verbose = verbose;
+  out->copy    = copy_open(dst, MAX(nb_workers, 2));
 
   /* for debugging purpose */
   UNPTR(out->wp);
@@ -257,29 +455,155 @@ struct sar_file * sar_creat(const char *path,
   return out;
 }
 
+/* tell which levels the adaptive blocks ended up with */
+static void report_levels(const struct sar_file *file)
+{
+  const unsigned long *levels;
+  int min, max, i;
+
+  levels = block_levels(file->block, &min, &max);
+  if(!levels)
+    return;
+
+  /* the last block gets its level first */
+  block_cut(file->block);
+
+  verbose(0, file->verbose, "adaptive levels:");
+  for(i = min ; i <= max ; i++)
+    if(levels[i - min])
+      verbose(0, file->verbose, " %d (%lu blocks)", i, levels[i - min]);
+  verbose(0, file->verbose, "\n");
+}
+
+/* something requested was not done although the archive was read */
+bool sar_failed(const struct sar_file *file)
+{
+  assert(file);
+
+  return file->missed;
+}
+
 void sar_close(struct sar_file *file)
 {
   assert(file);
-  assert(file->file);
+  assert(file->file || file->fifo || file->shards || file->copy);
   assert(!file->wp);
 
+  bool stopped = false;
   int status = 0;
 
+  if(file->copy) {
+    copy_close(file->copy);
+    free(file);
+    return;
+  }
+
+  if(file->shards) {
+    unsigned int i;
+
+    for(i = 0 ; i < file->nb_shards ; i++)
+      sar_close(file->shards[i]);
+
+    if(file->dict)
+      dict_free(file->dict);
+
+    free(file->shards);
+    free(file);
+    return;
+  }
+
+  if(file->dctx)
+    dict_ctx_free(file->dctx);
+  if(file->dict)
+    dict_free(file->dict);
+
+  if(file->spool)
+    write_columns(file);
+  else if(A_HAS_COLUMN(file))
+    stopped = stop_columns(file);
+
+  if(file->creat && A_HAS_TOC(file))
+    write_toc(file);
+  else if(file->toc && !file->inplace)
+    free_toc(file);
+
+  if(file->patterns) {
+    unsigned int i;
+
+    for(i = 0 ; i < file->nb_patterns ; i++)
+      free(file->patterns[i]);
+    free(file->patterns);
+    free(file->matched);
+  }
+
+  /* flush the codec before the archive */
+  if(file->cs)
+    cstream_close(file->cs);
+  else if(file->block) {
+    report_levels(file);
+    block_close(file->block);
+  }
+
+  /* an archive modified in place ends with what was written last,
+     its index covers the new nodes */
+  if(file->inplace) {
+    if(iobuf_flush(file->file) < 0 ||
+       (!file->block && ftruncate(file->fd, file->offset) < 0))
+      err(EXIT_FAILURE, "cannot write archive");
+
+    if(file->toc) {
+      write_index(file);
+      free_toc(file);
+    }
+  }
+
+  /* the compaction is over once the archive reached the disk */
+  if(file->journal) {
+    if(fdatasync(file->fd) < 0)
+      err(EXIT_FAILURE, "cannot write archive");
+    unlink(file->journal);
+    free(file->journal);
+  }
+
+  if(file->seeds) {
+    while(file->nb_seeds--)
+      free(file->seeds[file->nb_seeds].path);
+    free(file->seeds);
+  }
+
+  free(file->path);
+  free(file->syncs);
+  free(file->extents);
+
   /* We have to close this file before waiting the
      compressor to avoid a deadlock */
-  iobuf_close(file->file);
+  if(file->fifo)
+    fifo_close(file->fifo);
+  else
+    iobuf_close(file->file);
 
   /* we need to wait for compression child to return */
-  wait(&status);
+  if(file->pid)
+    waitpid(file->pid, &status, 0);
+  else if(file->parallel)
+    status = parallel_wait(file->parallel);
+
+  /* the decompressor was stopped on purpose */
+  if(stopped)
+    status = 0;
 
   if(status)
     errx(EXIT_FAILURE, "failed to compress");
+
+  free(file);
 }
 
-void sar_add(struct sar_file *out, const char *path)
+/* archive one source root, the nodes leading to it are
+   emitted as directories which are closed afterward */
+static void add_root(struct sar_file *out, const char *path)
 {
   assert(out);
-  assert(out->file);
+  assert(out->file || out->fifo || out->shards || out->copy);
   assert(!out->wp);
   assert(path);
 
@@ -290,6 +614,15 @@ void sar_add(struct sar_file *out, const char *path)
   /* create hard link table */
   out->hl_tbl    = ht_create(HL_TBL_SZ, hl_hash, hl_compare, hl_destroy);
 
+  /* links may refer to the files of an archive appended to */
+  for(i = 0 ; i < out->nb_seeds ; i++) {
+    struct sar_hardlink *hl = xmalloc(sizeof(struct sar_hardlink));
+
+    *hl      = out->seeds[i];
+    hl->path = strdup(hl->path);
+    ht_search(out->hl_tbl, hl, hl);
+  }
+
   /* now we may create the working path
      this is the one we will use in the future */
   out->wp     = xmalloc(WP_MAX);
@@ -309,7 +642,6 @@ void sar_add(struct sar_file *out, const char *path)
     npath++;
 
 NEXT_NODE:
-  nb_nodes++;
   s = npath;
 
   for(;; s++) {
@@ -321,6 +653,7 @@ NEXT_NODE:
       node = strdup(npath);
 
       add_node(out, NULL, node);
+      nb_nodes++;
 
       *s = '/';
 
@@ -338,8 +671,10 @@ NEXT_NODE:
   }
 
 CLEAN:
+  /* close leading directories only,
+     the caller terminates the archive */
   while(nb_nodes--)
-    write_control(out, M_C_CHILD);
+    leave_node(out);
 
   ht_destroy(out->hl_tbl);
   free(out->wp);
@@ -348,782 +683,4087 @@ CLEAN:
   UNPTR(out->wp);
 }
 
-static void crc_write(struct sar_file *out, const void *buf, size_t count)
+/* archive units given in walk order, the directories leading to
+   consecutive units are shared and closed once no unit follows */
+static void add_units(struct sar_file *out,
+                      const struct sar_unit *units, unsigned long nb_units)
 {
-  if(A_HAS_CRC(out))
-    out->crc = out->f_crc(buf, count, out->crc);
-  xiobuf_write(out->file, buf, count);
-}
+  assert(out);
+  assert(!out->wp);
 
-static void xcrc_read(struct sar_file *out, void *buf, size_t count)
-{
-  xxiobuf_read(out->file, buf, count);
+  size_t dir = 0, nb_nodes = 0;
+  unsigned long u;
 
-  if(A_HAS_CRC(out))
-    out->crc = out->f_crc(buf, count, out->crc);
-}
+  out->hl_tbl = ht_create(HL_TBL_SZ, hl_hash, hl_compare, hl_destroy);
+  out->wp     = xmalloc(WP_MAX);
 
-static char * watch_inode(struct sar_file *out)
-{
-  assert(out);
-  assert(out->hl_tbl);
+  for(u = 0 ; u < nb_units ; u++) {
+    const char *path = units[u].path;
+    size_t len, start, i;
 
-  struct sar_hardlink *key = xmalloc(sizeof(struct sar_hardlink));
-  struct sar_hardlink *hl;
+    /* close the directories which do not lead to this unit */
+    while(nb_nodes && (strncmp(out->wp, path, dir) || path[dir] != '/')) {
+      char *s;
 
-  key->inode  = out->stat.st_ino;
-  key->device = out->stat.st_dev;
-  hl = ht_search(out->hl_tbl, key, NULL);
+      out->wp[dir] = '\0';
+      leave_node(out);
+      nb_nodes--;
 
-  if(hl) {
-    hl->links--;
-    if(hl->links <= 0)
-      ht_delete(out->hl_tbl, key);
-    return strdup(hl->path);
-  } else {
-    key->links  = out->stat.st_nlink;
-    key->path   = strdup(out->wp);
-    ht_search(out->hl_tbl, key, key);
+      s   = strrchr(out->wp, '/');
+      dir = s ? (size_t)(s - out->wp) : 0;
+    }
+
+    len = n_strncpy(out->wp, path, WP_MAX);
+    if(len >= WP_MAX)
+      errx(EXIT_FAILURE, "path too long");
+
+    /* avoid root slash */
+    start = nb_nodes ? dir + 1 : *path == '/';
+
+    /* open the directories leading to this unit */
+    for(i = start ; i < len ; i++) {
+      if(out->wp[i] != '/')
+        continue;
+
+      out->wp[i] = '\0';
+      add_node(out, NULL, out->wp + start);
+      out->wp[i] = '/';
+
+      nb_nodes++;
+      dir   = i;
+      start = i + 1;
+    }
+
+    out->wp_idx = len;
+    rec_add(out, out->wp + start);
   }
 
-  return NULL;
-}
+  while(nb_nodes--)
+    leave_node(out);
 
-static enum fsclass get_file_size_class(off_t size)
-{
-  if(size <= UINT8_MAX)
-    return N_FBYTE;
-  else if(size <= UINT16_MAX)
-    return N_FKILO;
-  else if(size <= UINT32_MAX)
-    return N_FGIGA;
-  else
-    return N_FHUGE;
+  ht_destroy(out->hl_tbl);
+  free(out->wp);
+
+  UNPTR(out->hl_tbl);
+  UNPTR(out->wp);
 }
 
-static enum isclass get_id_size_class(uid_t uid, gid_t gid)
+static void * spool_root(void *arg)
 {
-  if(uid == 0 && gid == 0)
-    return N_IRR;
-  else if(uid == 1000 && gid == 1000)
-    return N_IUU;
-  else if(uid == gid && uid <= UINT8_MAX)
-    return N_ISRB;
-  else if(uid == gid && uid >= 1000 && uid <= (1000 + UINT8_MAX))
-    return N_ISUB;
-  else if(uid == 0 && (gid <= UINT8_MAX))
-    return N_IRB;
-  else if(uid == 1000 && gid >= 1000 && gid <= (1000 + UINT8_MAX))
-    return N_IUB;
-  else if(uid == gid && uid <= UINT16_MAX)
-    return N_ISKILO;
-  else if(uid <= UINT8_MAX && gid <= UINT8_MAX)
-    return N_IBBYTE;
-  else if(uid >= 1000 && gid >= 1000 &&
-          uid <= (1000 + UINT8_MAX) && gid <= (1000 + UINT8_MAX))
-    return N_IBUBYTE;
-  else if(uid <= UINT8_MAX && gid <= UINT16_MAX)
-    return N_IBK;
-  else if(gid <= UINT16_MAX && uid <= UINT8_MAX)
-    return N_IKB;
-  else if(uid == gid)
-    return N_ISGIGA;
-  else if(uid <= UINT16_MAX && gid <= UINT16_MAX)
-    return N_IBKILO;
-  else if(uid <= UINT16_MAX)
-    return N_IKG;
-  else if(gid <= UINT16_MAX)
-    return N_IGK;
-  else
-    return N_IGG;
+  struct sar_spool *spool = arg;
+
+  add_root(spool->file, spool->path);
+
+  /* flush the spool, closing the pipe ends the copy */
+  iobuf_close(spool->file->file);
+
+  return NULL;
 }
 
-static enum tsclass get_time_size_class(time_t atime, time_t mtime)
+/* Keep the spool of a root until the archive gets to it. The start
+   is kept in memory and the rest goes to a temporary file. */
+static void * drain_spool(void *arg)
 {
-  if(atime == mtime && (int32_t)atime == atime)
-    return N_TS32;
-  else if(atime == mtime)
-    return N_TS64;
-  else if((int32_t)atime == atime && (int32_t)mtime == mtime)
-    return N_TB32;
-  else
-    return N_TB64;
+  struct sar_spool *spool = arg;
+  char *iobuf = xmalloc(IO_SZ);
+
+  while(1) {
+    ssize_t n;
+    bool taken;
+
+    pthread_mutex_lock(&spool->lock);
+    taken = spool->taken;
+    pthread_mutex_unlock(&spool->lock);
+
+    if(taken)
+      break;
+
+    n = read(spool->fd, iobuf, IO_SZ);
+    if(n < 0)
+      err(EXIT_FAILURE, "cannot read spool of \"%s\"", spool->path);
+    else if(n == 0)
+      break;
+
+    if(spool->tmp < 0 && spool->size + n <= SPOOL_SZ) {
+      spool->buf = xrealloc(spool->buf, spool->size + n);
+      memcpy(spool->buf + spool->size, iobuf, n);
+      spool->size += n;
+    }
+    else {
+      if(spool->tmp < 0)
+        spool->tmp = xtmpfd();
+      xwrite(spool->tmp, iobuf, n);
+    }
+  }
+
+  free(iobuf);
+
+  return NULL;
 }
 
-static void write_regular(struct sar_file *out)
+/* append a spooled root to the archive, what was drained
+   comes first and the rest is read from the pipe directly */
+static void copy_spool(struct sar_file *out, struct sar_spool *spool)
 {
-  char iobuf[IO_SZ];
-  enum fsclass class;
+  char *iobuf;
+  uint64_t offset = out->offset;
   ssize_t n;
-  int fd;
 
-  /* store size first */
-  class = out->nsclass & N_FILE;
-  switch(class) {
-    uint8_t  size_byte;
-    uint16_t size_kilo;
-    uint32_t size_giga;
-    uint64_t size_huge;
+  pthread_mutex_lock(&spool->lock);
+  spool->taken = true;
+  pthread_mutex_unlock(&spool->lock);
 
-  case(N_FBYTE):
-    size_byte = out->stat.st_size;
-    crc_write(out, &size_byte, sizeof(size_byte));
-    break;
-  case(N_FKILO):
-    size_kilo = htole16(out->stat.st_size);
-    crc_write(out, &size_kilo, sizeof(size_kilo));
-    break;
-  case(N_FGIGA):
-    size_giga = htole32(out->stat.st_size);
-    crc_write(out, &size_giga, sizeof(size_giga));
-    break;
-  case(N_FHUGE):
-    size_huge = htole64(out->stat.st_size);
-    crc_write(out, &size_huge, sizeof(size_huge));
-    break;
+  /* the drainer stops after its current read */
+  pthread_join(spool->drainer, NULL);
+
+  /* the spool starts with a top level node */
+  if(out->block)
+    block_node(out->block, "");
+
+  if(spool->size)
+    stream_write(out, spool->buf, spool->size);
+  free(spool->buf);
+
+  iobuf = xmalloc(IO_SZ);
+
+  if(spool->tmp >= 0) {
+    if(lseek(spool->tmp, 0, SEEK_SET) < 0)
+      err(EXIT_FAILURE, "cannot seek spool of \"%s\"", spool->path);
+
+    while((n = xread(spool->tmp, iobuf, IO_SZ)))
+      stream_write(out, iobuf, n);
+
+    close(spool->tmp);
   }
 
-  /* store file */
-  fd = open(out->wp, O_RDONLY);
+  while((n = xread(spool->fd, iobuf, IO_SZ)))
+    stream_write(out, iobuf, n);
 
-  /* if it fails here the archive is screwed out */
-  if(fd < 0)
-    err(EXIT_FAILURE, "cannot open \"%s\"", out->wp);
+  pthread_join(spool->thread, NULL);
 
-  while((n = xread(fd, iobuf, IO_SZ)))
-    crc_write(out, iobuf, n);
+  /* the entries of the spool follow the nodes written before it */
+  if(A_HAS_TOC(out) || out->indexing)
+    merge_toc(out, spool->file, offset);
 
-  close(fd);
+  pthread_mutex_destroy(&spool->lock);
+  close(spool->fd);
+  free(iobuf);
 }
 
-static void write_link(struct sar_file *out)
+static bool scan_size(const char *path, const struct stat *st, void *data)
 {
-  ssize_t n;
-  enum fsclass class;
+  off_t *size = data;
 
-  /* read link */
-  out->link = xreadlink_malloc_n(out->wp, &n);
+  /* hard linked files are counted once per group */
+  if(S_ISREG(st->st_mode))
+    *size += st->st_size / st->st_nlink;
 
-  /* if it fails here the archive is screwed out */
-  if(!out->link)
-    err(EXIT_FAILURE, "cannot read \"%s\"", out->wp);
+  return true;
+}
 
-  /* store size */
-  class = out->nsclass & N_FILE;
-  switch(class) {
-    uint8_t  size_byte;
-    uint16_t size_kilo;
+struct sar_sample {
+  char *buf;               /* small files put end to end */
+  size_t size;
+  size_t *sizes;           /* size of each file */
+  unsigned int nb_files;
+  unsigned int max_files;
+};
 
-  case(N_FBYTE):
-    size_byte = n;
-    crc_write(out, &size_byte, sizeof(size_byte));
-    break;
-  case(N_FKILO):
-    size_kilo = htole16(n);
-    crc_write(out, &size_kilo, sizeof(size_kilo));
-    break;
-  case(N_FGIGA):
-  case(N_FHUGE):
-    errx(EXIT_FAILURE, "link size too large for \"%s\"", out->wp);
+/* collect small files until the training set is full */
+static bool scan_sample(const char *path, const struct stat *st, void *data)
+{
+  struct sar_sample *sample = data;
+  ssize_t n;
+  int fd;
+
+  if(!S_ISREG(st->st_mode) || !st->st_size || st->st_size > DICT_FILE_MAX)
+    return true;
+
+  if(sample->size + st->st_size > DICT_SAMPLES)
+    return false;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return true;
+
+  n = read(fd, sample->buf + sample->size, st->st_size);
+  close(fd);
+
+  /* the file is read again when archived */
+  restore_time(path, st);
+
+  if(n <= 0)
+    return true;
+
+  if(sample->nb_files == sample->max_files) {
+    sample->max_files = sample->max_files ? sample->max_files * 2 : 1024;
+    sample->sizes     = xrealloc(sample->sizes,
+                                 sizeof(size_t) * sample->max_files);
   }
 
-  crc_write(out, out->link, n);
+  sample->sizes[sample->nb_files++] = n;
+  sample->size += n;
+
+  return true;
 }
 
-static void write_dev(struct sar_file *out)
+static void write_dict(struct sar_file *out)
 {
-  uint64_t dev = htole64(out->stat.st_rdev);
+  const void *buf = NULL;
+  size_t size     = 0;
+  uint32_t s_size;
 
-  crc_write(out, &dev, sizeof(dev));
+  if(out->dict)
+    buf = dict_buffer(out->dict, &size);
+
+  s_size = htole32(size);
+  stream_write(out, &s_size, sizeof(s_size));
+  if(size)
+    stream_write(out, buf, size);
+
+  /* nodes may start the next block */
+  if(out->block)
+    block_cut(out->block);
 }
 
-static void write_control(struct sar_file *out, uint16_t id)
+/* Train the dictionary on the first small files found in the roots.
+   It follows the header of each archive, empty when there were not
+   enough samples in which case small files are stored as is. */
+static void add_dict(struct sar_file *out,
+                     char * const *paths, unsigned int nb_paths)
 {
-  uint16_t control = htole16(M_ICTRL | id);
+  struct sar_sample sample = { .buf = xmalloc(DICT_SAMPLES) };
+  unsigned int i;
+
+  for(i = 0 ; i < nb_paths ; i++)
+    if(!scan_tree(paths[i], scan_sample, &sample))
+      break;
+
+  out->dict = dict_train(sample.buf, sample.sizes, sample.nb_files,
+                         out->dict_level);
+  if(!out->dict)
+    warnx("not enough small files to train a dictionary");
+  else
+    verbose(0, out->verbose, "dictionary trained on %u files\n",
+            sample.nb_files);
+
+  free(sample.buf);
+  free(sample.sizes);
+
+  if(!out->shards) {
+    write_dict(out);
+    out->dctx = out->dict ? dict_ctx_new(out->dict) : NULL;
+    return;
+  }
 
-  xiobuf_write(out->file, &control, sizeof(control));
+  for(i = 0 ; i < out->nb_shards ; i++) {
+    struct sar_file *shard = out->shards[i];
+
+    shard->dict = out->dict;
+    write_dict(shard);
+    shard->dict = NULL;
+    shard->dctx = out->dict ? dict_ctx_new(out->dict) : NULL;
+  }
 }
 
-static void write_name(struct sar_file *out, const char *name)
+struct sar_tie {
+  unsigned long first;     /* walk order of the first link to a file */
+  unsigned long link;      /* walk order of another link to it */
+};
+
+struct sar_split {
+  struct sar_unit *units;  /* units in walk order */
+  unsigned long nb_units;
+  unsigned long max_units;
+  off_t quota;             /* size of the largest subtree kept whole */
+  unsigned long seq;       /* nodes walked so far */
+
+  /* hard links which must stay in the same shard */
+  htable_t hl_tbl;
+  struct sar_tie *ties;
+  unsigned long nb_ties;
+  unsigned long max_ties;
+};
+
+/* remember the first link to a file to tie the other ones to it */
+static void split_link(struct sar_split *split, const struct stat *st,
+                       unsigned long seq)
 {
-  uint8_t s_size;
-  size_t size    = strlen(name);
+  struct sar_hardlink *key = xmalloc(sizeof(struct sar_hardlink));
+  struct sar_hardlink *hl;
 
-#ifndef DISABLE_NAME_WIDTH_CHECK
-  /* check for large node name */
-  if(size > NAME_MAX) {
-    char *short_name = strndup(name, NAME_MAX);
-    size   = NAME_MAX;
-    s_size = NAME_MAX;
+  key->inode  = st->st_ino;
+  key->device = st->st_dev;
+  hl = ht_search(split->hl_tbl, key, NULL);
 
-    short_name[NAME_MAX - 1] = '~';
-    short_name[NAME_MAX]     = '\0';
+  if(!hl) {
+    key->links = st->st_nlink - 1;
+    key->path  = NULL;
+    key->seq   = seq;
+    ht_search(split->hl_tbl, key, key);
+    return;
+  }
 
-    crc_write(out, &s_size, sizeof(s_size));
-    crc_write(out, short_name, NAME_MAX);
+  if(split->nb_ties == split->max_ties) {
+    split->max_ties = split->max_ties ? split->max_ties * 2 : 64;
+    split->ties     = xrealloc(split->ties,
+                               sizeof(struct sar_tie) * split->max_ties);
+  }
 
-    warnx("name too long for \"%s\" reduced to \"%s\"", out->wp, short_name);
+  split->ties[split->nb_ties].first  = hl->seq;
+  split->ties[split->nb_ties].link   = seq;
+  split->nb_ties++;
 
-    free(short_name);
+  hl->links--;
+  if(hl->links <= 0)
+    ht_delete(split->hl_tbl, key);
+  free(key);
+}
+
+/* Cut a tree in units no larger than the quota unless it is a single
+   file, a larger directory gives the units of its children instead.
+   The sizes come up from the leaves so that each node is only stated
+   once. Returns the payload size of the tree. */
+static off_t split_tree(struct sar_split *split, char *wp, size_t idx)
+{
+  unsigned long first = split->nb_units, seq = split->seq++, u;
+  struct sar_unit *unit;
+  struct stat st;
+  off_t size = 0;
+
+  if(lstat(wp, &st) < 0)
+    return 0;
+
+  if(S_ISDIR(st.st_mode)) {
+    struct dirent *e;
+    DIR *dp = opendir(wp);
+
+    while(dp && (e = readdir(dp))) {
+      size_t n;
+
+      /* skip special entity name */
+      if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+        continue;
+
+      n = strlen(e->d_name);
+      if(idx + n + 1 >= WP_MAX) {
+        warnx("path too long for \"%s/%s\"", wp, e->d_name);
+        continue;
+      }
+
+      wp[idx] = '/';
+      memcpy(wp + idx + 1, e->d_name, n + 1);
+
+      size += split_tree(split, wp, idx + n + 1);
+
+      wp[idx] = '\0';
+    }
+
+    if(dp)
+      closedir(dp);
+
+    if(size > split->quota)
+      return size;
   }
   else {
-    s_size = size;
-    crc_write(out, &s_size, sizeof(s_size));
-    crc_write(out, name, s_size);
+    scan_size(wp, &st, &size);
+
+    if(st.st_nlink >= 2)
+      split_link(split, &st, seq);
   }
-#else
-  s_size = size;
-  crc_write(out, &s_size, sizeof(s_size));
-  crc_write(out, name, size);
-#endif /* NAME_WIDTH_CHECK */
+
+  /* the whole tree replaces the units of its children */
+  for(u = first ; u < split->nb_units ; u++)
+    free(split->units[u].path);
+  split->nb_units = first;
+
+  if(split->nb_units == split->max_units) {
+    split->max_units = split->max_units ? split->max_units * 2 : 64;
+    split->units     = xrealloc(split->units,
+                                sizeof(struct sar_unit) * split->max_units);
+  }
+
+  unit       = &split->units[split->nb_units++];
+  unit->path = strdup(*wp ? wp : "/");
+  unit->size = size;
+  unit->seq  = seq;
+
+  return size;
 }
 
-static void show_file(const struct sar_file *out,
-                      const char *path, const char *link,
-                      mode_t mode, uint16_t sar_mode,
-                      uid_t uid, gid_t gid,
-                      off_t size,
-                      time_t atime, time_t mtime,
-                      uint32_t crc, bool display_crc)
+/* find the unit holding a node from its walk order */
+static unsigned long find_unit(const struct sar_split *split,
+                               unsigned long seq)
 {
-  if(out->verbose >= 2) {
-    struct tm *tm;
-    char date[DATE_MAX];
-    struct passwd *p_uid;
-    struct group  *g_gid;
-    char s_mode[] = "?---------";
+  unsigned long lo = 0, hi = split->nb_units;
 
-    if(M_ISCTRL(sar_mode)) {
-      /* special file type */
-      switch(sar_mode) {
-      case(M_ICTRL | M_C_CHILD):
-        s_mode[0] = 'C';
-        printf("%s\n", s_mode);
-        return;
-      case(M_ICTRL | M_C_IGNORE):
-        s_mode[0] = 'I';
-        if(display_crc && out->verbose >= 3)
-          printf("%s\t%s {0x%x}\n", s_mode, path, crc);
-        else
-          printf("%s\t%s\n", s_mode, path);
-        return;
+  while(hi - lo > 1) {
+    unsigned long mid = (lo + hi) / 2;
+
+    if(split->units[mid].seq <= seq)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static void * walk_shard(void *arg)
+{
+  struct sar_walk *walk = arg;
+
+  add_units(walk->shard, walk->units, walk->nb_units);
+
+  /* terminate the shard */
+  write_control(walk->shard, M_C_CHILD);
+
+  return NULL;
+}
+
+/* Split the roots in shards of roughly equal payload size. A first
+   walk which only stats nodes cuts the roots in units, each shard
+   then takes the next units in walk order until it holds its share
+   of the size left. A shard does not stop before the last unit linked
+   to its units so that hard links stay in one shard. The shards are
+   walked at once, each by its own thread. Shards left without units
+   are still written, they only hold an empty tree. */
+static void add_shards(struct sar_file *out,
+                       char * const *paths, unsigned int nb_paths)
+{
+  struct sar_split split = { 0 };
+  struct sar_unit *units;
+  struct sar_walk *walks;
+  unsigned long nb_units, *reach, t, u = 0;
+  off_t size = 0, left;
+  unsigned int i, n = 0;
+  char *wp;
+
+  for(i = 0 ; i < nb_paths ; i++)
+    scan_tree(paths[i], scan_size, &size);
+
+  split.quota  = MAX(size / out->nb_shards, 1);
+  split.hl_tbl = ht_create(HL_TBL_SZ, hl_hash, hl_compare, hl_destroy);
+  wp           = xmalloc(WP_MAX);
+
+  for(i = 0 ; i < nb_paths ; i++) {
+    size_t len = n_strncpy(wp, paths[i], WP_MAX - 1);
+
+    /* remove trailing / */
+    while(len > 1 && wp[len - 1] == '/')
+      wp[--len] = '\0';
+
+    /* the file system root already ends with a slash */
+    if(!strcmp(wp, "/"))
+      wp[--len] = '\0';
+
+    split_tree(&split, wp, len);
+  }
+
+  units    = split.units;
+  nb_units = split.nb_units;
+
+  /* the last unit that each unit is linked to */
+  reach = xmalloc(sizeof(unsigned long) * (nb_units + 1));
+  for(u = 0 ; u < nb_units ; u++)
+    reach[u] = u;
+
+  for(t = 0 ; t < split.nb_ties ; t++) {
+    unsigned long a = find_unit(&split, split.ties[t].first);
+    unsigned long b = find_unit(&split, split.ties[t].link);
+
+    reach[a] = MAX(reach[a], b);
+  }
+
+  walks = xmalloc(sizeof(struct sar_walk) * out->nb_shards);
+  left  = size;
+  u     = 0;
+
+  for(i = 0 ; i < out->nb_shards ; i++) {
+    off_t share = left / (out->nb_shards - i), fill = 0;
+    bool last   = i + 1 == out->nb_shards;
+
+    walks[i].shard = out->shards[i];
+    walks[i].units = &units[u];
+
+    while(u < nb_units) {
+      unsigned long end = u, k;
+      off_t block = 0;
+
+      /* units tied by hard links are taken together */
+      for(k = u ; k <= end ; k++) {
+        end    = MAX(end, reach[k]);
+        block += units[k].size;
       }
-    }
-    else {
-      /* regular file type */
-      switch(mode & S_IFMT) {
-      case(S_IFSOCK):
-        s_mode[0] = 's';
-        break;
-      case(S_IFLNK):
-        s_mode[0] = 'l';
-        break;
-      case(S_IFREG):
-        s_mode[0] = '-';
-        break;
-      case(S_IFDIR):
-        s_mode[0] = 'd';
-        break;
-      case(S_IFBLK):
-        s_mode[0] = 'b';
-        break;
-      case(S_IFCHR):
-        s_mode[0] = 'c';
-        break;
-      case(S_IFIFO):
-        s_mode[0] = 'p';
+
+      /* a block goes to the shard where its middle falls */
+      if(walks[i].units != &units[u] && !last && fill + block / 2 >= share)
         break;
-      }
 
-      /* basic permissions */
-      if(mode & S_IRUSR)
-        s_mode[1] = 'r';
-      if(mode & S_IWUSR)
-        s_mode[2] = 'w';
-      if(mode & S_IXUSR)
-        s_mode[3] = 'x';
-      if(mode & S_IRGRP)
-        s_mode[4] = 'r';
-      if(mode & S_IWGRP)
-        s_mode[5] = 'w';
-      if(mode & S_IXGRP)
-        s_mode[6] = 'x';
-      if(mode & S_IROTH)
-        s_mode[7] = 'r';
-      if(mode & S_IWOTH)
-        s_mode[8] = 'w';
-      if(mode & S_IXOTH)
-        s_mode[9] = 'x';
+      fill += block;
+      u     = end + 1;
+    }
 
-      /* extended permissions */
-      if(mode & S_ISUID) {
-        if(s_mode[3] == 'x')
-          s_mode[3] = 's';
-        else
-          s_mode[3] = 'S';
-      }
-      if(mode & S_ISGID) {
-        if(s_mode[6] == 'x')
-          s_mode[6] = 's';
-        else
-          s_mode[6] = 'S';
-      }
-      if(mode & S_ISVTX) {
-        if(s_mode[9] == 'x')
-          s_mode[9] = 't';
-        else
-          s_mode[9] = 'T';
-      }
+    walks[i].nb_units = &units[u] - walks[i].units;
+    left             -= fill;
+
+    if(walks[i].nb_units)
+      n++;
+  }
+
+  verbose(0, out->verbose, "sharding %ld bytes in %u of %u shards\n",
+          (long)size, n, out->nb_shards);
+
+  for(i = 0 ; i < out->nb_shards ; i++) {
+    int r = pthread_create(&walks[i].thread, NULL, walk_shard, &walks[i]);
+
+    if(r) {
+      errno = r;
+      err(EXIT_FAILURE, "cannot create thread");
     }
+  }
 
-    if((sar_mode & M_IFMT) == M_IHARD) {
-      s_mode[0] = 'h';
+  for(i = 0 ; i < out->nb_shards ; i++)
+    pthread_join(walks[i].thread, NULL);
+
+  for(u = 0 ; u < nb_units ; u++)
+    free(units[u].path);
+  ht_destroy(split.hl_tbl);
+  free(split.ties);
+  free(units);
+  free(reach);
+  free(walks);
+  free(wp);
+}
 
-      if(display_crc && out->verbose >= 3)
-        printf("%s\t%s -> %s {0x%x}\n", s_mode, path, link, crc);
-      else
-        printf("%s\t%s -> %s\n", s_mode, path, link);
-      return;
+struct sar_spread {
+  char *buf;               /* chunks put end to end */
+  size_t size;
+  uint64_t pos;            /* payload walked so far */
+  uint64_t next;           /* payload offset of the next chunk */
+  uint64_t stride;         /* payload between two chunks */
+  size_t fill;             /* bytes missing in the current chunk */
+};
+
+/* Collect chunks spread evenly over the payload. A chunk continues
+   through the following files until it is full like a block would. */
+static bool scan_spread(const char *path, const struct stat *st, void *data)
+{
+  struct sar_spread *spread = data;
+  uint64_t start = spread->pos;
+  off_t size, offset = 0;
+  int fd = -1;
+
+  if(!S_ISREG(st->st_mode))
+    return true;
+
+  /* hard linked files are counted once per group as in scan_size() */
+  size         = st->st_size / st->st_nlink;
+  spread->pos += size;
+
+  while(spread->size < AUTO_SAMPLES && offset < size) {
+    ssize_t n;
+
+    if(!spread->fill) {
+      if(spread->next >= spread->pos)
+        break;
+
+      offset        = MAX(offset, (off_t)(spread->next - start));
+      spread->fill  = AUTO_CHUNK;
+      spread->next += spread->stride;
     }
 
-    printf("%s\t", s_mode);
+    if(fd < 0 && (fd = open(path, O_RDONLY)) < 0)
+      break;
 
-    /* user name / group name */
-    p_uid = getpwuid(uid);
-    g_gid = getgrgid(gid);
+    n = pread(fd, spread->buf + spread->size,
+              MIN(spread->fill, (size_t)(size - offset)), offset);
+    if(n <= 0)
+      break;
+
+    spread->size += n;
+    spread->fill -= n;
+    offset       += n;
+  }
+
+  /* the file is read again when archived */
+  if(fd >= 0) {
+    close(fd);
+    restore_time(path, st);
+  }
+
+  return spread->size < AUTO_SAMPLES;
+}
+
+static double elapsed(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* a few levels across the range along with the default one */
+static bool bench_candidate(const struct codec *codec, int level)
+{
+  int min, max, step;
+
+  codec_range(codec, &min, &max);
+
+  for(step = 0 ; step <= AUTO_LEVELS ; step++)
+    if(min + (max - min) * step / AUTO_LEVELS == level)
+      return true;
+
+  return level == codec_level(codec, LEVEL_DEFAULT);
+}
+
+struct sar_bench {
+  const struct sar_spread *spread;
+  unsigned int *order;     /* chunks in a shuffled order */
+  unsigned int nb_chunks;
+  size_t *ref;             /* packed size of each chunk at the reference */
+  double ref_ratio;        /* ratio of the whole sample at the reference */
+};
+
+/* Compress chunks of the sample for a while, or all of them for the
+   reference. The chunks are taken in a shuffled order so that a short
+   run still covers the whole tree. Slow levels only see a few chunks,
+   so their ratio is scaled from the reference on the same chunks.
+   Return the speed in MiB/s and the ratio. */
+static void bench_level(struct sar_bench *bench,
+                        const struct codec *codec, int level,
+                        double *speed, double *ratio)
+{
+  const struct sar_spread *spread = bench->spread;
+  unsigned char *packed = xmalloc(AUTO_CHUNK);
+  uint64_t plain_size = 0, packed_size = 0, ref_size = 0;
+  struct timespec start;
+  double t = 0;
+  unsigned int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(i = 0 ; i < bench->nb_chunks ; i++) {
+    unsigned int chunk = bench->order[i];
+    size_t offset = (size_t)chunk * AUTO_CHUNK;
+    size_t size   = MIN(spread->size - offset, AUTO_CHUNK);
+    size_t n;
+
+    if(bench->ref_ratio && i && t >= AUTO_TIME)
+      break;
+
+    n = codec_pack(codec, level, spread->buf + offset, size,
+                   packed, size);
+
+    /* blocks which do not shrink are stored */
+    n = n ? n : size;
+
+    if(!bench->ref_ratio)
+      bench->ref[chunk] = n;
+
+    plain_size  += size;
+    packed_size += n;
+    ref_size    += bench->ref[chunk];
+
+    t = elapsed(&start);
+  }
+
+  free(packed);
+
+  if(!bench->ref_ratio)
+    bench->ref_ratio = (double)plain_size / packed_size;
+
+  *speed = plain_size / (1024. * 1024.) / MAX(t, 1e-6);
+  *ratio = bench->ref_ratio * ref_size / packed_size;
+}
+
+/* Choose the built-in codec and level with the best ratio among
+   those compressing at least at the target speed on one thread.
+   They are measured on a sample of the roots and the table is
+   printed so that the choice may be given explicitly next time.
+   The lowest level of the first codec is the reference. */
+void sar_auto(struct sar_compress *compress,
+              char * const *paths, unsigned int nb_paths)
+{
+  struct sar_spread spread = { .buf = xmalloc(AUTO_SAMPLES) };
+  struct sar_bench bench   = { .spread = &spread };
+  const struct codec *codec, *best = NULL, *fastest = NULL;
+  double best_ratio = 0, fastest_speed = 0;
+  int best_level = 0, fastest_level = 0;
+  unsigned int target = compress->target ? compress->target : AUTO_TARGET;
+  unsigned int seed = 1;
+  unsigned int i;
+  off_t size = 0;
+
+  if(!codec_next(NULL))
+    errx(EXIT_FAILURE, "no built-in codec to choose from");
+
+  for(i = 0 ; i < nb_paths ; i++)
+    scan_tree(paths[i], scan_size, &size);
+
+  spread.stride = MAX((uint64_t)size / (AUTO_SAMPLES / AUTO_CHUNK), AUTO_CHUNK);
+
+  for(i = 0 ; i < nb_paths ; i++)
+    if(!scan_tree(paths[i], scan_spread, &spread))
+      break;
+
+  if(!spread.size)
+    errx(EXIT_FAILURE, "nothing to sample for automatic compression");
+
+  bench.nb_chunks = (spread.size + AUTO_CHUNK - 1) / AUTO_CHUNK;
+  bench.order     = xmalloc(sizeof(unsigned int) * bench.nb_chunks);
+  bench.ref       = xmalloc(sizeof(size_t) * bench.nb_chunks);
+
+  for(i = 0 ; i < bench.nb_chunks ; i++)
+    bench.order[i] = i;
+  for(i = bench.nb_chunks - 1 ; i > 0 ; i--) {
+    unsigned int j = rand_r(&seed) % (i + 1);
+    unsigned int k = bench.order[i];
+
+    bench.order[i] = bench.order[j];
+    bench.order[j] = k;
+  }
+
+  fprintf(stderr, "sampled %lu bytes in %u chunks, target %u MiB/s\n",
+          (unsigned long)spread.size, bench.nb_chunks, target);
+  fprintf(stderr, "codec  level   ratio     MiB/s\n");
+
+  for(codec = codec_next(NULL) ; codec ; codec = codec_next(codec)) {
+    int level, min, max;
+
+    codec_range(codec, &min, &max);
+
+    for(level = min ; level <= max ; level++) {
+      double speed, ratio;
+
+      if(!bench_candidate(codec, level))
+        continue;
+
+      bench_level(&bench, codec, level, &speed, &ratio);
+      fprintf(stderr, "%-6s %5d %7.3f %9.1f\n",
+              codec_name(codec), level, ratio, speed);
+
+      if(speed >= target && ratio > best_ratio) {
+        best       = codec;
+        best_level = level;
+        best_ratio = ratio;
+      }
+      if(speed > fastest_speed) {
+        fastest       = codec;
+        fastest_level = level;
+        fastest_speed = speed;
+      }
+    }
+  }
+
+  /* nothing is fast enough, do the best we can */
+  if(!best) {
+    best       = fastest;
+    best_level = fastest_level;
+  }
+
+  fprintf(stderr, "chosen: --compress-level %d with %s\n",
+          best_level, codec_name(best));
+
+  compress->program = codec_name(best);
+  compress->codec   = compress->jobs > 1 ? NULL : best;
+  compress->level   = best_level;
+
+  free(bench.order);
+  free(bench.ref);
+  free(spread.buf);
+}
+
+/* Files of the archive appended to which have other links on disk
+   are watched as if they were walked, so that new links refer to them.
+   The entries are then dropped unless they are written again. */
+static void seed_links(struct sar_file *out)
+{
+  unsigned long i;
+
+  out->seeds = xmalloc(sizeof(struct sar_hardlink) * (out->nb_toc + 1));
+
+  for(i = 0 ; i < out->nb_toc ; i++) {
+    const struct sar_toc *entry = &out->toc[i];
+    struct sar_hardlink *seed;
+    struct stat st;
+
+    if(!M_ISREG(entry->mode) || lstat(entry->path, &st) < 0 ||
+       !S_ISREG(st.st_mode) || st.st_nlink < 2)
+      continue;
+
+    seed = &out->seeds[out->nb_seeds++];
+    seed->inode  = st.st_ino;
+    seed->device = st.st_dev;
+    seed->links  = st.st_nlink;
+    seed->path   = strdup(entry->path);
+  }
+
+  if(!A_HAS_TOC(out) && !out->indexing)
+    free_toc(out);
+}
+
+/* Archive each source path as a sibling top-level subtree.
+   The first root is written directly to the archive while the
+   other ones are walked concurrently, each by its own thread into
+   a pipe. Another thread drains each pipe meanwhile, in memory up
+   to SPOOL_SZ then in a temporary file. Once the previous root is
+   written, the spool is copied and the pipe is read directly. So
+   walking roots on different devices overlaps, and only the roots
+   larger than SPOOL_SZ that wait for others go through the disk.
+
+   Each root has its own hard link table,
+   hard links across roots are archived as distinct files. */
+void sar_add(struct sar_file *out, char * const *paths, unsigned int nb_paths)
+{
+  assert(out);
+  assert(out->file || out->fifo || out->shards || out->copy);
+  assert(paths);
+  assert(nb_paths > 0);
+
+  struct sar_spool *spools = NULL;
+  unsigned int i;
+
+  /* the dictionary comes before any node,
+     appended nodes use the one of the archive */
+  if(out->inplace)
+    seed_links(out);
+  else if(A_HAS_DICT(out))
+    add_dict(out, paths, nb_paths);
+
+  /* shards have a walker each over their own subtrees */
+  if(out->shards) {
+    add_shards(out, paths, nb_paths);
+    return;
+  }
+
+  /* the copy mode has its own workers */
+  if(out->copy) {
+    for(i = 0 ; i < nb_paths ; i++)
+      add_root(out, paths[i]);
+    return;
+  }
+
+  /* the times of columnar archives depend on the previous node,
+     markers and aligned payloads depend on their own offset so that
+     roots cannot be spooled and are walked in order */
+  if(A_HAS_COLUMN(out) || A_HAS_SYNC(out) || out->align) {
+    for(i = 0 ; i < nb_paths ; i++)
+      add_root(out, paths[i]);
+    write_control(out, M_C_CHILD);
+    return;
+  }
+
+  if(nb_paths > 1)
+    spools = xmalloc(sizeof(struct sar_spool) * nb_paths);
+
+  for(i = 1 ; i < nb_paths ; i++) {
+    struct sar_file *file = create_sar_file();
+    int fd[2];
+    int n;
+
+    file->flags   = out->flags;
+    file->version = out->version;
+    file->verbose = out->verbose;
+    file->f_crc   = out->f_crc;
+    file->group   = out->group;
+
+    file->sparse     = out->sparse;
+    file->zero_block = out->zero_block;
+
+    file->indexing = out->indexing;
+    file->seeds    = out->seeds;
+    file->nb_seeds = out->nb_seeds;
+
+    if(out->dict)
+      file->dctx = dict_ctx_new(out->dict);
+
+    /* the root writes in a pipe drained by another thread */
+    xpipe(fd);
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    fifo_grow(fd[1]);
+
+    spools[i].fd    = fd[0];
+    spools[i].path  = paths[i];
+    spools[i].file  = file;
+    spools[i].buf   = NULL;
+    spools[i].size  = 0;
+    spools[i].tmp   = -1;
+    spools[i].taken = false;
+    pthread_mutex_init(&spools[i].lock, NULL);
+
+    file->fd   = fd[1];
+    file->file = iobuf_dopen(file->fd);
+
+    n = pthread_create(&spools[i].thread, NULL, spool_root, &spools[i]);
+    if(!n)
+      n = pthread_create(&spools[i].drainer, NULL, drain_spool, &spools[i]);
+    if(n) {
+      errno = n;
+      err(EXIT_FAILURE, "cannot create thread");
+    }
+  }
+
+  add_root(out, paths[0]);
+
+  /* each spool is copied once the previous root is written */
+  for(i = 1 ; i < nb_paths ; i++) {
+    copy_spool(out, &spools[i]);
+
+    if(spools[i].file->dctx)
+      dict_ctx_free(spools[i].file->dctx);
+    free(spools[i].file->toc);
+    free(spools[i].file);
+  }
+
+  /* terminate the archive */
+  write_control(out, M_C_CHILD);
+
+  free(spools);
+}
+
+/* Columnar archives keep each field of the nodes in its own column,
+   the payloads are spooled meanwhile. When the archive is closed the
+   metadata is written first so that listing stops right after it.
+
+   metadata : number of columns (1) | { column size (8) } ... | columns
+   data     : payloads in the order of the nodes */
+static void column_put(struct sar_column *column, const void *buf,
+                       size_t count)
+{
+  if(column->size + count > column->alloc) {
+    column->alloc = MAX(column->alloc * 2, column->size + count);
+    column->alloc = MAX(column->alloc, 4096);
+    column->buf   = xrealloc(column->buf, column->alloc);
+  }
+
+  memcpy(column->buf + column->size, buf, count);
+  column->size += count;
+}
+
+static void column_get(struct sar_column *column, void *buf, size_t count)
+{
+  if(count > column->size - column->pos)
+    errx(EXIT_FAILURE, "IO read error or inconsistent archive");
+
+  if(buf)
+    memcpy(buf, column->buf + column->pos, count);
+  column->pos += count;
+}
+
+/* the block archive needs to know which payloads are stored raw */
+static void spool_write(struct sar_file *out, const void *buf, size_t count)
+{
+  if(!count)
+    return;
+
+  if(out->raw != (out->nb_runs & 1)) {
+    if(out->nb_runs == out->runs_size) {
+      out->runs_size = out->runs_size ? out->runs_size * 2 : 64;
+      out->runs      = xrealloc(out->runs, sizeof(off_t) * out->runs_size);
+    }
+
+    out->runs[out->nb_runs++] = out->spool_size;
+  }
+
+  xiobuf_write(out->spool, buf, count);
+  out->spool_size += count;
+}
+
+static void write_columns(struct sar_file *out)
+{
+  char *iobuf = xmalloc(IO_SZ);
+  uint8_t nb_columns = COL_DATA - COL_MODE;
+  unsigned int i, run = 0;
+  off_t pos = 0;
+  ssize_t n;
+
+  out->column = COL_STREAM;
+
+  stream_write(out, &nb_columns, sizeof(nb_columns));
+
+  for(i = COL_MODE ; i < COL_DATA ; i++) {
+    uint64_t size = htole64(out->columns[i].size);
+    stream_write(out, &size, sizeof(size));
+  }
+
+  for(i = COL_MODE ; i < COL_DATA ; i++) {
+    if(out->columns[i].size)
+      stream_write(out, out->columns[i].buf, out->columns[i].size);
+    free(out->columns[i].buf);
+  }
+
+  /* the spool works on a duplicate */
+  iobuf_close(out->spool);
+  UNPTR(out->spool);
+
+  if(lseek(out->spool_fd, 0, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek payload spool");
+
+  while((n = xread(out->spool_fd, iobuf, IO_SZ))) {
+    char *s = iobuf;
+
+    while(n) {
+      off_t end = run < out->nb_runs ? out->runs[run] : pos + n;
+      size_t count = MIN(n, end - pos);
+
+      if(!count) {
+        run++;
+        continue;
+      }
+
+      out->raw = run & 1;
+      stream_write(out, s, count);
+
+      s   += count;
+      pos += count;
+      n   -= count;
+    }
+  }
+
+  out->raw = false;
+
+  close(out->spool_fd);
+  free(out->runs);
+  free(iobuf);
+}
+
+static void read_columns(struct sar_file *out)
+{
+  uint8_t nb_columns;
+  unsigned int i;
+
+  xstream_read(out, &nb_columns, sizeof(nb_columns));
+
+  if(nb_columns != COL_DATA - COL_MODE)
+    errx(EXIT_FAILURE, "unknown number of columns (%u)", nb_columns);
+
+  for(i = COL_MODE ; i < COL_DATA ; i++) {
+    uint64_t size;
+
+    xstream_read(out, &size, sizeof(size));
+    out->columns[i].size = le64toh(size);
+  }
+
+  for(i = COL_MODE ; i < COL_DATA ; i++) {
+    out->columns[i].buf = xmalloc(out->columns[i].size);
+    xstream_read(out, out->columns[i].buf, out->columns[i].size);
+  }
+}
+
+/* A listing does not read the payloads. In-process decompression
+   simply stops but children have to be killed or drained. Return
+   true when the status of the children does not matter anymore. */
+static bool stop_columns(struct sar_file *out)
+{
+  unsigned int i;
+
+  for(i = COL_MODE ; i < COL_DATA ; i++)
+    free(out->columns[i].buf);
+
+  if(!out->listed)
+    return false;
+
+  if(out->pid) {
+    kill(out->pid, SIGTERM);
+    return true;
+  }
+
+  if(out->parallel) {
+    char *iobuf = xmalloc(IO_SZ);
+
+    while(iobuf_read(out->file, iobuf, IO_SZ) > 0);
+
+    free(iobuf);
+  }
+
+  return false;
+}
+
+/* The table of contents follows the control ending the archive. It
+   gives the plain offset of each node in the archive stream, that is
+   the offset in the file for archives which are not compressed.
+
+   toc    : { node offset (8) | payload offset (8) | size (8) | crc (4) |
+              mode (2) | path size (2) | path } ...
+   footer : toc offset (8) | number of entries (4) | magik (4) */
+static struct sar_toc * new_toc(struct sar_file *out)
+{
+  if(out->nb_toc == out->toc_size) {
+    out->toc_size = out->toc_size ? out->toc_size * 2 : 256;
+    out->toc      = xrealloc(out->toc, sizeof(struct sar_toc) *
+                                       out->toc_size);
+  }
+
+  return &out->toc[out->nb_toc++];
+}
+
+static void add_toc(struct sar_file *out, uint64_t node, uint16_t mode,
+                    off_t size, uint32_t crc)
+{
+  struct sar_toc *entry = new_toc(out);
+  const char *path = out->wp;
+
+  /* paths are given as readers see them */
+  while(*path == '/')
+    path++;
+
+  entry->path    = strdup(path);
+  entry->node    = node;
+  entry->payload = out->payload_offset;
+  entry->size    = 0;
+  entry->crc     = A_HAS_CRC(out) ? crc : 0;
+  entry->mode    = mode;
+
+  if(M_ISREG(mode) || M_ISLNK(mode) || M_ISDEAD(mode))
+    entry->size = size;
+}
+
+/* append the entries of a spooled root copied at an offset */
+static void merge_toc(struct sar_file *out, struct sar_file *spool,
+                      uint64_t offset)
+{
+  unsigned long i;
+
+  for(i = 0 ; i < spool->nb_toc ; i++) {
+    struct sar_toc *entry = new_toc(out);
+
+    *entry          = spool->toc[i];
+    entry->node    += offset;
+    entry->payload += offset;
+  }
+}
+
+/* encode an entry without its path, returns the size of the path */
+static uint16_t encode_toc(const struct sar_toc *entry,
+                           unsigned char *s_entry)
+{
+  uint16_t len = strlen(entry->path);
+  uint64_t u64;
+  uint32_t u32;
+  uint16_t u16;
+
+  u64 = htole64(entry->node);
+  memcpy(s_entry, &u64, sizeof(u64));
+  u64 = htole64(entry->payload);
+  memcpy(s_entry + 8, &u64, sizeof(u64));
+  u64 = htole64(entry->size);
+  memcpy(s_entry + 16, &u64, sizeof(u64));
+  u32 = htole32(entry->crc);
+  memcpy(s_entry + 24, &u32, sizeof(u32));
+  u16 = htole16(entry->mode);
+  memcpy(s_entry + 28, &u16, sizeof(u16));
+  u16 = htole16(len);
+  memcpy(s_entry + 30, &u16, sizeof(u16));
+
+  return len;
+}
+
+static void write_toc(struct sar_file *out)
+{
+  uint64_t toc_offset = htole64(out->offset);
+  uint32_t nb_entries = htole32(out->nb_toc);
+  uint32_t magik      = htole32(TOC_MAGIK);
+  unsigned long i;
+
+  out->column = COL_STREAM;
+
+  for(i = 0 ; i < out->nb_toc ; i++) {
+    const struct sar_toc *entry = &out->toc[i];
+    unsigned char s_entry[TOC_ENTRY];
+    uint16_t len = encode_toc(entry, s_entry);
+
+    stream_write(out, s_entry, sizeof(s_entry));
+    if(len)
+      stream_write(out, entry->path, len);
+  }
+
+  stream_write(out, &toc_offset, sizeof(toc_offset));
+  stream_write(out, &nb_entries, sizeof(nb_entries));
+  stream_write(out, &magik, sizeof(magik));
+
+  free_toc(out);
+}
+
+static void free_toc(struct sar_file *out)
+{
+  unsigned long i;
+
+  for(i = 0 ; i < out->nb_toc ; i++)
+    free(out->toc[i].path);
+  free(out->toc);
+
+  out->toc    = NULL;
+  out->nb_toc = 0;
+}
+
+/* size of the plain archive when it may be read at any offset */
+static bool plain_size(struct sar_file *out, uint64_t *size)
+{
+  struct stat st;
+
+  if(out->block) {
+    struct block_stat stat;
+
+    if(!block_table(out->block))
+      return false;
+
+    block_stat(out->block, &stat);
+    *size = ARCHIVE_HDR + stat.plain;
+
+    return true;
+  }
+
+  if(out->cs || out->fifo || out->parallel)
+    return false;
+
+  if(fstat(out->fd, &st) < 0 || !S_ISREG(st.st_mode))
+    return false;
+
+  *size = st.st_size;
+
+  return true;
+}
+
+/* read the plain archive at any offset, the stream is left alone */
+static bool plain_read(struct sar_file *out, void *buf, size_t count,
+                       uint64_t offset)
+{
+  if(out->block) {
+    struct block *at;
+    size_t n = 0;
+
+    if(offset < ARCHIVE_HDR)
+      return false;
+
+    at = block_at(out->block, offset - ARCHIVE_HDR);
+    if(!at)
+      return false;
+
+    while(n < count) {
+      size_t r = block_read(at, (char *)buf + n, count - n);
+
+      if(!r)
+        break;
+      n += r;
+    }
+
+    block_close(at);
+
+    return n == count;
+  }
+
+  return pread(out->fd, buf, count, offset) == (ssize_t)count;
+}
+
+/* decode the entries of a table, false when it is inconsistent */
+static bool decode_toc(struct sar_file *out, const unsigned char *s,
+                       const unsigned char *end, uint32_t nb_entries)
+{
+  unsigned long i;
+
+  /* never leave an empty table, it marks a table not loaded yet */
+  out->toc      = xmalloc(sizeof(struct sar_toc) * (nb_entries + 1));
+  out->toc_size = nb_entries + 1;
+
+  for(i = 0 ; i < nb_entries ; i++) {
+    struct sar_toc *entry = &out->toc[i];
+    uint64_t u64;
+    uint32_t u32;
+    uint16_t u16, len;
+
+    if(end - s < TOC_ENTRY)
+      break;
+
+    memcpy(&u64, s, sizeof(u64));
+    entry->node = le64toh(u64);
+    memcpy(&u64, s + 8, sizeof(u64));
+    entry->payload = le64toh(u64);
+    memcpy(&u64, s + 16, sizeof(u64));
+    entry->size = le64toh(u64);
+    memcpy(&u32, s + 24, sizeof(u32));
+    entry->crc = le32toh(u32);
+    memcpy(&u16, s + 28, sizeof(u16));
+    entry->mode = le16toh(u16);
+    memcpy(&len, s + 30, sizeof(len));
+    len = le16toh(len);
+    s  += TOC_ENTRY;
+
+    if(end - s < len)
+      break;
+
+    entry->path = strndup((const char *)s, len);
+    s += len;
+
+    out->nb_toc++;
+  }
+
+  return out->nb_toc == nb_entries;
+}
+
+/* An index written beside an archive once it was scanned holds the
+   table of contents the archive lacks and the checkpoints where its
+   decompression may resume. It is ignored once the archive changed.
+
+   header     : magik (4) | archive size (8) | archive mtime (8) |
+                number of checkpoints (4) | number of entries (4)
+   checkpoint : packed offset (8) | plain offset (8) | bits (1) |
+                window size (2) | packed window size (2) | window
+   followed by the entries of the table of contents */
+static char * sidecar_name(const char *path, const char *ext)
+{
+  char *name = xmalloc(strlen(path) + strlen(ext) + 1);
+
+  sprintf(name, "%s%s", path, ext);
+
+  return name;
+}
+
+/* the nodes of the archive may be read in any order */
+static bool seekable(struct sar_file *out)
+{
+  struct stat st;
+
+  if(out->block)
+    return block_table(out->block);
+
+  if(out->fifo || out->parallel || fstat(out->fd, &st) < 0)
+    return false;
+
+  return S_ISREG(st.st_mode);
+}
+
+static struct cpoint * decode_cpoints(const unsigned char **s,
+                                      const unsigned char *end,
+                                      uint32_t nb_cps)
+{
+  const struct codec *zlib = codec_find("gzip");
+  struct cpoint *cps = xmalloc(sizeof(struct cpoint) * (nb_cps + 1));
+  uint32_t i;
+
+  for(i = 0 ; i < nb_cps ; i++) {
+    struct cpoint *cp = &cps[i];
+    uint64_t u64;
+    uint16_t u16, packed_size;
+
+    if(end - *s < INDEX_CPOINT)
+      break;
+
+    memcpy(&u64, *s, sizeof(u64));
+    cp->packed = le64toh(u64);
+    memcpy(&u64, *s + 8, sizeof(u64));
+    cp->plain = le64toh(u64);
+    cp->bits  = (*s)[16];
+    memcpy(&u16, *s + 17, sizeof(u16));
+    cp->window_size = le16toh(u16);
+    memcpy(&u16, *s + 19, sizeof(u16));
+    packed_size = le16toh(u16);
+    *s += INDEX_CPOINT;
+
+    cp->window = NULL;
+    if(!cp->window_size)
+      continue;
+
+    cp->window = xmalloc(cp->window_size);
+
+    /* windows are compressed unless they would not shrink */
+    if(!packed_size && end - *s >= cp->window_size) {
+      memcpy(cp->window, *s, cp->window_size);
+      *s += cp->window_size;
+    }
+    else if(packed_size && end - *s >= packed_size && zlib &&
+            codec_unpack(zlib, *s, packed_size, cp->window, cp->window_size))
+      *s += packed_size;
+    else {
+      free(cp->window);
+      break;
+    }
+  }
+
+  if(i == nb_cps)
+    return cps;
+
+  while(i--)
+    free(cps[i].window);
+  free(cps);
+
+  return NULL;
+}
+
+/* load the sidecar index of an archive */
+static bool read_index(struct sar_file *out)
+{
+  unsigned char *buf;
+  const unsigned char *s, *end;
+  struct cpoint *cps;
+  struct stat st, st_index;
+  uint64_t size, mtime;
+  uint32_t nb_cps, nb_entries, magik;
+  iofile_t file;
+  char *path;
+  int fd;
+
+  if(!out->path || !seekable(out) || fstat(out->fd, &st) < 0)
+    return false;
+
+  path = sidecar_name(out->path, INDEX_EXT);
+  fd   = open(path, O_RDONLY);
+
+  if(fd < 0) {
+    free(path);
+    return false;
+  }
+
+  if(fstat(fd, &st_index) < 0 || st_index.st_size < INDEX_HEADER)
+    errx(EXIT_FAILURE, "inconsistent index \"%s\"", path);
+
+  buf  = xmalloc(st_index.st_size);
+  file = iobuf_dopen(fd);
+  xxiobuf_read(file, buf, st_index.st_size);
+  iobuf_close(file);
+
+  memcpy(&magik, buf, sizeof(magik));
+  memcpy(&size, buf + 4, sizeof(size));
+  memcpy(&mtime, buf + 12, sizeof(mtime));
+  memcpy(&nb_cps, buf + 20, sizeof(nb_cps));
+  memcpy(&nb_entries, buf + 24, sizeof(nb_entries));
+  nb_cps     = le32toh(nb_cps);
+  nb_entries = le32toh(nb_entries);
+
+  if(le32toh(magik) != INDEX_MAGIK)
+    errx(EXIT_FAILURE, "inconsistent index \"%s\"", path);
+
+  if(le64toh(size) != (uint64_t)st.st_size ||
+     le64toh(mtime) != (uint64_t)st.st_mtime) {
+    warnx("index \"%s\" is out of date", path);
+    free(buf);
+    free(path);
+    return false;
+  }
+
+  s   = buf + INDEX_HEADER;
+  end = buf + st_index.st_size;
+  cps = decode_cpoints(&s, end, nb_cps);
+
+  if(!cps || !decode_toc(out, s, end, nb_entries))
+    errx(EXIT_FAILURE, "inconsistent index \"%s\"", path);
+
+  /* only the decompressor needs the checkpoints */
+  if(out->cs)
+    cstream_index(out->cs, cps, nb_cps);
+  else {
+    while(nb_cps--)
+      free(cps[nb_cps].window);
+    free(cps);
+  }
+
+  free(buf);
+  free(path);
+
+  return true;
+}
+
+/* load the table of contents through the footer of a seekable archive */
+static bool read_toc(struct sar_file *out)
+{
+  unsigned char footer[TOC_FOOTER];
+  unsigned char *buf;
+  uint64_t size = 0, toc_offset;
+  uint32_t nb_entries, magik;
+  bool consistent;
+
+  if(out->toc)
+    return true;
+
+  /* archives without table may have been indexed */
+  if(!A_HAS_TOC(out))
+    return read_index(out);
+
+  if(!plain_size(out, &size) || size < TOC_FOOTER ||
+     !plain_read(out, footer, TOC_FOOTER, size - TOC_FOOTER))
+    return false;
+
+  memcpy(&toc_offset, footer, sizeof(toc_offset));
+  memcpy(&nb_entries, footer + 8, sizeof(nb_entries));
+  memcpy(&magik, footer + 12, sizeof(magik));
+  toc_offset = le64toh(toc_offset);
+  nb_entries = le32toh(nb_entries);
+
+  if(le32toh(magik) != TOC_MAGIK || toc_offset > size - TOC_FOOTER)
+    return false;
+
+  size -= TOC_FOOTER + toc_offset;
+  buf   = xmalloc(size + 1);
+
+  if(!plain_read(out, buf, size, toc_offset)) {
+    free(buf);
+    return false;
+  }
+
+  consistent = decode_toc(out, buf, buf + size, nb_entries);
+  free(buf);
+
+  if(!consistent)
+    errx(EXIT_FAILURE, "inconsistent table of contents");
+
+  return true;
+}
+
+/* write to the archive through the codec if any */
+static void stream_write(struct sar_file *out, const void *buf, size_t count)
+{
+  /* columnar archives hold the nodes back until they are closed */
+  if(A_HAS_COLUMN(out) && out->column == COL_DATA) {
+    spool_write(out, buf, count);
+    return;
+  }
+  else if(A_HAS_COLUMN(out) && out->column != COL_STREAM) {
+    column_put(&out->columns[out->column], buf, count);
+    return;
+  }
+
+  out->offset += count;
+
+  if(out->cs)
+    cstream_write(out->cs, buf, count);
+  else if(out->block && out->raw)
+    block_store(out->block, buf, count);
+  else if(out->block)
+    block_write(out->block, buf, count);
+  else if(out->fifo)
+    fifo_write(out->fifo, buf, count);
+  else
+    xiobuf_write(out->file, buf, count);
+}
+
+/* read exactly count bytes from the archive */
+static void xstream_read(struct sar_file *out, void *buf, size_t count)
+{
+  if(A_HAS_COLUMN(out) && out->column != COL_STREAM &&
+     out->column != COL_DATA) {
+    column_get(&out->columns[out->column], buf, count);
+    return;
+  }
+
+  if(out->stop && out->offset + count > out->stop)
+    inconsistent(out);
+
+  out->offset += count;
+
+  if(!out->cs && !out->block && !out->fifo) {
+    xxiobuf_read(out->file, buf, count);
+    return;
+  }
+
+  while(count) {
+    size_t n;
+
+    if(out->cs)
+      n = cstream_read(out->cs, buf, count);
+    else if(out->block)
+      n = block_read(out->block, buf, count);
+    else
+      n = fifo_read(out->fifo, buf, count);
+
+    if(!n)
+      errx(EXIT_FAILURE, "IO read error or inconsistent archive");
+
+    buf    = (char *)buf + n;
+    count -= n;
+  }
+}
+
+static void xstream_skip(struct sar_file *out, off_t size)
+{
+  if(A_HAS_COLUMN(out) && out->column != COL_STREAM &&
+     out->column != COL_DATA) {
+    column_get(&out->columns[out->column], NULL, size);
+    return;
+  }
+
+  /* a listing never reaches the payloads of columnar archives */
+  if(A_HAS_COLUMN(out) && out->column == COL_DATA && out->listed)
+    return;
+
+  if(out->stop && out->offset + size > out->stop)
+    inconsistent(out);
+
+  if(!out->cs && !out->block && !out->fifo) {
+    xiobuf_skip(out->file, size);
+    out->offset += size;
+    return;
+  }
+
+  /* whole blocks are skipped without decompression */
+  if(out->block) {
+    block_skip(out->block, size);
+    out->offset += size;
+    return;
+  }
+
+  /* neither a compressed stream nor a pipe can seek */
+  while(size) {
+    char dummy[IO_SZ];
+    size_t n = MIN(size, IO_SZ);
+
+    xstream_read(out, dummy, n);
+    size -= n;
+  }
+}
+
+static void crc_write(struct sar_file *out, const void *buf, size_t count)
+{
+  if(A_HAS_CRC(out))
+    out->crc = out->f_crc(buf, count, out->crc);
+  stream_write(out, buf, count);
+}
+
+static void xcrc_read(struct sar_file *out, void *buf, size_t count)
+{
+  xstream_read(out, buf, count);
+
+  if(A_HAS_CRC(out))
+    out->crc = out->f_crc(buf, count, out->crc);
+}
+
+static char * watch_inode(struct sar_file *out)
+{
+  assert(out);
+  assert(out->hl_tbl);
+
+  struct sar_hardlink *key = xmalloc(sizeof(struct sar_hardlink));
+  struct sar_hardlink *hl;
+
+  key->inode  = out->stat.st_ino;
+  key->device = out->stat.st_dev;
+  hl = ht_search(out->hl_tbl, key, NULL);
+
+  if(hl) {
+    char *path = strdup(hl->path);
+
+    hl->links--;
+    if(hl->links <= 0)
+      ht_delete(out->hl_tbl, key);
+    free(key);
+
+    return path;
+  } else {
+    key->links  = out->stat.st_nlink;
+    key->path   = strdup(out->wp);
+    ht_search(out->hl_tbl, key, key);
+  }
+
+  return NULL;
+}
+
+static enum fsclass get_file_size_class(off_t size)
+{
+  if(size <= UINT8_MAX)
+    return N_FBYTE;
+  else if(size <= UINT16_MAX)
+    return N_FKILO;
+  else if(size <= UINT32_MAX)
+    return N_FGIGA;
+  else
+    return N_FHUGE;
+}
+
+static enum isclass get_id_size_class(uid_t uid, gid_t gid)
+{
+  if(uid == 0 && gid == 0)
+    return N_IRR;
+  else if(uid == 1000 && gid == 1000)
+    return N_IUU;
+  else if(uid == gid && uid <= UINT8_MAX)
+    return N_ISRB;
+  else if(uid == gid && uid >= 1000 && uid <= (1000 + UINT8_MAX))
+    return N_ISUB;
+  else if(uid == 0 && (gid <= UINT8_MAX))
+    return N_IRB;
+  else if(uid == 1000 && gid >= 1000 && gid <= (1000 + UINT8_MAX))
+    return N_IUB;
+  else if(uid == gid && uid <= UINT16_MAX)
+    return N_ISKILO;
+  else if(uid <= UINT8_MAX && gid <= UINT8_MAX)
+    return N_IBBYTE;
+  else if(uid >= 1000 && gid >= 1000 &&
+          uid <= (1000 + UINT8_MAX) && gid <= (1000 + UINT8_MAX))
+    return N_IBUBYTE;
+  else if(uid <= UINT8_MAX && gid <= UINT16_MAX)
+    return N_IBK;
+  else if(gid <= UINT16_MAX && uid <= UINT8_MAX)
+    return N_IKB;
+  else if(uid == gid)
+    return N_ISGIGA;
+  else if(uid <= UINT16_MAX && gid <= UINT16_MAX)
+    return N_IBKILO;
+  else if(uid <= UINT16_MAX)
+    return N_IKG;
+  else if(gid <= UINT16_MAX)
+    return N_IGK;
+  else
+    return N_IGG;
+}
+
+static enum tsclass get_time_size_class(time_t atime, time_t mtime)
+{
+  if(atime == mtime && (int32_t)atime == atime)
+    return N_TS32;
+  else if(atime == mtime)
+    return N_TS64;
+  else if((int32_t)atime == atime && (int32_t)mtime == mtime)
+    return N_TB32;
+  else
+    return N_TB64;
+}
+
+static void write_regular(struct sar_file *out, bool raw)
+{
+  char iobuf[IO_SZ];
+  enum fsclass class;
+  ssize_t n;
+  int fd;
+
+  /* store size first */
+  class = out->nsclass & N_FILE;
+  switch(class) {
+    uint8_t  size_byte;
+    uint16_t size_kilo;
+    uint32_t size_giga;
+    uint64_t size_huge;
+
+  case(N_FBYTE):
+    size_byte = out->stat.st_size;
+    crc_write(out, &size_byte, sizeof(size_byte));
+    break;
+  case(N_FKILO):
+    size_kilo = htole16(out->stat.st_size);
+    crc_write(out, &size_kilo, sizeof(size_kilo));
+    break;
+  case(N_FGIGA):
+    size_giga = htole32(out->stat.st_size);
+    crc_write(out, &size_giga, sizeof(size_giga));
+    break;
+  case(N_FHUGE):
+    size_huge = htole64(out->stat.st_size);
+    crc_write(out, &size_huge, sizeof(size_huge));
+    break;
+  }
+
+  /* store file, a transcoded payload comes from the other archive */
+  fd = -1;
+  if(!out->src) {
+    fd = open(out->wp, O_RDONLY);
+
+    /* if it fails here the archive is screwed out */
+    if(fd < 0)
+      err(EXIT_FAILURE, "cannot open \"%s\"", out->wp);
+  }
+
+  if(A_HAS_DICT(out) && !out->mapped && out->stat.st_size &&
+     out->stat.st_size <= DICT_FILE_MAX) {
+    write_small(out, fd);
+    if(fd >= 0)
+      close(fd);
+    return;
+  }
+
+  /* incompressible payloads bypass the codec */
+  out->raw            = raw;
+  out->column         = COL_DATA;
+  out->payload_offset = out->offset;
+
+  if(out->mapped && fd >= 0)
+    write_sparse(out, fd);
+  else while((n = read_payload(out, fd, iobuf, IO_SZ)))
+    crc_write(out, iobuf, n);
+
+  out->raw = false;
+
+  if(fd >= 0)
+    close(fd);
+}
+
+/* read the payload of the node being written from its file
+   or from the archive being transcoded */
+static size_t read_payload(struct sar_file *out, int fd,
+                           void *buf, size_t count)
+{
+  struct sar_file *in = out->src;
+
+  if(!in)
+    return xread(fd, buf, count);
+
+  count = MIN(count, (size_t)in->left);
+  if(!count)
+    return 0;
+
+  if(in->payload) {
+    memcpy(buf, in->payload, count);
+    in->payload += count;
+  }
+  else
+    xcrc_read(in, buf, count);
+
+  in->left -= count;
+
+  return count;
+}
+
+/* Small files are compressed alone with the dictionary, the packed
+   size comes first and is zero when the file is stored as is. */
+static void write_small(struct sar_file *out, int fd)
+{
+  unsigned char plain[DICT_FILE_MAX];
+  unsigned char packed[DICT_FILE_MAX];
+  size_t size = out->stat.st_size;
+  size_t n    = 0;
+  uint16_t s_packed;
+
+  while(n < size) {
+    ssize_t r = read_payload(out, fd, plain + n, size - n);
+
+    /* keep the archive consistent with the size already written */
+    if(!r) {
+      warnx("file \"%s\" shrunk while archived", out->wp);
+      memset(plain + n, 0, size - n);
+      break;
+    }
+
+    n += r;
+  }
+
+  n = 0;
+  if(out->dctx)
+    n = dict_pack(out->dctx, plain, size, packed, size - 1);
+
+  s_packed = htole16(n);
+  crc_write(out, &s_packed, sizeof(s_packed));
+
+  out->column         = COL_DATA;
+  out->payload_offset = out->offset;
+  if(n)
+    crc_write(out, packed, n);
+  else
+    crc_write(out, plain, size);
+}
+
+static void add_extent(struct sar_file *out, uint64_t offset, uint64_t size)
+{
+  if(out->nb_extents) {
+    struct sar_extent *last = &out->extents[out->nb_extents - 1];
+
+    if(last->offset + last->size == offset) {
+      last->size += size;
+      return;
+    }
+  }
+
+  if(out->nb_extents == out->extents_size) {
+    out->extents_size = out->extents_size ? out->extents_size * 2 : 64;
+    out->extents      = xrealloc(out->extents, sizeof(struct sar_extent) *
+                                               out->extents_size);
+  }
+
+  out->extents[out->nb_extents].offset = offset;
+  out->extents[out->nb_extents].size   = size;
+  out->nb_extents++;
+}
+
+/* comparing a buffer with itself shifted by one byte
+   lets the C library compare it word by word */
+static bool is_zero(const char *buf, size_t size)
+{
+  return !buf[0] && !memcmp(buf, buf + 1, size - 1);
+}
+
+/* the data of a region of a file without its blocks of zeros */
+static void scan_zeros(struct sar_file *out, int fd, off_t offset, off_t size)
+{
+  size_t block = out->zero_block;
+  size_t chunk = IO_SZ - IO_SZ % block;
+  char *iobuf;
+
+  if(!block) {
+    add_extent(out, offset, size);
+    return;
+  }
+
+  iobuf = xmalloc(chunk);
+
+  while(size > 0) {
+    ssize_t n = pread(fd, iobuf, MIN(size, (off_t)chunk), offset);
+    ssize_t i;
+
+    /* what cannot be read is stored, the archive tells it later */
+    if(n <= 0) {
+      add_extent(out, offset, size);
+      break;
+    }
+
+    for(i = 0 ; i < n ; i += block) {
+      size_t len = MIN(block, (size_t)(n - i));
+
+      if(!is_zero(iobuf + i, len))
+        add_extent(out, offset + i, len);
+    }
+
+    offset += n;
+    size   -= n;
+  }
+
+  free(iobuf);
+}
+
+/* Find the data of a sparse file from the holes the file system knows
+   of and from blocks of zeros when they are looked for. The file is
+   stored as usual when its data covers it all. */
+static bool scan_extents(struct sar_file *out)
+{
+  off_t size = out->stat.st_size;
+  bool holes;
+  int fd;
+
+  out->nb_extents = 0;
+
+  /* files with holes use fewer blocks than their size */
+  holes = (off_t)out->stat.st_blocks * 512 < size;
+  if(!holes && !out->zero_block)
+    return false;
+
+  fd = open(out->wp, O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  if(holes) {
+    off_t data, hole = 0;
+
+    while(hole < size) {
+      int n = seek_data(fd, hole, &data, &hole);
+
+      /* the file system does not know, zeros may still be found */
+      if(n < 0) {
+        out->nb_extents = 0;
+        holes = false;
+        break;
+      }
+
+      if(!n || data >= size)
+        break;
+
+      hole = MIN(hole, size);
+      scan_zeros(out, fd, data, hole - data);
+    }
+  }
+
+  if(!holes)
+    scan_zeros(out, fd, 0, size);
+
+  close(fd);
+
+  return out->nb_extents != 1 || out->extents[0].offset ||
+         out->extents[0].size != (uint64_t)size;
+}
+
+/* Sparse files are stored as the extents of their data. The map comes
+   first and the payload holds the data alone.
+
+   map : control (2) | number of extents (4) |
+         { offset (8) | size (8) } ... */
+static void write_extents(struct sar_file *out)
+{
+  uint16_t control = htole16(M_ICTRL | M_C_SPARSE);
+  uint32_t nb      = htole32(out->nb_extents);
+  unsigned long i;
+
+  out->column = COL_MODE;
+  crc_write(out, &control, sizeof(control));
+
+  out->column = COL_SIZE;
+  crc_write(out, &nb, sizeof(nb));
+
+  for(i = 0 ; i < out->nb_extents ; i++) {
+    uint64_t offset = htole64(out->extents[i].offset);
+    uint64_t size   = htole64(out->extents[i].size);
+
+    crc_write(out, &offset, sizeof(offset));
+    crc_write(out, &size, sizeof(size));
+  }
+}
+
+static void write_sparse(struct sar_file *out, int fd)
+{
+  char iobuf[IO_SZ];
+  bool shrunk = false;
+  unsigned long i;
+
+  for(i = 0 ; i < out->nb_extents ; i++) {
+    off_t offset = out->extents[i].offset;
+    off_t left   = out->extents[i].size;
+
+    while(left) {
+      ssize_t n = pread(fd, iobuf, MIN(left, IO_SZ), offset);
+
+      if(n < 0)
+        err(EXIT_FAILURE, "cannot read \"%s\"", out->wp);
+
+      /* keep the archive consistent with the map already written */
+      if(n == 0) {
+        if(!shrunk)
+          warnx("file \"%s\" shrunk while archived", out->wp);
+        shrunk = true;
+        n      = MIN(left, IO_SZ);
+        memset(iobuf, 0, n);
+      }
+
+      crc_write(out, iobuf, n);
+
+      offset += n;
+      left   -= n;
+    }
+  }
+}
+
+/* check whether the beginning of a file is worth compressing */
+static bool sample_regular(const struct sar_file *out)
+{
+  char sample[SAMPLE_SZ];
+  ssize_t n;
+  int fd;
+
+  /* a transcoded file keeps the choice made the first time */
+  if(out->src)
+    return !out->src->raw;
+
+  fd = open(out->wp, O_RDONLY);
+  if(fd < 0)
+    return true;
+
+  n = read(fd, sample, SAMPLE_SZ);
+  close(fd);
+
+  if(n <= 0)
+    return true;
+
+  return block_sample(out->block, sample, n);
+}
+
+static void write_link(struct sar_file *out)
+{
+  ssize_t n;
+  enum fsclass class;
+
+  /* read link */
+  if(out->src) {
+    out->link = strdup(out->src->link);
+    n         = out->src->size;
+  }
+  else
+    out->link = xreadlink_malloc_n(out->wp, &n);
+
+  /* if it fails here the archive is screwed out */
+  if(!out->link)
+    err(EXIT_FAILURE, "cannot read \"%s\"", out->wp);
+
+  /* store size */
+  class = out->nsclass & N_FILE;
+  switch(class) {
+    uint8_t  size_byte;
+    uint16_t size_kilo;
+
+  case(N_FBYTE):
+    size_byte = n;
+    crc_write(out, &size_byte, sizeof(size_byte));
+    break;
+  case(N_FKILO):
+    size_kilo = htole16(n);
+    crc_write(out, &size_kilo, sizeof(size_kilo));
+    break;
+  case(N_FGIGA):
+  case(N_FHUGE):
+    errx(EXIT_FAILURE, "link size too large for \"%s\"", out->wp);
+  }
+
+  out->column = COL_LINK;
+  crc_write(out, out->link, n);
+}
+
+static void write_dev(struct sar_file *out)
+{
+  uint64_t dev = htole64(out->stat.st_rdev);
+
+  crc_write(out, &dev, sizeof(dev));
+}
+
+static void write_control(struct sar_file *out, uint16_t id)
+{
+  uint16_t control = htole16(M_ICTRL | id);
+
+  out->column = COL_MODE;
+  stream_write(out, &control, sizeof(control));
+}
+
+static void write_name(struct sar_file *out, const char *name)
+{
+  uint8_t s_size;
+  size_t size    = strlen(name);
+
+#ifndef DISABLE_NAME_WIDTH_CHECK
+  /* check for large node name */
+  if(size > NAME_MAX) {
+    char *short_name = strndup(name, NAME_MAX);
+    size   = NAME_MAX;
+    s_size = NAME_MAX;
+
+    short_name[NAME_MAX - 1] = '~';
+    short_name[NAME_MAX]     = '\0';
+
+    crc_write(out, &s_size, sizeof(s_size));
+    crc_write(out, short_name, NAME_MAX);
+
+    warnx("name too long for \"%s\" reduced to \"%s\"", out->wp, short_name);
+
+    free(short_name);
+  }
+  else {
+    s_size = size;
+    crc_write(out, &s_size, sizeof(s_size));
+    crc_write(out, name, s_size);
+  }
+#else
+  s_size = size;
+  crc_write(out, &s_size, sizeof(s_size));
+  crc_write(out, name, size);
+#endif /* NAME_WIDTH_CHECK */
+}
+
+static void print_file(const struct sar_file *out,
+                       const char *path, const char *link,
+                      mode_t mode, uint16_t sar_mode,
+                      uid_t uid, gid_t gid,
+                      off_t size,
+                      time_t atime, time_t mtime,
+                      uint32_t crc, bool display_crc)
+{
+  FILE *fp = out->listing ? out->listing : stdout;
+
+  if(out->verbose >= 2) {
+    struct tm *tm;
+    char date[DATE_MAX];
+    struct passwd *p_uid;
+    struct group  *g_gid;
+    char s_mode[] = "?---------";
+
+    if(M_ISCTRL(sar_mode)) {
+      /* special file type */
+      switch(sar_mode) {
+      case(M_ICTRL | M_C_CHILD):
+        s_mode[0] = 'C';
+        fprintf(fp, "%s\n", s_mode);
+        return;
+      case(M_ICTRL | M_C_IGNORE):
+        s_mode[0] = 'I';
+        if(display_crc && out->verbose >= 3)
+          fprintf(fp, "%s\t%s {0x%x}\n", s_mode, path, crc);
+        else
+          fprintf(fp, "%s\t%s\n", s_mode, path);
+        return;
+      }
+    }
+    else {
+      /* regular file type */
+      switch(mode & S_IFMT) {
+      case(S_IFSOCK):
+        s_mode[0] = 's';
+        break;
+      case(S_IFLNK):
+        s_mode[0] = 'l';
+        break;
+      case(S_IFREG):
+        s_mode[0] = '-';
+        break;
+      case(S_IFDIR):
+        s_mode[0] = 'd';
+        break;
+      case(S_IFBLK):
+        s_mode[0] = 'b';
+        break;
+      case(S_IFCHR):
+        s_mode[0] = 'c';
+        break;
+      case(S_IFIFO):
+        s_mode[0] = 'p';
+        break;
+      }
+
+      /* basic permissions */
+      if(mode & S_IRUSR)
+        s_mode[1] = 'r';
+      if(mode & S_IWUSR)
+        s_mode[2] = 'w';
+      if(mode & S_IXUSR)
+        s_mode[3] = 'x';
+      if(mode & S_IRGRP)
+        s_mode[4] = 'r';
+      if(mode & S_IWGRP)
+        s_mode[5] = 'w';
+      if(mode & S_IXGRP)
+        s_mode[6] = 'x';
+      if(mode & S_IROTH)
+        s_mode[7] = 'r';
+      if(mode & S_IWOTH)
+        s_mode[8] = 'w';
+      if(mode & S_IXOTH)
+        s_mode[9] = 'x';
+
+      /* extended permissions */
+      if(mode & S_ISUID) {
+        if(s_mode[3] == 'x')
+          s_mode[3] = 's';
+        else
+          s_mode[3] = 'S';
+      }
+      if(mode & S_ISGID) {
+        if(s_mode[6] == 'x')
+          s_mode[6] = 's';
+        else
+          s_mode[6] = 'S';
+      }
+      if(mode & S_ISVTX) {
+        if(s_mode[9] == 'x')
+          s_mode[9] = 't';
+        else
+          s_mode[9] = 'T';
+      }
+    }
+
+    if((sar_mode & M_IFMT) == M_IHARD) {
+      s_mode[0] = 'h';
+
+      if(display_crc && out->verbose >= 3)
+        fprintf(fp, "%s\t%s -> %s {0x%x}\n", s_mode, path, link, crc);
+      else
+        fprintf(fp, "%s\t%s -> %s\n", s_mode, path, link);
+      return;
+    }
+
+    fprintf(fp, "%s\t", s_mode);
+
+    /* user name / group name */
+    p_uid = getpwuid(uid);
+    g_gid = getgrgid(gid);
+
+    if(p_uid)
+      fprintf(fp, "%s/", p_uid->pw_name);
+    else
+      fprintf(fp, "%d/", uid);
+
+    if(g_gid)
+      fprintf(fp, "%s\t", g_gid->gr_name);
+    else
+      fprintf(fp, "%d\t", gid);
+
+    /* size */
+    fprintf(fp, "% 9ld\t", size);
+
+    /* times */
+    tm = localtime(&atime);
+    if(tm == NULL) {
+      switch(errno) {
+      case EOVERFLOW:
+        strflargetime(date, DATE_MAX, atime);
+        break;
+      default:
+        err(1, "cannot format time");
+      }
+    } else
+      strftime(date, DATE_MAX, DATE_FORMAT,tm);
+    fprintf(fp, "%s\t", date);
+
+
+    /* path */
+    if(link)
+      fprintf(fp, "%s -> %s", path, link);
+    else
+      fprintf(fp, "%s", path);
+
+    /* crc */
+    if(display_crc && out->verbose >= 3)
+      fprintf(fp, " {0x%x}\n", out->crc);
+    else
+      fprintf(fp, "\n");
+  }
+  else if(out->verbose >= 1)
+    fprintf(fp, "%s\n", path);
+}
+
+static void show_file(const struct sar_file *out,
+                      const char *path, const char *link,
+                      mode_t mode, uint16_t sar_mode,
+                      uid_t uid, gid_t gid,
+                      off_t size,
+                      time_t atime, time_t mtime,
+                      uint32_t crc, bool display_crc)
+{
+  /* roots may be walked concurrently, also
+     getpwuid() and getgrgid() are not reentrant
+     so stdout also guards listings in memory */
+  flockfile(stdout);
+  print_file(out, path, link, mode, sar_mode, uid, gid,
+             size, atime, mtime, crc, display_crc);
+  funlockfile(stdout);
+}
+
+static int add_node(struct sar_file *out, mode_t *rmode, const char *name)
+{
+  assert(out);
+  assert(out->wp);
+  assert(name);
+
+  /* stat the file first to reupdate access time later */
+  if(lstat(out->wp, &out->stat) < 0) {
+    warn("could not stat \"%s\"", out->wp);
+    return -1;
+  }
+
+  out->link = NULL;
+
+  /* watch for hard link */
+  if(out->stat.st_nlink >= 2 && !S_ISDIR(out->stat.st_mode))
+    out->link = watch_inode(out);
+
+  if(out->copy) {
+    copy_node(out->copy, out->wp, &out->stat, out->link);
+    show_file(out, out->wp, out->link, out->stat.st_mode,
+              mode2uint16(out->stat.st_mode), out->stat.st_uid,
+              out->stat.st_gid, out->stat.st_size, out->stat.st_atime,
+              out->stat.st_mtime, 0, false);
+  }
+  else
+    write_node(out, name);
+
+  /* update remote mode */
+  if(rmode)
+    *rmode = out->stat.st_mode;
+
+  if(out->link)
+    free(out->link);
+
+  /* reupdate access time */
+  reupdate_time(out);
+
+  return 0;
+}
+
+/* serialize the node described by the current stat,
+   the current link is the hard link destination if any */
+static void write_node(struct sar_file *out, const char *name)
+{
+  enum isclass iclass;
+  enum tsclass tclass;
+  uint16_t mode, s_mode;
+  uint8_t s_nsclass;
+  uint64_t atime, mtime;
+  uint64_t node;
+
+  /* setup crc we don't care if we will compute it or not */
+  out->crc = 0;
+
+  /* a marker comes before the first node of each span */
+  if(out->sync_span && out->offset >= out->next_sync)
+    write_sync(out);
+
+  /* sparse files are stored as the extents of their data,
+     transcoded ones keep the extents they were read with */
+  if(!out->src)
+    out->mapped = out->sparse && !out->link && S_ISREG(out->stat.st_mode) &&
+                  out->stat.st_size > DICT_FILE_MAX && scan_extents(out);
+
+  /* large payloads start on the alignment, dead bytes fill the gap */
+  if(out->align && !out->link && !out->mapped &&
+     S_ISREG(out->stat.st_mode) && out->stat.st_size >= ALIGN_MIN)
+    write_padding(out, name);
+
+  node = out->offset;
+
+  /* the metadata of columnar archives is not cut in blocks */
+  if(out->block && !A_HAS_COLUMN(out))
+    mark_node(out);
+
+  /* hard link */
+  {
+    const char *link = out->link;
+
+    if(link) {
+      uint16_t s_link_sz;
+      uint16_t link_sz = strlen(link);
+
+      /* compute mode and convert endianess */
+      mode      = (mode2uint16(out->stat.st_mode) & M_IPERM) | M_IHARD;
+      s_mode    = htole16(mode);
+      s_link_sz = htole16(link_sz);
+
+      out->column = COL_MODE;
+      crc_write(out, &s_mode, sizeof(s_mode));
+      out->column = COL_NAME;
+      write_name(out, name);
+      out->column         = COL_SIZE;
+      out->payload_offset = out->offset;
+      crc_write(out, &s_link_sz, sizeof(s_link_sz));
+      out->column = COL_LINK;
+      crc_write(out, link, link_sz);
+
+      goto CRC;
+    }
+  }
+
+  if(out->mapped)
+    write_extents(out);
+
+  /* now that we stated the file and we took care of hardlink
+     we may compute node file class */
+  out->nsclass  = get_file_size_class(out->stat.st_size);
+  out->nsclass |= get_id_size_class(out->stat.st_uid, out->stat.st_gid);
+  out->nsclass |= get_time_size_class(out->stat.st_atime, out->stat.st_mtime);
+
+  /* store mode first, large files which do not
+     compress in block archives are stored as is */
+  mode = mode2uint16(out->stat.st_mode);
+  if(out->block && S_ISREG(out->stat.st_mode) &&
+     out->stat.st_size >= SAMPLE_MIN && !sample_regular(out))
+    mode |= M_IRAW;
+
+  s_mode = htole16(mode);
+  out->column = COL_MODE;
+  crc_write(out, &s_mode, sizeof(s_mode));
+
+  /* store node size class */
+  s_nsclass = htole16(out->nsclass);
+  out->column = COL_CLASS;
+  crc_write(out, &s_nsclass, sizeof(s_nsclass));
+
+  /* store uid/gid */
+  out->column = COL_ID;
+  iclass = out->nsclass & N_ID;
+  switch(iclass) {
+    uint8_t  id_byte;
+    uint16_t id_kilo;
+    uint32_t id_giga;
+
+  case(N_IRR):
+  case(N_IUU):
+    break;
+  case(N_ISRB):
+    id_byte = out->stat.st_uid;
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_ISUB):
+    id_byte = (out->stat.st_uid - 1000);
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_IRB):
+    id_byte = out->stat.st_gid;
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_IUB):
+    id_byte = out->stat.st_gid - 1000;
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_ISKILO):
+    id_kilo = htole16(out->stat.st_uid);
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+    break;
+  case(N_IBBYTE):
+    id_byte = out->stat.st_uid;
+    crc_write(out, &id_byte, sizeof(id_byte));
+
+    id_byte = out->stat.st_gid;
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_IBUBYTE):
+    id_byte = out->stat.st_uid - 1000;
+    crc_write(out, &id_byte, sizeof(id_byte));
+
+    id_byte = out->stat.st_gid - 1000;
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_IBK):
+    id_byte = out->stat.st_uid;
+    id_kilo = htole16(out->stat.st_gid);
+
+    crc_write(out, &id_byte, sizeof(id_byte));
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+    break;
+  case(N_IKB):
+    id_kilo = htole16(out->stat.st_uid);
+    id_byte = out->stat.st_gid;
+
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+    crc_write(out, &id_byte, sizeof(id_byte));
+    break;
+  case(N_ISGIGA):
+    id_giga = htole32(out->stat.st_uid);
+    crc_write(out, &id_giga, sizeof(id_giga));
+    break;
+  case(N_IBKILO):
+    id_kilo = htole16(out->stat.st_uid);
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+
+    id_kilo = htole16(out->stat.st_gid);
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+    break;
+  case(N_IKG):
+    id_kilo = htole16(out->stat.st_uid);
+    id_giga = htole32(out->stat.st_gid);
+
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+    crc_write(out, &id_giga, sizeof(id_giga));
+    break;
+  case(N_IGK):
+    id_giga = htole32(out->stat.st_uid);
+    id_kilo = htole16(out->stat.st_gid);
+
+    crc_write(out, &id_giga, sizeof(id_giga));
+    crc_write(out, &id_kilo, sizeof(id_kilo));
+  case(N_IGG):
+    id_giga = htole32(out->stat.st_uid);
+    crc_write(out, &id_giga, sizeof(id_giga));
+
+    id_giga = htole32(out->stat.st_gid);
+    crc_write(out, &id_giga, sizeof(id_giga));
+    break;
+  }
+
+  /* store atime/mtime, columnar archives store the difference with
+     the previous node truncated to the size class of the times */
+  atime = (uint64_t)out->stat.st_atime - (uint64_t)out->atime;
+  mtime = (uint64_t)out->stat.st_mtime - (uint64_t)out->mtime;
+  if(A_HAS_COLUMN(out)) {
+    out->atime = out->stat.st_atime;
+    out->mtime = out->stat.st_mtime;
+  }
+
+  out->column = COL_TIME;
+  tclass = out->nsclass & N_TIME;
+  switch(tclass) {
+    int32_t time_giga;
+    int64_t time_huge;
+
+  case(N_TS32):
+    time_giga = htole32(atime);
+    crc_write(out, &time_giga, sizeof(time_giga));
+    break;
+  case(N_TS64):
+    time_huge = htole64(atime);
+    crc_write(out, &time_huge, sizeof(time_huge));
+    break;
+  case(N_TB32):
+    time_giga = htole32(atime);
+    crc_write(out, &time_giga, sizeof(time_giga));
+
+    time_giga = htole32(mtime);
+    crc_write(out, &time_giga, sizeof(time_giga));
+    break;
+  case(N_TB64):
+    time_huge = htole64(atime);
+    crc_write(out, &time_huge, sizeof(time_huge));
+
+    time_huge = htole64(mtime);
+    crc_write(out, &time_huge, sizeof(time_huge));
+    break;
+  }
+
+  if(A_HAS_NTIME(out)) {
+    uint32_t atime_ns = htole32(out->stat.st_atim.tv_nsec);
+    uint32_t mtime_ns = htole32(out->stat.st_mtim.tv_nsec);
+
+    crc_write(out, &atime_ns, sizeof(atime_ns));
+    crc_write(out, &mtime_ns, sizeof(mtime_ns));
+  }
+
+  out->column = COL_NAME;
+  write_name(out, name);
+
+  out->column         = COL_SIZE;
+  out->payload_offset = out->offset;
+  switch(out->stat.st_mode & S_IFMT) {
+  case(S_IFREG):
+    write_regular(out, mode & M_IRAW);
+    break;
+  case(S_IFLNK):
+    write_link(out);
+    break;
+  case(S_IFCHR):
+  case(S_IFBLK):
+    write_dev(out);
+    break;
+  default:
+    break;
+  }
+
+CRC:
+  /* write crc if needed */
+  if(A_HAS_CRC(out)) {
+    uint32_t s_crc = htole32(out->crc);
+
+    out->column = COL_CRC;
+    stream_write(out, &s_crc, sizeof(s_crc));
+  }
+
+  if(A_HAS_TOC(out) || out->indexing)
+    add_toc(out, node, mode, out->stat.st_size, out->crc);
+
+  /* display file */
+  show_file(out, out->wp, out->link, out->stat.st_mode, mode, out->stat.st_uid,
+            out->stat.st_gid, out->stat.st_size, out->stat.st_atime,
+            out->stat.st_mtime, out->crc, A_HAS_CRC(out));
+}
+
+/* let the block archive cut a block before this node,
+   its parent directory is given as readers see it */
+static void mark_node(struct sar_file *out)
+{
+  char context[WP_MAX + 1];
+  const char *path = out->wp;
+  const char *s;
+
+  while(*path == '/')
+    path++;
+
+  s = strrchr(path, '/');
+  n_strncpy(context, path, s ? (size_t)(s - path) : 0);
+
+  block_node(out->block, context);
+}
+
+/* Synchronization marker telling readers which directory the next node
+   is in, so that they may start there. The offset of the marker itself
+   and the checksum tell it from the same bytes within a payload.
+
+   marker : control (2) | magik (8) | offset (8) | depth (2) |
+            path size (2) | path | crc (4) */
+static size_t encode_sync(unsigned char *marker, uint64_t offset,
+                          const char *path, uint16_t len)
+{
+  uint16_t control = htole16(M_ICTRL | M_C_SYNC);
+  uint64_t u64;
+  uint32_t crc;
+  uint16_t depth = 0, u16;
+  size_t i;
+
+  for(i = 0 ; i < len ; i++)
+    if(path[i] == '/')
+      depth++;
+
+  memcpy(marker, &control, sizeof(control));
+  u64 = htole64(SYNC_MAGIK);
+  memcpy(marker + 2, &u64, sizeof(u64));
+  u64 = htole64(offset);
+  memcpy(marker + 10, &u64, sizeof(u64));
+  u16 = htole16(depth);
+  memcpy(marker + 18, &u16, sizeof(u16));
+  u16 = htole16(len);
+  memcpy(marker + 20, &u16, sizeof(u16));
+  memcpy(marker + SYNC_HDR, path, len);
+
+  crc = htole32(crc32_c(marker, SYNC_HDR + len, 0));
+  memcpy(marker + SYNC_HDR + len, &crc, sizeof(crc));
+
+  return SYNC_HDR + len + sizeof(crc);
+}
+
+/* the directory is given as readers see it, with a trailing slash */
+static void write_sync(struct sar_file *out)
+{
+  unsigned char marker[SYNC_HDR + WP_MAX + sizeof(uint32_t)];
+  const char *path = out->wp;
+  const char *s;
+  size_t size;
+
+  while(*path == '/')
+    path++;
+
+  s    = strrchr(path, '/');
+  size = encode_sync(marker, out->offset, path,
+                     s ? (size_t)(s - path + 1) : 0);
+
+  out->column = COL_MODE;
+  stream_write(out, marker, size);
+
+  out->next_sync = out->offset - out->offset % out->sync_span +
+                   out->sync_span;
+}
+
+/* size of the header of a regular file up to its payload */
+static size_t regular_header(const struct sar_file *out, const char *name)
+{
+  /* giga/kilo ids are written as giga/giga after them */
+  static const uint8_t id_sizes[] = { 0, 0, 1, 1, 1, 1, 2, 2,
+                                      2, 3, 3, 4, 4, 6, 14, 8 };
+  static const uint8_t time_sizes[] = { 4, 8, 8, 16 };
+  static const uint8_t file_sizes[] = { 1, 2, 4, 8 };
+  uint8_t nsclass;
+  size_t size;
+
+  nsclass  = get_file_size_class(out->stat.st_size);
+  nsclass |= get_id_size_class(out->stat.st_uid, out->stat.st_gid);
+  nsclass |= get_time_size_class(out->stat.st_atime, out->stat.st_mtime);
+
+  /* mode, class and name size */
+  size  = sizeof(uint16_t) + 2 * sizeof(uint8_t);
+  size += id_sizes[(nsclass & N_ID) >> 2];
+  size += time_sizes[(nsclass & N_TIME) >> 6];
+  size += file_sizes[nsclass & N_FILE];
+  size += MIN(strlen(name), NAME_MAX);
+
+  if(A_HAS_NTIME(out))
+    size += 2 * sizeof(uint32_t);
+
+  return size;
+}
+
+/* Tombstone moving the payload of the next node to the alignment.
+   Readers skip it as they skip deleted nodes and it is a dead entry
+   of the table of contents. */
+static void write_padding(struct sar_file *out, const char *name)
+{
+  static const unsigned char zero[ALIGN_MAX];
+  uint64_t payload = out->offset + regular_header(out, name);
+  uint16_t control = htole16(M_ICTRL | M_C_DEAD);
+  uint32_t dead, s_dead;
+  size_t cut;
+  char *s, c;
+
+  if(payload % out->align == 0)
+    return;
+
+  payload += DEAD_HDR;
+  dead     = (out->align - payload % out->align) % out->align;
+  s_dead   = htole32(dead);
+
+  out->column = COL_MODE;
+  stream_write(out, &control, sizeof(control));
+  stream_write(out, &s_dead, sizeof(s_dead));
+  stream_write(out, zero, dead);
+
+  if(!A_HAS_TOC(out) && !out->indexing)
+    return;
+
+  /* readers give dead bytes the path of their directory */
+  s   = strrchr(out->wp, '/');
+  cut = s ? (size_t)(s - out->wp + 1) : 0;
+  c   = out->wp[cut];
+
+  out->wp[cut] = '\0';
+  add_toc(out, out->offset - DEAD_HDR - dead, M_ICTRL | M_C_DEAD,
+          DEAD_HDR + dead, 0);
+  out->wp[cut] = c;
+}
+
+/* close the current directory */
+static void leave_node(struct sar_file *out)
+{
+  if(!out->copy)
+    write_control(out, M_C_CHILD);
+}
+
+static void reupdate_time(const struct sar_file *out)
+{
+  restore_time(out->wp, &out->stat);
+}
+
+/* walk a tree without archiving it,
+   the walk stops when the callback returns false */
+static bool rec_scan(char *wp, size_t idx,
+                     bool (*f)(const char *, const struct stat *, void *),
+                     void *data)
+{
+  struct stat st;
+  bool more = true;
+
+  if(lstat(wp, &st) < 0)
+    return true;
+
+  if(!f(wp, &st, data))
+    return false;
+
+  if(S_ISDIR(st.st_mode)) {
+    struct dirent *e;
+    DIR *dp = opendir(wp);
+
+    if(!dp)
+      return true;
+
+    while(more && (e = readdir(dp))) {
+      size_t n;
+
+      /* skip special entity name */
+      if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+        continue;
+
+      n = strlen(e->d_name);
+      if(idx + n + 1 >= WP_MAX)
+        continue;
+
+      wp[idx] = '/';
+      memcpy(wp + idx + 1, e->d_name, n + 1);
+
+      more = rec_scan(wp, idx + n + 1, f, data);
+
+      wp[idx] = '\0';
+    }
+
+    closedir(dp);
+  }
+
+  return more;
+}
+
+static bool scan_tree(const char *path,
+                      bool (*f)(const char *, const struct stat *, void *),
+                      void *data)
+{
+  char *wp = xmalloc(WP_MAX);
+  bool more;
+
+  more = rec_scan(wp, n_strncpy(wp, path, WP_MAX - 1), f, data);
+
+  free(wp);
+
+  return more;
+}
+
+static void rec_add(struct sar_file *out, const char *node)
+{
+  assert(out);
+  assert(out->wp);
+
+  mode_t mode;
+
+  if(add_node(out, &mode, node) < 0)
+    return;
+
+  if(S_ISDIR(mode)) {
+    struct dirent *e;
+    DIR *dp = opendir(out->wp);
+
+    if(!dp) {
+      /* the directory node is already written,
+         close it anyway to keep the archive consistent */
+      warn("cannot open \"%s\"", out->wp);
+      leave_node(out);
+      return;
+    }
+
+    if(out->group)
+      add_grouped(out, dp);
+    else {
+      while((e = readdir(dp))) {
+        /* skip special entity name */
+        if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+          continue;
+
+        add_child(out, e->d_name);
+      }
+    }
+
+    closedir(dp);
+
+    /* append control information */
+    leave_node(out);
+  }
+}
+
+static void add_child(struct sar_file *out, const char *name)
+{
+  size_t idx = out->wp_idx;
+  const char *s;
+
+  if(idx + strlen(name) + 1 >= WP_MAX) {
+    warnx("path too long for \"%s/%s\"", out->wp, name);
+    return;
+  }
+
+  /* append child node name */
+  out->wp[out->wp_idx++] = '/';
+
+  for(s = name ; *s != '\0' ; s++, out->wp_idx++)
+    out->wp[out->wp_idx] = *s;
+  out->wp[out->wp_idx] = '\0';
+
+  /* recurse into it */
+  rec_add(out, name);
+
+  /* restore working path */
+  out->wp_idx  = idx;
+  out->wp[idx] = '\0';
+}
+
+/* files sorted by extension then size, directories come last */
+static int cmp_entry(const void *a, const void *b)
+{
+  const struct sar_entry *ea = a;
+  const struct sar_entry *eb = b;
+  int n;
+
+  if(ea->dir != eb->dir)
+    return ea->dir - eb->dir;
+
+  n = strcmp(ea->ext, eb->ext);
+  if(n)
+    return n;
+
+  if(ea->size != eb->size)
+    return ea->size < eb->size ? -1 : 1;
+
+  return strcmp(ea->name, eb->name);
+}
+
+/* Archive the children of a directory grouped by kind, so that similar
+   files are close to each other in the compressor window. Only the
+   children of a directory may be reordered since they are enclosed in
+   their parent node. */
+static void add_grouped(struct sar_file *out, DIR *dp)
+{
+  struct sar_entry *entries = NULL;
+  size_t nb_entries = 0;
+  size_t max_entries = 0;
+  struct dirent *e;
+  size_t i;
+
+  while((e = readdir(dp))) {
+    struct sar_entry *entry;
+    struct stat st;
+
+    /* skip special entity name */
+    if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+      continue;
+
+    if(nb_entries == max_entries) {
+      max_entries = max_entries ? max_entries * 2 : 64;
+      entries     = xrealloc(entries, sizeof(struct sar_entry) * max_entries);
+    }
+
+    entry       = &entries[nb_entries++];
+    entry->name = strdup(e->d_name);
+    entry->ext  = strrchr(entry->name, '.');
+    entry->size = 0;
+    entry->dir  = false;
+
+    /* dot files have no extension */
+    if(!entry->ext || entry->ext == entry->name)
+      entry->ext = "";
+
+    if(!fstatat(dirfd(dp), e->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      entry->size = st.st_size;
+      entry->dir  = S_ISDIR(st.st_mode);
+    }
+  }
+
+  qsort(entries, nb_entries, sizeof(struct sar_entry), cmp_entry);
+
+  for(i = 0 ; i < nb_entries ; i++) {
+    add_child(out, entries[i].name);
+    free(entries[i].name);
+  }
+
+  free(entries);
+}
+
+/* Read the first bytes of the archive. Seekable archives are read in
+   place, otherwise the bytes are consumed. Only the magik number is
+   read from a plain archive so that it may be checked as usual. */
+static size_t sniff_archive(int fd, unsigned char *buf, bool *consumed)
+{
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  size_t size = 0;
+  ssize_t n;
+
+  if(pos >= 0) {
+    n = pread(fd, buf, PROGRAM_MAGIC_MAX, pos);
+    if(n < 0)
+      err(EXIT_FAILURE, "cannot read archive");
+
+    *consumed = false;
+    return n;
+  }
+
+  *consumed = true;
+
+  while(size < PROGRAM_MAGIC_MAX) {
+    n = xread(fd, buf + size, (size < 4 ? 4 : PROGRAM_MAGIC_MAX) - size);
+    if(!n)
+      break;
+
+    size += n;
+
+    if(size == 4 && !memcmp(buf, "SAR", 3))
+      break;
+  }
+
+  return size;
+}
+
+struct sar_feeder {
+  int in;                  /* archive */
+  int out;                 /* pipe to the reader */
+  unsigned char head[PROGRAM_MAGIC_MAX];
+  size_t head_size;        /* bytes already consumed */
+};
+
+static bool write_all(int fd, const void *buf, size_t count)
+{
+  while(count) {
+    ssize_t n = write(fd, buf, count);
+
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return false;
+
+    buf    = (const char *)buf + n;
+    count -= n;
+  }
+
+  return true;
+}
+
+static void * feed_archive(void *arg)
+{
+  struct sar_feeder *feeder = arg;
+  char *iobuf = xmalloc(IO_SZ);
+  sigset_t set;
+  ssize_t n;
+
+  /* the reader may stop before the end of the archive */
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  if(write_all(feeder->out, feeder->head, feeder->head_size))
+    while((n = read(feeder->in, iobuf, IO_SZ)) > 0)
+      if(!write_all(feeder->out, iobuf, n))
+        break;
+
+  close(feeder->out);
+  free(feeder);
+  free(iobuf);
+
+  return NULL;
+}
+
+/* give the consumed bytes back through a pipe fed by a thread */
+static int unread_archive(int fd, const unsigned char *head, size_t size)
+{
+  struct sar_feeder *feeder = xmalloc(sizeof(struct sar_feeder));
+  pthread_t thread;
+  int p[2];
+  int n;
+
+  xpipe(p);
+  fcntl(p[0], F_SETFD, FD_CLOEXEC);
+  fcntl(p[1], F_SETFD, FD_CLOEXEC);
+  fifo_grow(p[1]);
+
+  feeder->in        = fd;
+  feeder->out       = p[1];
+  feeder->head_size = size;
+  memcpy(feeder->head, head, size);
+
+  n = pthread_create(&thread, NULL, feed_archive, feeder);
+  if(n) {
+    errno = n;
+    err(EXIT_FAILURE, "cannot create thread");
+  }
+  pthread_detach(thread);
+
+  return p[0];
+}
+
+/* the dictionary is not needed to list the archive */
+static void read_dict(struct sar_file *out)
+{
+  uint32_t size;
+  void *buf;
+
+  xstream_read(out, &size, sizeof(size));
+  size = le32toh(size);
+
+  if(size > DICT_SZ_MAX)
+    errx(EXIT_FAILURE, "invalid dictionary size (%u)", size);
+  if(!size)
+    return;
+
+  if(!dict_supported()) {
+    xstream_skip(out, size);
+    return;
+  }
+
+  buf = xmalloc(size);
+  xstream_read(out, buf, size);
+
+  out->dict = dict_load(buf, size, LEVEL_DEFAULT);
+  out->dctx = dict_ctx_new(out->dict);
+
+  free(buf);
+}
+
+/* open an archive for reading */
+static struct sar_file * read_archive(const char *path,
+                                      const struct sar_compress *compress,
+                                      unsigned int verbose, int flags)
+{
+  unsigned char head[PROGRAM_MAGIC_MAX];
+  struct sar_compress sniffed = *compress;
+  bool consumed, has_magik = false;
+  const char *program;
+  size_t head_size;
+  uint32_t magik;
+
+  struct sar_file *out = create_sar_file();
+
+  out->verbose = verbose;
+
+  if(!path)
+    out->fd = STDIN_FILENO;
+  else {
+    out->fd = open(path, flags);
+
+    if(out->fd < 0)
+      err(EXIT_FAILURE, "could not open file \"%s\"", path);
+
+    /* its index is looked for after a change of directory */
+    out->path = realpath(path, NULL);
+  }
+
+  /* the first bytes of the archive tell which decompressor to use,
+     the options given by the user only matter for unknown streams */
+  head_size = sniff_archive(out->fd, head, &consumed);
+  program   = program_sniff(head, head_size);
+
+  if(head_size >= 3 && !memcmp(head, "SAR", 3)) {
+    sniffed.program = NULL;
+    sniffed.codec   = NULL;
+
+    /* the magik number was read from a pipe */
+    if(consumed) {
+      memcpy(&magik, head, sizeof(magik));
+      magik     = le32toh(magik);
+      has_magik = true;
+    }
+  }
+  else if(program) {
+    if(!compress->program || strcmp(compress->program, program))
+      sniffed.jobs = 0;
+    sniffed.program = program;
+    sniffed.codec   = codec_find(program);
+  }
+
+  if(consumed && !has_magik)
+    out->fd = unread_archive(out->fd, head, head_size);
+
+  compress = &sniffed;
+
+  /* a codec works on top of the iobuf opened below */
+  if(!compress->codec && compress->program && compress->jobs > 1)
+    out->parallel = parallel_decompress(compress->program, compress->jobs,
+                                        out->fd, &out->fd);
+  else if(!compress->codec && compress->program) {
+    int fd[2];
+    pid_t pid;
+
+    xpipe(fd);
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    pid = xfork();
+
+    if(!pid) /* child */ {
+      close(fd[0]);
+
+      xdup2(out->fd, STDIN_FILENO);
+      xdup2(fd[1], STDOUT_FILENO);
+
+      if(out->fd != STDIN_FILENO)
+        close(out->fd);
+      close(fd[1]);
+
+      program_exec(compress->program, LEVEL_DEFAULT, compress->threads,
+                   true);
+    }
+
+    close(fd[1]);
+    out->fd   = fd[0];
+    out->pid  = pid;
+    out->fifo = fifo_open(out->fd, false);
+  }
+
+  if(!out->fifo)
+    out->file = iobuf_dopen(out->fd);
+
+  if(compress->codec)
+    out->cs = cstream_open(compress->codec, out->file, LEVEL_DEFAULT,
+                           compress->threads, false, true);
+
+  /* check magik number */
+  if(!has_magik) {
+    xstream_read(out, &magik, sizeof(magik));
+    magik = le32toh(magik);
+  }
+
+  if((magik & ~MAGIK_FMT_VER) != MAGIK)
+    errx(EXIT_FAILURE, "incompatible magik number");
+
+  out->version = (magik & MAGIK_FMT_VER) >> 24;
+  if(out->version > MAGIK_VERSION)
+    errx(EXIT_FAILURE, "unsupported archive version %u", out->version);
+
+  /* extract flags */
+  xstream_read(out, &out->flags, sizeof(out->flags));
+
+  if(out->flags & ~A_IMASK)
+    errx(EXIT_FAILURE, "unknown flags found (%x)", out->flags);
+
+  if(out->flags & A_ICRC32_C)
+    out->f_crc = f_crc_c;
+  else
+    out->f_crc = f_crc_legacy;
+
+  /* the node stream follows in blocks */
+  if(A_HAS_BLOCK(out)) {
+    out->block   = block_open(out->file, out->fd,
+                              sizeof(magik) + sizeof(out->flags));
+    out->threads = compress->threads;
+
+    if(!out->threads)
+      out->threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+  }
+
+  if(A_HAS_DICT(out))
+    read_dict(out);
+
+  if(A_HAS_COLUMN(out))
+    read_columns(out);
+
+  /* for debugging purpose */
+  UNPTR(out->wp);
+  UNPTR(out->hl_tbl);
+
+  return out;
+}
+
+struct sar_file * sar_read(const char *path,
+                           const struct sar_compress *compress,
+                           unsigned int verbose)
+{
+  /* the nodes of an archive compacted halfway are not in order */
+  if(path) {
+    char *journal = sidecar_name(path, JOURNAL_EXT);
+    bool compacting = !access(journal, F_OK);
+
+    free(journal);
+
+    if(compacting)
+      errx(EXIT_FAILURE, "compaction of \"%s\" was interrupted, "
+           "resume it with --compact", path);
+  }
+
+  return read_archive(path, compress, verbose, O_RDONLY);
+}
+
+/* List the nodes once to record their entries, uncompressed payloads
+   are skipped with a seek. Returns the offset where the nodes end. */
+static uint64_t scan_entries(struct sar_file *out)
+{
+  unsigned int verbose = out->verbose;
+
+  if(out->block)
+    block_readahead(out->block, out->threads);
+
+  out->list_only = true;
+  out->indexing  = true;
+  out->verbose   = 0;
+  out->wp        = xmalloc(WP_MAX);
+
+  while(rec_extract(out, 0) != 1);
+
+  free(out->wp);
+  UNPTR(out->wp);
+
+  out->list_only = false;
+  out->indexing  = false;
+  out->verbose   = verbose;
+
+  return out->offset;
+}
+
+/* The node stream ends with a control node, only followed by the
+   table of contents if any. Returns the plain offset of this node. */
+static uint64_t nodes_end(struct sar_file *out)
+{
+  unsigned char footer[TOC_FOOTER];
+  uint64_t size;
+  uint16_t control;
+
+  if(!plain_size(out, &size))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+
+  if(A_HAS_TOC(out)) {
+    if(size < TOC_FOOTER ||
+       !plain_read(out, footer, TOC_FOOTER, size - TOC_FOOTER))
+      errx(EXIT_FAILURE, "inconsistent table of contents");
+
+    memcpy(&size, footer, sizeof(size));
+    size = le64toh(size);
+  }
+
+  if(size < ARCHIVE_HDR + sizeof(control) ||
+     !plain_read(out, &control, sizeof(control), size - sizeof(control)) ||
+     le16toh(control) != (M_ICTRL | M_C_CHILD))
+    errx(EXIT_FAILURE, "archive is not terminated");
+
+  return size - sizeof(control);
+}
+
+/* Open an archive to write new nodes after its own. The archive is
+   cut where its nodes end, which is only possible when it is not
+   compressed or when it is compressed in blocks. Its table of contents
+   or its index is kept to be written again with the new nodes, its
+   entries tell which files are already archived for hard links. */
+struct sar_file * sar_append(const char *path,
+                             const struct sar_compress *compress,
+                             unsigned int verbose)
+{
+  assert(path);
+
+  struct sar_compress sniffed = { .threads = compress->threads };
+  struct sar_file *out = sar_read(path, &sniffed, 0);
+  uint64_t end;
+  iofile_t file;
+  int fd;
+
+  if(out->cs || out->fifo || out->parallel)
+    errx(EXIT_FAILURE, "only uncompressed or block archives "
+         "can be appended to");
+  if(A_HAS_COLUMN(out))
+    errx(EXIT_FAILURE, "cannot append to columnar archives");
+  if(!seekable(out))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+
+  /* without table nor index the nodes are listed once */
+  if(read_toc(out) && !A_HAS_TOC(out))
+    out->indexing = true;
+  else if(!out->toc)
+    scan_entries(out);
+
+  end = nodes_end(out);
+
+  fd = open(path, O_RDWR | O_CLOEXEC);
+  if(fd < 0)
+    err(EXIT_FAILURE, "could not open file \"%s\"", path);
+  file = iobuf_dopen(fd);
+
+  if(out->block) {
+    unsigned int nb_threads = compress->threads;
+    struct block *block;
+
+    if(!nb_threads)
+      nb_threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    block = block_append(out->block, file, fd, end - ARCHIVE_HDR,
+                         compress->level, nb_threads);
+    block_close(out->block);
+    out->block = block;
+  }
+  else if(ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot truncate archive");
+
+  iobuf_close(out->file);
+
+  out->fd      = fd;
+  out->file    = file;
+  out->offset  = end;
+  out->verbose = verbose;
+  out->creat   = true;
+  out->inplace = true;
+  out->group   = compress->group;
+
+  /* the span of the markers is not recorded in the archive */
+  if(A_HAS_SYNC(out)) {
+    out->sync_span = SYNC_SPAN;
+    if(compress->sync)
+      out->sync_span = (uint64_t)compress->sync * 1024 * 1024;
+    out->next_sync = end - end % out->sync_span + out->sync_span;
+  }
+
+  /* compressed blocks gain nothing from aligned payloads */
+  if(!out->block)
+    out->align = compress->align * 1024;
+
+  out->sparse     = compress->sparse;
+  out->zero_block = compress->zero_block * 1024;
+
+  if(out->align || out->sparse)
+    raise_version(out);
+
+  return out;
+}
+
+/* Archives given dead or sparse controls in place take the version
+   older readers reject, the magik at the start is written again. */
+static void raise_version(struct sar_file *out)
+{
+  uint32_t s_magik = htole32(MAGIK_OF(MAGIK_VERSION));
+
+  if(out->version >= MAGIK_VERSION)
+    return;
+
+  if(pwrite(out->fd, &s_magik, sizeof(s_magik), 0) != sizeof(s_magik))
+    err(EXIT_FAILURE, "cannot write archive header");
+  out->version = MAGIK_VERSION;
+}
+
+/* Nodes are deleted in place by covering them with tombstones, that is
+   a dead control node followed by the size of the bytes it covers.
+   Larger spans are covered by a chain of tombstones. */
+static void bury(int fd, uint64_t offset, uint64_t size)
+{
+  unsigned char tomb[DEAD_HDR];
+  uint16_t control = htole16(M_ICTRL | M_C_DEAD);
+
+  assert(size >= DEAD_HDR);
+
+  while(size) {
+    uint64_t n = size - DEAD_HDR > UINT32_MAX ? UINT32_MAX : size;
+    uint32_t dead = htole32(n - DEAD_HDR);
+
+    memcpy(tomb, &control, sizeof(control));
+    memcpy(tomb + sizeof(control), &dead, sizeof(dead));
+
+    if(pwrite(fd, tomb, DEAD_HDR, offset) != DEAD_HDR)
+      err(EXIT_FAILURE, "cannot write archive");
+
+    offset += n;
+    size   -= n;
+  }
+}
+
+static void xpread(int fd, void *buf, size_t count, uint64_t offset)
+{
+  while(count) {
+    ssize_t n = pread(fd, buf, count, offset);
+
+    if(n <= 0)
+      err(EXIT_FAILURE, "cannot read archive");
+
+    buf     = (char *)buf + n;
+    count  -= n;
+    offset += n;
+  }
+}
+
+static void xpwrite(int fd, const void *buf, size_t count, uint64_t offset)
+{
+  while(count) {
+    ssize_t n = pwrite(fd, buf, count, offset);
+
+    if(n < 0)
+      err(EXIT_FAILURE, "cannot write archive");
+
+    buf     = (const char *)buf + n;
+    count  -= n;
+    offset += n;
+  }
+}
+
+/* readers looking for markers must not find them within dead bytes */
+static void unsync(int fd, uint64_t offset, uint64_t size)
+{
+  unsigned char *buf = xmalloc(IO_SZ);
+  uint64_t magik = htole64(SYNC_MAGIK);
+  uint64_t none  = 0;
+  uint64_t end   = offset + size;
+
+  while(offset + sizeof(magik) <= end) {
+    size_t n = MIN(IO_SZ, end - offset);
+    size_t i;
+
+    xpread(fd, buf, n, offset);
+
+    for(i = 0 ; i + sizeof(magik) <= n ; i++)
+      if(!memcmp(buf + i, &magik, sizeof(magik)))
+        xpwrite(fd, &none, sizeof(none), offset + i);
+
+    offset += n - sizeof(magik) + 1;
+  }
+
+  free(buf);
+}
+
+/* a marker moved by a compaction gives its new offset */
+static void resync(int fd, uint64_t offset)
+{
+  unsigned char marker[SYNC_HDR + WP_MAX + sizeof(uint32_t)];
+  char path[WP_MAX];
+  uint16_t len;
+  size_t size;
 
-    if(p_uid)
-      printf("%s/", p_uid->pw_name);
-    else
-      printf("%d/", uid);
+  xpread(fd, marker, SYNC_HDR, offset);
+  memcpy(&len, marker + 20, sizeof(len));
+  len = le16toh(len);
 
-    if(g_gid)
-      printf("%s\t", g_gid->gr_name);
-    else
-      printf("%d\t", gid);
+  if(len >= WP_MAX)
+    errx(EXIT_FAILURE, "inconsistent archive");
 
-    /* size */
-    printf("% 9ld\t", size);
+  xpread(fd, path, len, offset + SYNC_HDR);
 
-    /* times */
-    tm = localtime(&atime);
-    if(tm == NULL) {
-      switch(errno) {
-      case EOVERFLOW:
-        strflargetime(date, DATE_MAX, atime);
-        break;
-      default:
-        err(1, "cannot format time");
-      }
-    } else
-      strftime(date, DATE_MAX, DATE_FORMAT,tm);
-    printf("%s\t", date);
+  size = encode_sync(marker, offset, path, len);
+  xpwrite(fd, marker, size, offset);
+}
 
+/* Compactions move the nodes forward by steps recorded beforehand in a
+   journal beside the archive. A step which may overwrite the nodes it
+   moves is recorded with them.
 
-    /* path */
-    if(link)
-      printf("%s -> %s", path, link);
-    else
-      printf("%s", path);
+   journal : magik (4) | end of the nodes moved (8) |
+             start of the nodes left (8) | node boundary moved to (8) |
+             end of the nodes (8) | size of the step (4) | step */
+static void write_journal(int fd, const struct sar_journal *journal,
+                          const void *step, uint32_t size)
+{
+  unsigned char header[JOURNAL_HDR];
+  uint64_t u64;
+  uint32_t u32;
+
+  /* the header only tells of a step once it is written */
+  if(size && (pwrite(fd, step, size, JOURNAL_HDR) != size ||
+              fdatasync(fd) < 0))
+    err(EXIT_FAILURE, "cannot write journal");
+
+  u32 = htole32(JOURNAL_MAGIK);
+  memcpy(header, &u32, sizeof(u32));
+  u64 = htole64(journal->w);
+  memcpy(header + 4, &u64, sizeof(u64));
+  u64 = htole64(journal->r);
+  memcpy(header + 12, &u64, sizeof(u64));
+  u64 = htole64(journal->target);
+  memcpy(header + 20, &u64, sizeof(u64));
+  u64 = htole64(journal->end);
+  memcpy(header + 28, &u64, sizeof(u64));
+  u32 = htole32(size);
+  memcpy(header + 36, &u32, sizeof(u32));
+
+  if(pwrite(fd, header, JOURNAL_HDR, 0) != JOURNAL_HDR || fdatasync(fd) < 0)
+    err(EXIT_FAILURE, "cannot write journal");
+}
 
-    /* crc */
-    if(display_crc && out->verbose >= 3)
-      printf(" {0x%x}\n", out->crc);
-    else
-      printf("\n");
+/* returns false when no step was recorded yet */
+static bool read_journal(int fd, struct sar_journal *journal,
+                         unsigned char **step, uint32_t *size)
+{
+  unsigned char header[JOURNAL_HDR];
+  uint64_t u64;
+  uint32_t u32;
+
+  if(pread(fd, header, JOURNAL_HDR, 0) != JOURNAL_HDR)
+    return false;
+
+  memcpy(&u32, header, sizeof(u32));
+  if(le32toh(u32) != JOURNAL_MAGIK)
+    errx(EXIT_FAILURE, "inconsistent journal");
+
+  memcpy(&u64, header + 4, sizeof(u64));
+  journal->w = le64toh(u64);
+  memcpy(&u64, header + 12, sizeof(u64));
+  journal->r = le64toh(u64);
+  memcpy(&u64, header + 20, sizeof(u64));
+  journal->target = le64toh(u64);
+  memcpy(&u64, header + 28, sizeof(u64));
+  journal->end = le64toh(u64);
+  memcpy(&u32, header + 36, sizeof(u32));
+  *size = le32toh(u32);
+
+  if(journal->w > journal->r || journal->r > journal->target ||
+     journal->target > journal->end || *size > COMPACT_CHUNK)
+    errx(EXIT_FAILURE, "inconsistent journal");
+
+  *step = NULL;
+  if(*size) {
+    *step = xmalloc(*size);
+    if(pread(fd, *step, *size, JOURNAL_HDR) != *size)
+      errx(EXIT_FAILURE, "inconsistent journal");
   }
-  else if(out->verbose >= 1)
-    printf("%s\n", path);
+
+  return true;
 }
 
-static int add_node(struct sar_file *out, mode_t *rmode, const char *name)
+/* Move the next bytes of the nodes forward. They are copied directly
+   when they do not overlap their destination, otherwise they are
+   recorded in the journal before being written back. */
+static void move_step(int fd, int jfd, struct sar_journal *journal,
+                      uint32_t size)
 {
-  assert(out);
-  assert(out->wp);
-  assert(name);
-
-  enum isclass iclass;
-  enum tsclass tclass;
-  uint16_t mode, s_mode;
-  uint8_t s_nsclass;
+  if(size <= journal->r - journal->w) {
+    if(move_data(fd, journal->r, journal->w, size) < 0)
+      err(EXIT_FAILURE, "cannot move nodes");
+  }
+  else {
+    unsigned char *step = xmalloc(size);
 
-  /* stat the file first to reupdate access time later */
-  if(lstat(out->wp, &out->stat) < 0) {
-    warn("could not stat \"%s\"", out->wp);
-    return -1;
+    xpread(fd, step, size, journal->r);
+    write_journal(jfd, journal, step, size);
+    xpwrite(fd, step, size, journal->w);
+    free(step);
   }
 
-  /* setup crc and fallback variables we don't
-     care if we will compute it or not */
-  out->crc  = 0;
-  out->link = NULL;
+  if(fdatasync(fd) < 0)
+    err(EXIT_FAILURE, "cannot write archive");
 
-  /* watch for hard link */
-  if(out->stat.st_nlink >= 2 && !S_ISDIR(out->stat.st_mode)) {
-    char *link = watch_inode(out);
+  journal->w += size;
+  journal->r += size;
+  write_journal(jfd, journal, NULL, 0);
+}
 
-    if(link) {
-      uint16_t s_link_sz;
-      uint16_t link_sz = strlen(link);
+/* Carry on an interrupted compaction up to the node boundary it was
+   moving to, the dead bytes left are covered by a tombstone. Returns
+   false when the archive was not being compacted. */
+static bool recover(const char *path)
+{
+  char *name = sidecar_name(path, JOURNAL_EXT);
+  struct sar_journal journal;
+  unsigned char *step;
+  uint32_t size;
+  int fd, jfd;
 
-      /* compute mode and convert endianess */
-      mode      = (mode2uint16(out->stat.st_mode) & M_IPERM) | M_IHARD;
-      s_mode    = htole16(mode);
-      s_link_sz = htole16(link_sz);
+  jfd = open(name, O_RDWR | O_CLOEXEC);
+  free(name);
 
-      crc_write(out, &s_mode, sizeof(s_mode));
-      write_name(out, name);
-      crc_write(out, &s_link_sz, sizeof(s_link_sz));
-      crc_write(out, link, link_sz);
+  if(jfd < 0)
+    return false;
 
-      /* save link for displaying */
-      out->link = link;
+  fd = open(path, O_RDWR | O_CLOEXEC);
+  if(fd < 0)
+    err(EXIT_FAILURE, "could not open file \"%s\"", path);
+
+  if(read_journal(jfd, &journal, &step, &size)) {
+    if(step) {
+      xpwrite(fd, step, size, journal.w);
+      if(fdatasync(fd) < 0)
+        err(EXIT_FAILURE, "cannot write archive");
+
+      journal.w += size;
+      journal.r += size;
+      write_journal(jfd, &journal, NULL, 0);
+      free(step);
+    }
 
-      goto CRC;
+    while(journal.r < journal.target)
+      move_step(fd, jfd, &journal,
+                MIN(journal.target - journal.r, COMPACT_CHUNK));
+
+    if(journal.target < journal.end && journal.w < journal.r) {
+      uint8_t flags;
+
+      if(pread(fd, &flags, sizeof(flags), sizeof(uint32_t)) != sizeof(flags))
+        err(EXIT_FAILURE, "cannot read archive");
+      if(flags & A_ISYNC)
+        unsync(fd, journal.w, journal.r - journal.w);
+
+      bury(fd, journal.w, journal.r - journal.w);
+      if(fdatasync(fd) < 0)
+        err(EXIT_FAILURE, "cannot write archive");
     }
   }
 
-  /* now that we stated the file and we took care of hardlink
-     we may compute node file class */
-  out->nsclass  = get_file_size_class(out->stat.st_size);
-  out->nsclass |= get_id_size_class(out->stat.st_uid, out->stat.st_gid);
-  out->nsclass |= get_time_size_class(out->stat.st_atime, out->stat.st_mtime);
-
-  /* store mode first */
-  mode   = mode2uint16(out->stat.st_mode);
-  s_mode = htole16(mode);
-  crc_write(out, &s_mode, sizeof(s_mode));
+  close(fd);
+  close(jfd);
 
-  /* store node size class */
-  s_nsclass = htole16(out->nsclass);
-  crc_write(out, &s_nsclass, sizeof(s_nsclass));
+  return true;
+}
 
-  /* store uid/gid */
-  iclass = out->nsclass & N_ID;
-  switch(iclass) {
-    uint8_t  id_byte;
-    uint16_t id_kilo;
-    uint32_t id_giga;
+static struct sar_file * open_inplace(const char *path, unsigned int verbose)
+{
+  struct sar_compress none = { 0 };
+  struct sar_file *out = read_archive(path, &none, verbose,
+                                      O_RDWR | O_CLOEXEC);
+
+  if(out->cs || out->fifo || out->parallel || out->block)
+    errx(EXIT_FAILURE, "only uncompressed archives can be modified "
+         "in place");
+  if(A_HAS_COLUMN(out))
+    errx(EXIT_FAILURE, "cannot modify columnar archives in place");
+  if(!seekable(out))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
 
-  case(N_IRR):
-  case(N_IUU):
-    break;
-  case(N_ISRB):
-    id_byte = out->stat.st_uid;
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_ISUB):
-    id_byte = (out->stat.st_uid - 1000);
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_IRB):
-    id_byte = out->stat.st_gid;
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_IUB):
-    id_byte = out->stat.st_gid - 1000;
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_ISKILO):
-    id_kilo = htole16(out->stat.st_uid);
-    crc_write(out, &id_kilo, sizeof(id_kilo));
-    break;
-  case(N_IBBYTE):
-    id_byte = out->stat.st_uid;
-    crc_write(out, &id_byte, sizeof(id_byte));
+  return out;
+}
 
-    id_byte = out->stat.st_gid;
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_IBUBYTE):
-    id_byte = out->stat.st_uid - 1000;
-    crc_write(out, &id_byte, sizeof(id_byte));
+/* the archive goes on at this offset, what follows is written when
+   it is closed and the archive is cut there */
+static void settle(struct sar_file *out, uint64_t offset)
+{
+  int fd = xdup(out->fd);
 
-    id_byte = out->stat.st_gid - 1000;
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_IBK):
-    id_byte = out->stat.st_uid;
-    id_kilo = htole16(out->stat.st_gid);
+  iobuf_close(out->file);
 
-    crc_write(out, &id_byte, sizeof(id_byte));
-    crc_write(out, &id_kilo, sizeof(id_kilo));
-    break;
-  case(N_IKB):
-    id_kilo = htole16(out->stat.st_uid);
-    id_byte = out->stat.st_gid;
+  if(lseek(fd, offset, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek archive");
 
-    crc_write(out, &id_kilo, sizeof(id_kilo));
-    crc_write(out, &id_byte, sizeof(id_byte));
-    break;
-  case(N_ISGIGA):
-    id_giga = htole32(out->stat.st_uid);
-    crc_write(out, &id_giga, sizeof(id_giga));
-    break;
-  case(N_IBKILO):
-    id_kilo = htole16(out->stat.st_uid);
-    crc_write(out, &id_kilo, sizeof(id_kilo));
+  out->fd      = fd;
+  out->file    = iobuf_dopen(fd);
+  out->offset  = offset;
+  out->creat   = true;
+  out->inplace = true;
+}
 
-    id_kilo = htole16(out->stat.st_gid);
-    crc_write(out, &id_kilo, sizeof(id_kilo));
-    break;
-  case(N_IKG):
-    id_kilo = htole16(out->stat.st_uid);
-    id_giga = htole32(out->stat.st_gid);
+/* the entries are only kept for a table of contents or an index */
+static void keep_entries(struct sar_file *out)
+{
+  char *index;
+  bool indexed;
 
-    crc_write(out, &id_kilo, sizeof(id_kilo));
-    crc_write(out, &id_giga, sizeof(id_giga));
-    break;
-  case(N_IGK):
-    id_giga = htole32(out->stat.st_uid);
-    id_kilo = htole16(out->stat.st_gid);
+  if(A_HAS_TOC(out) || !out->toc)
+    return;
 
-    crc_write(out, &id_giga, sizeof(id_giga));
-    crc_write(out, &id_kilo, sizeof(id_kilo));
-  case(N_IGG):
-    id_giga = htole32(out->stat.st_uid);
-    crc_write(out, &id_giga, sizeof(id_giga));
+  index   = sidecar_name(out->path, INDEX_EXT);
+  indexed = !access(index, F_OK);
+  free(index);
 
-    id_giga = htole32(out->stat.st_gid);
-    crc_write(out, &id_giga, sizeof(id_giga));
-    break;
-  }
+  if(!indexed)
+    free_toc(out);
+}
 
-  /* store atime/mtime */
-  tclass = out->nsclass & N_TIME;
-  switch(tclass) {
-    int32_t time_giga;
-    int64_t time_huge;
+/* Open an uncompressed archive to modify its nodes in place. A
+   compaction which was interrupted is carried on first, the table
+   of contents, the index and the markers are then written again. */
+struct sar_file * sar_rewrite(const char *path, unsigned int verbose)
+{
+  assert(path);
 
-  case(N_TS32):
-    time_giga = htole32(out->stat.st_atime);
-    crc_write(out, &time_giga, sizeof(time_giga));
-    break;
-  case(N_TS64):
-    time_huge = htole32(out->stat.st_atime);
-    crc_write(out, &time_huge, sizeof(time_huge));
-    break;
-  case(N_TB32):
-    time_giga = htole32(out->stat.st_atime);
-    crc_write(out, &time_giga, sizeof(time_giga));
+  if(recover(path)) {
+    struct sar_file *out = open_inplace(path, 0);
+    unsigned long i;
 
-    time_giga = htole32(out->stat.st_mtime);
-    crc_write(out, &time_giga, sizeof(time_giga));
-    break;
-  case(N_TB64):
-    time_huge = htole64(out->stat.st_atime);
-    crc_write(out, &time_huge, sizeof(time_huge));
+    out->journal = sidecar_name(out->path, JOURNAL_EXT);
 
-    time_huge = htole64(out->stat.st_mtime);
-    crc_write(out, &time_huge, sizeof(time_huge));
-    break;
+    settle(out, scan_entries(out));
+    for(i = 0 ; i < out->nb_syncs ; i++)
+      resync(out->fd, out->syncs[i]);
+    keep_entries(out);
+    sar_close(out);
   }
 
-  if(A_HAS_NTIME(out)) {
-    uint32_t atime_ns = htole32(out->stat.st_atim.tv_nsec);
-    uint32_t mtime_ns = htole32(out->stat.st_mtim.tv_nsec);
+  return open_inplace(path, verbose);
+}
 
-    crc_write(out, &atime_ns, sizeof(atime_ns));
-    crc_write(out, &mtime_ns, sizeof(mtime_ns));
+static unsigned int count_dirs(const char *path)
+{
+  unsigned int n = 0;
+
+  while((path = strchr(path, '/'))) {
+    path++;
+    n++;
   }
 
-  write_name(out, name);
+  return n;
+}
 
-  switch(out->stat.st_mode & S_IFMT) {
-  case(S_IFREG):
-    write_regular(out);
-    break;
-  case(S_IFLNK):
-    write_link(out);
-    break;
-  case(S_IFCHR):
-  case(S_IFBLK):
-    write_dev(out);
-    break;
-  default:
-    break;
-  }
+/* directories leading to both paths */
+static unsigned int common_dirs(const char *a, const char *b)
+{
+  unsigned int n = 0;
+  const char *s;
 
-CRC:
-  /* write crc if needed */
-  if(A_HAS_CRC(out)) {
-    uint32_t s_crc = htole32(out->crc);
-    xiobuf_write(out->file, &s_crc, sizeof(s_crc));
+  while((s = strchr(a, '/'))) {
+    size_t len = s - a + 1;
+
+    if(strncmp(a, b, len))
+      break;
+
+    a += len;
+    b += len;
+    n++;
   }
 
-  /* update remote mode */
-  if(rmode)
-    *rmode = out->stat.st_mode;
+  return n;
+}
 
-  /* display file */
-  show_file(out, out->wp, out->link, out->stat.st_mode, mode, out->stat.st_uid,
-            out->stat.st_gid, out->stat.st_size, out->stat.st_atime,
-            out->stat.st_mtime, out->crc, A_HAS_CRC(out));
-  if(out->link)
-    free(out->link);
+/* size of the marker right before a node if any */
+static uint64_t sync_before(struct sar_file *out, const struct sar_toc *entry)
+{
+  const char *s = strrchr(entry->path, '/');
+  uint64_t size = SYNC_HDR + sizeof(uint32_t) +
+                  (s ? (uint64_t)(s - entry->path + 1) : 0);
 
-  /* reupdate access time */
-  reupdate_time(out);
+  if(!A_HAS_SYNC(out) || entry->node < size ||
+     !check_sync(out, entry->node - size, NULL))
+    return 0;
 
-  return 0;
+  return size;
 }
 
-static void reupdate_time(const struct sar_file *out)
+/* Bytes of a node and of its subtree, that is up to the next node
+   once the directories the next node is not in are closed. */
+static uint64_t dead_span(struct sar_file *out, const struct sar_toc *entry,
+                          const struct sar_toc *next, uint64_t end)
 {
-#ifdef __FreeBSD__
-  /* FreeBSD doesn't seems to support nanosecond timestamp
-     therefore we use a microsecond timestamp instead */
-  struct timeval times[2];
+  unsigned int closes = count_dirs(entry->path);
+  uint16_t mode;
+  uint64_t stop;
 
-  times[0].tv_sec  = out->stat.st_atime;
-  times[0].tv_usec = out->stat.st_atim.tv_nsec / 1000;
+  if(next) {
+    closes -= common_dirs(entry->path, next->path);
+    end     = next->node - sync_before(out, next);
+  }
 
-  times[1].tv_sec  = out->stat.st_mtime;
-  times[1].tv_usec = out->stat.st_mtim.tv_nsec / 1000;
+  stop = end - closes * sizeof(mode);
 
-  lutimes(out->wp, times);
-#else
-  struct timespec times[2];
+  /* the table must agree with the nodes before they are covered */
+  if(entry->node + DEAD_HDR > stop)
+    errx(EXIT_FAILURE, "inconsistent table of contents");
 
-  times[0].tv_sec  = out->stat.st_atime;
-  times[0].tv_nsec = out->stat.st_atim.tv_nsec;
+  /* sparse files start with their extents */
+  xpread(out->fd, &mode, sizeof(mode), entry->node);
+  mode = le16toh(mode);
+  if(mode != entry->mode && !(M_ISSPARSE(mode) && M_ISREG(entry->mode)))
+    errx(EXIT_FAILURE, "inconsistent table of contents");
 
-  times[1].tv_sec  = out->stat.st_mtime;
-  times[1].tv_nsec = out->stat.st_mtim.tv_nsec;
+  for(; closes ; closes--) {
+    xpread(out->fd, &mode, sizeof(mode), end - closes * sizeof(mode));
+    if(le16toh(mode) != (M_ICTRL | M_C_CHILD))
+      errx(EXIT_FAILURE, "inconsistent table of contents");
+  }
 
-  utimensat(AT_FDCWD, out->wp, times, AT_SYMLINK_NOFOLLOW);
-#endif /* __FreeBSD__ */
+  return stop - entry->node;
 }
 
-static void rec_add(struct sar_file *out, const char *node)
+/* The payload of hard linked files is held by the first of them alone,
+   it cannot be buried while a link left in the archive points to it. */
+static void check_links(struct sar_file *out)
 {
-  assert(out);
-  assert(out->wp);
+  char target[WP_MAX + 1];
+  unsigned long i;
 
-  mode_t mode;
+  for(i = 0 ; i < out->nb_toc ; i++) {
+    const struct sar_toc *entry = &out->toc[i];
+    const char *s = target;
+    uint16_t size;
 
-  if(add_node(out, &mode, node) < 0)
-    return;
+    if(!M_ISHARD(entry->mode) || selected(out, entry->path))
+      continue;
 
-  if(S_ISDIR(mode)) {
-    struct dirent *e;
-    size_t idx = out->wp_idx;
-    DIR *dp = opendir(out->wp);
+    if(!plain_read(out, &size, sizeof(size), entry->payload) ||
+       (size = le16toh(size)) > WP_MAX ||
+       !plain_read(out, target, size, entry->payload + sizeof(size)))
+      errx(EXIT_FAILURE, "inconsistent table of contents");
+    target[size] = '\0';
+
+    while(*s == '/')
+      s++;
+
+    if(selected(out, s))
+      errx(EXIT_FAILURE, "cannot delete \"%s\" hard linked by \"%s\"",
+           s, entry->path);
+  }
+}
+
+/* Delete the selected nodes along with their subtree by covering them
+   with tombstones. Their entries are replaced by the tombstones so that
+   later deletions and compactions find them without a listing. The
+   space is only given back by a compaction. */
+void sar_delete(struct sar_file *out)
+{
+  assert(out);
+  assert(out->nb_patterns);
 
-    if(!dp) {
-      warn("cannot open \"%s\"", out->wp);
-      return;
-    }
+  unsigned long i, j, n;
+  unsigned int k;
+  uint64_t end, lead;
 
-    while((e = readdir(dp))) {
-      const char *s;
+  if(!read_toc(out))
+    scan_entries(out);
 
-      /* skip special entity name */
-      if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
-        continue;
+  end = nodes_end(out);
 
-      /* append child node name */
-      out->wp[out->wp_idx++] = '/';
+  check_links(out);
 
-      for(s = e->d_name ; *s != '\0' ; s++, out->wp_idx++)
-        out->wp[out->wp_idx] = *s;
-      out->wp[out->wp_idx] = '\0';
+  for(i = n = 0 ; i < out->nb_toc ; i = j) {
+    struct sar_toc *entry = &out->toc[i];
 
-      /* recurse into it */
-      rec_add(out, e->d_name);
+    j = i + 1;
 
-      /* restore working path */
-      out->wp_idx  = idx;
-      out->wp[idx] = '\0';
+    if(M_ISDEAD(entry->mode) || !selected(out, entry->path)) {
+      out->toc[n++] = *entry;
+      continue;
     }
 
-    closedir(dp);
-
-    /* append control information */
-    write_control(out, M_C_CHILD);
+    while(j < out->nb_toc && is_parent(entry->path, out->toc[j].path))
+      j++;
+
+    entry->size    = dead_span(out, entry, j < out->nb_toc ? &out->toc[j]
+                                                           : NULL, end);
+
+    /* the marker of a node is covered along */
+    lead           = sync_before(out, entry);
+    entry->node   -= lead;
+    entry->size   += lead;
+    entry->payload = entry->node;
+    entry->crc     = 0;
+    entry->mode    = M_ICTRL | M_C_DEAD;
+
+    raise_version(out);
+    if(A_HAS_SYNC(out))
+      unsync(out->fd, entry->node, entry->size);
+    bury(out->fd, entry->node, entry->size);
+    verbose(0, out->verbose, "%s\n", entry->path);
+
+    for(k = i + 1 ; k < j ; k++)
+      free(out->toc[k].path);
+    out->toc[n++] = *entry;
   }
+
+  out->nb_toc = n;
+
+  report_missed(out);
+
+  keep_entries(out);
+  settle(out, end + sizeof(uint16_t));
 }
 
-/* open an archive for reading */
-struct sar_file * sar_read(const char *path,
-                           const char *compress,
-                           unsigned int verbose)
+/* Move the live nodes forward over the dead ones and cut the archive.
+   The steps are recorded in a journal beside the archive, an interrupted
+   compaction is carried on by the next one. With a budget it stops
+   between two nodes before it moves more than that many bytes, a
+   single tombstone then covers the dead bytes left behind. */
+void sar_compact(struct sar_file *out, uint64_t budget)
 {
-  uint32_t magik;
+  assert(out);
 
-  struct sar_file *out = create_sar_file();
+  struct sar_journal journal;
+  uint64_t end, left, moved = 0;
+  unsigned long i, k, n, m = 0;
+  int jfd;
 
-  out->verbose = verbose;
+  end = scan_entries(out);
 
-  if(!path)
-    out->fd = STDIN_FILENO;
-  else {
-    out->fd = open(path, O_RDONLY);
+  for(i = 0 ; i < out->nb_toc && !M_ISDEAD(out->toc[i].mode) ; i++);
 
-    if(out->fd < 0)
-      err(EXIT_FAILURE, "could not open file \"%s\"", path);
+  if(i == out->nb_toc) {
+    keep_entries(out);
+    settle(out, end);
+    return;
   }
 
-  if(compress) {
-    int fd[2];
-    pid_t pid;
+  out->journal = sidecar_name(out->path, JOURNAL_EXT);
 
-    xpipe(fd);
-    pid = xfork();
+  jfd = open(out->journal, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC,
+             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if(jfd < 0)
+    err(EXIT_FAILURE, "could not open file \"%s\"", out->journal);
 
-    if(!pid) /* child */ {
-      close(fd[0]);
+  journal.w   = out->toc[i].node;
+  journal.r   = journal.w;
+  journal.end = end;
 
-      xdup2(out->fd, STDIN_FILENO);
-      xdup2(fd[1], STDOUT_FILENO);
+  for(n = i ; i < out->nb_toc ;) {
+    struct sar_toc *entry = &out->toc[i];
+    uint64_t shift = journal.r - journal.w;
+    uint64_t from  = journal.r;
 
-      close(out->fd);
-      close(fd[1]);
+    if(entry->node < journal.r)
+      errx(EXIT_FAILURE, "inconsistent archive");
 
-      execlp(compress, compress, "-d", NULL);
-      err(EXIT_FAILURE, "cannot execute \"%s\"", compress);
+    if(M_ISDEAD(entry->mode) && entry->node == journal.r) {
+      journal.r += entry->size;
+      free(entry->path);
+      i++;
+      continue;
     }
 
-    close(fd[1]);
-    out->fd = fd[0];
-  }
-
-  out->file = iobuf_dopen(out->fd);
+    /* stop on a node rather than on the controls before it */
+    if(budget && moved >= budget && entry->node == journal.r)
+      break;
 
-  /* check magik number */
-  xxiobuf_read(out->file, &magik, sizeof(magik));
+    /* the nodes are moved by chunks up to a node boundary */
+    k = i;
+    if(!M_ISDEAD(entry->mode))
+      for(k++ ; k < out->nb_toc && !M_ISDEAD(out->toc[k].mode) &&
+                out->toc[k].node < journal.r + COMPACT_CHUNK ; k++);
+    journal.target = k < out->nb_toc ? out->toc[k].node : end;
+
+    /* nor beyond the budget left, a node larger than it is only
+       moved when nothing was moved yet */
+    left = budget > moved ? budget - moved : 0;
+    while(budget && k > i + 1 && journal.target - journal.r > left)
+      journal.target = out->toc[--k].node;
+    if(budget && moved && k > i && journal.target - journal.r > left)
+      break;
 
-  if(magik != MAGIK)
-    errx(EXIT_FAILURE, "incompatible magik number");
+    moved += journal.target - journal.r;
 
-  out->version = magik & MAGIK_FMT_VER;
+    write_journal(jfd, &journal, NULL, 0);
+    while(journal.r < journal.target)
+      move_step(out->fd, jfd, &journal,
+                MIN(journal.target - journal.r, COMPACT_CHUNK));
 
-  /* extract flags */
-  xxiobuf_read(out->file, &out->flags, sizeof(out->flags));
+    /* the markers of dead nodes are left behind */
+    for(; m < out->nb_syncs && out->syncs[m] < journal.r ; m++)
+      if(out->syncs[m] >= from)
+        resync(out->fd, out->syncs[m] - shift);
 
-  if(out->flags & ~A_IMASK)
-    errx(EXIT_FAILURE, "unknown flags found (%x)", out->flags);
+    for(; i < k ; i++) {
+      out->toc[i].node    -= shift;
+      out->toc[i].payload -= shift;
+      out->toc[n++]        = out->toc[i];
+    }
+  }
 
-  if(out->flags & A_ICRC32_C)
-    out->f_crc = f_crc_c;
-  else
-    out->f_crc = f_crc_legacy;
+  if(i < out->nb_toc) {
+    /* a tombstone in the directory of the next node */
+    struct sar_toc tomb = { .node    = journal.w,
+                            .payload = journal.w,
+                            .size    = journal.r - journal.w,
+                            .mode    = M_ICTRL | M_C_DEAD };
+    const char *s = strrchr(out->toc[i].path, '/');
+
+    tomb.path = strndup(out->toc[i].path,
+                        s ? (size_t)(s - out->toc[i].path + 1) : 0);
+
+    raise_version(out);
+    if(A_HAS_SYNC(out))
+      unsync(out->fd, tomb.node, tomb.size);
+    bury(out->fd, tomb.node, tomb.size);
+
+    memmove(&out->toc[n + 1], &out->toc[i],
+            sizeof(struct sar_toc) * (out->nb_toc - i));
+    out->toc[n] = tomb;
+    out->nb_toc = n + 1 + out->nb_toc - i;
+  }
+  else {
+    /* the nodes may end with dead ones */
+    journal.target = end;
+    write_journal(jfd, &journal, NULL, 0);
+    while(journal.r < journal.target)
+      move_step(out->fd, jfd, &journal,
+                MIN(journal.target - journal.r, COMPACT_CHUNK));
+
+    out->nb_toc = n;
+    end         = journal.w;
+  }
 
-  /* for debugging purpose */
-  UNPTR(out->wp);
-  UNPTR(out->hl_tbl);
+  close(jfd);
 
-  return out;
+  keep_entries(out);
+  settle(out, end);
 }
 
-static void read_regular(struct sar_file *out, mode_t mode)
+static off_t read_file_size(struct sar_file *out)
 {
-  char iobuf[IO_SZ];
   enum fsclass class;
   off_t size = 0;
-  int fd;
 
-  /* read size first */
+  out->column = COL_SIZE;
   class = out->nsclass & N_FILE;
   switch(class) {
     uint8_t  size_byte;
@@ -1149,19 +4789,97 @@ static void read_regular(struct sar_file *out, mode_t mode)
     break;
   }
 
+  return size;
+}
+
+/* Move the payload of a plain archive to the output within the kernel,
+   returns the size left to copy. The iobuf is synchronized first and
+   follows the offset of the archive afterwards. A checksum would need
+   every byte in user space anyway, so such payloads are read instead. */
+static off_t splice_payload(struct sar_file *out, off_t size)
+{
+  off_t left;
+
+  if(iobuf_lseek(out->file, 0, SEEK_CUR) < 0)
+    return size;
+
+  left = splice_data(out->fd, STDOUT_FILENO, size);
+  if(left < 0)
+    err(EXIT_FAILURE, "cannot write \"%s\"", out->wp);
+
+  out->offset += size - left;
+
+  return left;
+}
+
+/* share the extents of an aligned payload with the output file */
+static off_t clone_payload(struct sar_file *out, int fd, off_t size)
+{
+  off_t left;
+
+  /* readers bounded by a marker check each read */
+  if(size < ALIGN_MIN || (out->stop && out->offset + size > out->stop))
+    return size;
+
+  if(iobuf_lseek(out->file, 0, SEEK_CUR) < 0)
+    return size;
+
+  left = clone_data(out->fd, fd, size,
+                    A_HAS_CRC(out) ? out->f_crc : NULL, &out->crc);
+  if(left < 0)
+    err(EXIT_FAILURE, "cannot write \"%s\"", out->wp);
+
+  out->offset += size - left;
+
+  return left;
+}
+
+static void read_regular(struct sar_file *out, mode_t mode)
+{
+  char iobuf[IO_SZ];
+  off_t size;
+  int fd;
+
+  /* read size first */
+  size      = read_file_size(out);
   out->size = size;
 
+  out->payload_offset = out->offset;
+
+  if(out->mapped) {
+    read_sparse(out, mode);
+    return;
+  }
+
+  if(A_HAS_DICT(out) && size && size <= DICT_FILE_MAX) {
+    read_small(out, mode);
+    return;
+  }
+
   /* when we list the archive we don't want to read
      to whole file */
+  out->column = COL_DATA;
   if(out->list_only) {
-    xiobuf_skip(out->file, size);
+    xstream_skip(out, size);
     return;
   }
 
   /* open output file */
-  fd = open(out->wp, O_CREAT | O_RDWR | O_TRUNC, mode);
-  if(fd < 0)
-    err(EXIT_FAILURE, "could not open output file \"%s\"", out->wp);
+  if(out->cat) {
+    fd = STDOUT_FILENO;
+
+    if(!out->cs && !out->block && !out->fifo && !A_HAS_COLUMN(out) &&
+       !A_HAS_CRC(out))
+      size = splice_payload(out, size);
+  }
+  else {
+    fd = open(out->wp, O_CREAT | O_RDWR | O_TRUNC, mode);
+    if(fd < 0)
+      err(EXIT_FAILURE, "could not open output file \"%s\"", out->wp);
+
+    if(!out->cs && !out->block && !out->fifo && !A_HAS_COLUMN(out))
+      size = clone_payload(out, fd, size);
+  }
 
   /* read file */
   while(size) {
@@ -1177,6 +4895,194 @@ static void read_regular(struct sar_file *out, mode_t mode)
 
   assert(size == 0);
 
+  if(!out->cat)
+    close(fd);
+}
+
+static void read_extents(struct sar_file *out)
+{
+  uint32_t nb;
+
+  out->column = COL_SIZE;
+  xcrc_read(out, &nb, sizeof(nb));
+  nb = le32toh(nb);
+
+  out->nb_extents = 0;
+  out->mapped     = true;
+
+  while(nb--) {
+    uint64_t offset, size;
+
+    xcrc_read(out, &offset, sizeof(offset));
+    xcrc_read(out, &size, sizeof(size));
+    offset = le64toh(offset);
+    size   = le64toh(size);
+
+    if(!size) {
+      if(out->salvage)
+        inconsistent(out);
+      errx(EXIT_FAILURE, "inconsistent sparse file in \"%s\"", out->wp);
+    }
+
+    add_extent(out, offset, size);
+  }
+}
+
+/* the extents must be ordered within the file,
+   returns the size of the data they hold */
+static off_t check_extents(struct sar_file *out)
+{
+  uint64_t end = 0, data = 0;
+  unsigned long i;
+
+  for(i = 0 ; i < out->nb_extents ; i++) {
+    const struct sar_extent *extent = &out->extents[i];
+
+    if(extent->offset < end || extent->offset > (uint64_t)out->size ||
+       extent->size > (uint64_t)out->size - extent->offset) {
+      if(out->salvage)
+        inconsistent(out);
+      errx(EXIT_FAILURE, "inconsistent sparse map for \"%s\"", out->wp);
+    }
+
+    end   = extent->offset + extent->size;
+    data += extent->size;
+  }
+
+  return data;
+}
+
+/* holes are zeros on the standard output */
+static void write_zeros(int fd, off_t size)
+{
+  static const char zero[IO_SZ];
+
+  while(size) {
+    size_t n = MIN(size, IO_SZ);
+
+    xwrite(fd, zero, n);
+    size -= n;
+  }
+}
+
+/* the data of a sparse file is written at its extents
+   and the file is then extended over the last hole */
+static void read_sparse(struct sar_file *out, mode_t mode)
+{
+  char iobuf[IO_SZ];
+  off_t data = check_extents(out);
+  uint64_t end = 0;
+  unsigned long i;
+  int fd;
+
+  out->column = COL_DATA;
+  if(out->list_only) {
+    xstream_skip(out, data);
+    return;
+  }
+
+  if(out->cat)
+    fd = STDOUT_FILENO;
+  else {
+    fd = open(out->wp, O_CREAT | O_RDWR | O_TRUNC, mode);
+    if(fd < 0)
+      err(EXIT_FAILURE, "could not open output file \"%s\"", out->wp);
+  }
+
+  for(i = 0 ; i < out->nb_extents ; i++) {
+    const struct sar_extent *extent = &out->extents[i];
+    off_t left = extent->size;
+
+    if(out->cat)
+      write_zeros(fd, extent->offset - end);
+    else if(lseek(fd, extent->offset, SEEK_SET) < 0)
+      err(EXIT_FAILURE, "cannot seek \"%s\"", out->wp);
+
+    while(left) {
+      size_t n = MIN(left, IO_SZ);
+
+      xcrc_read(out, iobuf, n);
+      xwrite(fd, iobuf, n);
+
+      left -= n;
+    }
+
+    end = extent->offset + extent->size;
+  }
+
+  if(out->cat)
+    write_zeros(fd, out->size - end);
+  else {
+    if(ftruncate(fd, out->size) < 0)
+      err(EXIT_FAILURE, "cannot write \"%s\"", out->wp);
+    close(fd);
+  }
+}
+
+/* the packed size of a small file, zero when it is stored as is */
+static uint16_t read_small_size(struct sar_file *out)
+{
+  uint16_t n;
+
+  out->column = COL_SIZE;
+  xcrc_read(out, &n, sizeof(n));
+  n = le16toh(n);
+
+  out->column         = COL_DATA;
+  out->payload_offset = out->offset;
+  if(n >= out->size) {
+    if(out->salvage)
+      inconsistent(out);
+    errx(EXIT_FAILURE, "inconsistent size for \"%s\"", out->wp);
+  }
+
+  return n;
+}
+
+static void unpack_small(struct sar_file *out, uint16_t n,
+                         unsigned char *plain)
+{
+  unsigned char packed[DICT_FILE_MAX];
+
+  if(!n) {
+    xcrc_read(out, plain, out->size);
+    return;
+  }
+
+  xcrc_read(out, packed, n);
+
+  if(!out->dctx)
+    errx(EXIT_FAILURE, "no dictionary to decompress \"%s\"", out->wp);
+  if(!dict_unpack(out->dctx, packed, n, plain, out->size))
+    errx(EXIT_FAILURE, "corrupted file \"%s\"", out->wp);
+}
+
+static void read_small(struct sar_file *out, mode_t mode)
+{
+  unsigned char plain[DICT_FILE_MAX];
+  uint16_t n;
+  int fd;
+
+  n = read_small_size(out);
+
+  if(out->list_only) {
+    xstream_skip(out, n ? n : out->size);
+    return;
+  }
+
+  unpack_small(out, n, plain);
+
+  if(out->cat) {
+    xwrite(STDOUT_FILENO, plain, out->size);
+    return;
+  }
+
+  fd = open(out->wp, O_CREAT | O_RDWR | O_TRUNC, mode);
+  if(fd < 0)
+    err(EXIT_FAILURE, "could not open output file \"%s\"", out->wp);
+
+  xwrite(fd, plain, out->size);
+
   close(fd);
 }
 
@@ -1197,6 +5103,7 @@ static void read_link(struct sar_file *out, mode_t mode)
   uint16_t size = 0;
 
   /* read link length */
+  out->column = COL_SIZE;
   class = out->nsclass & N_FILE;
   switch(class) {
     uint8_t  size_byte;
@@ -1212,20 +5119,26 @@ static void read_link(struct sar_file *out, mode_t mode)
     break;
   case(N_FGIGA):
   case(N_FHUGE):
+    if(out->salvage)
+      inconsistent(out);
     errx(EXIT_FAILURE, "link size too large for \"%s\"", out->wp);
   }
   out->size = size;
 
   /* check size and extract path */
-  if(size > WP_MAX)
+  if(size > WP_MAX) {
+    if(out->salvage)
+      inconsistent(out);
     errx(EXIT_FAILURE, "path size exceeded");
+  }
+  out->column = COL_LINK;
   xcrc_read(out, path, size);
   path[size] = '\0';
 
   /* duplicate path for displaying
      it will be freed later by caller */
   out->link = strdup(path);
-  if(!out->list_only && symlink(path, out->wp) < 0)
+  if(!out->list_only && !out->dst && symlink(path, out->wp) < 0)
     warn("cannot create symlink \"%s\" to \"%s\"", out->wp, path);
 }
 
@@ -1240,17 +5153,23 @@ static void read_device(struct sar_file *out, mode_t mode)
   uint64_t dev;
 
   /* used for displaying */
-  out->size = sizeof(dev);
+  out->size   = sizeof(dev);
+  out->column = COL_SIZE;
 
   /* avoid reading when listing the archive */
   if(out->list_only) {
-    xiobuf_skip(out->file, sizeof(dev));
+    xstream_skip(out, sizeof(dev));
     return;
   }
 
   xcrc_read(out, &dev, sizeof(dev));
   dev = le64toh(dev);
 
+  if(out->dst) {
+    out->dst->stat.st_rdev = dev;
+    return;
+  }
+
   if(mknod(out->wp, mode, dev) < 0)
     err(EXIT_FAILURE, "cannot create device \"%s\"", out->wp);
 }
@@ -1261,27 +5180,192 @@ static void read_hardlink(struct sar_file *out, mode_t mode)
   uint16_t size;
 
   /* read link length */
+  out->column = COL_SIZE;
   xcrc_read(out, &size, sizeof(size));
   size = le16toh(size);
   out->size = size;
 
-  /* check size and extract path */
-  if(size > WP_MAX)
-    errx(EXIT_FAILURE, "path size exceeded");
-  xcrc_read(out, path, size);
-  path[size] = '\0';
+  /* check size and extract path */
+  if(size > WP_MAX) {
+    if(out->salvage)
+      inconsistent(out);
+    errx(EXIT_FAILURE, "path size exceeded");
+  }
+  out->column = COL_LINK;
+  xcrc_read(out, path, size);
+  path[size] = '\0';
+
+  /* duplicate link path for displaying
+     it will be freed later by caller */
+  out->link = strdup(path);
+  if(!out->list_only && !out->dst && link(path, out->wp) < 0)
+    warnx("cannot create hardlink \"%s\" to \"%s\"", out->wp, path);
+}
+
+/* Hand the node just parsed over to the archive being written.
+   Payloads are read from this archive while they are written to
+   the other one, so that nothing touches the filesystem. */
+static void transcode_node(struct sar_file *in, uint16_t mode,
+                           const char *name)
+{
+  /* smallest size of each file size class, this keeps the class of
+     nodes which do not store a size such as directories */
+  static const off_t class_size[] = { 0, 0x100, 0x10000, 0x100000000LL };
+  unsigned char plain[DICT_FILE_MAX];
+  struct sar_file *out = in->dst;
+
+  in->payload = NULL;
+  in->left    = 0;
+  out->link   = NULL;
+  out->wp     = in->wp;
+
+  out->stat.st_size = class_size[in->nsclass & N_FILE];
+
+  switch(mode & M_IFMT) {
+  case(M_IREG):
+    in->size   = read_file_size(in);
+    in->left   = in->size;
+    in->raw    = mode & M_IRAW;
+    in->column = COL_DATA;
+
+    /* the extents are written again along their data */
+    if(in->mapped) {
+      in->left        = check_extents(in);
+      out->mapped     = true;
+      out->extents    = in->extents;
+      out->nb_extents = in->nb_extents;
+    }
+    else if(A_HAS_DICT(in) && in->size && in->size <= DICT_FILE_MAX) {
+      unpack_small(in, read_small_size(in), plain);
+      in->payload = plain;
+    }
+
+    out->stat.st_size = in->size;
+    break;
+  case(M_ILNK):
+    read_link(in, out->stat.st_mode);
+    out->stat.st_size = in->size;
+    break;
+  case(M_IHARD):
+    read_hardlink(in, out->stat.st_mode);
+    out->link = in->link;
+    break;
+  case(M_IBLK):
+  case(M_ICHR):
+    read_device(in, out->stat.st_mode);
+    break;
+  }
+
+  out->src = in;
+  write_node(out, name);
+  out->src = NULL;
+
+  out->mapped     = false;
+  out->extents    = NULL;
+  out->nb_extents = 0;
+
+  /* write_link() duplicated the target of symbolic links */
+  if((mode & M_IFMT) == M_ILNK)
+    free(out->link);
+
+  out->link = NULL;
+  out->wp   = NULL;
+}
+
+/* A node is selected when a pattern matches its path or the path
+   of one of its parents, so that a directory brings its subtree. */
+static bool selected(struct sar_file *out, const char *path)
+{
+  char prefix[WP_MAX];
+  bool match = false;
+  unsigned int i;
+
+  if(!out->nb_patterns)
+    return true;
+
+  for(i = 0 ; i < out->nb_patterns ; i++) {
+    char *s;
+
+    strcpy(prefix, path);
+
+    do {
+      if(!fnmatch(out->patterns[i], prefix, 0)) {
+        out->matched[i] = true;
+        match = true;
+        break;
+      }
+
+      s = strrchr(prefix, '/');
+      if(s)
+        *s = '\0';
+    } while(s);
+  }
+
+  return match;
+}
+
+/* create the directories leading to a node extracted alone */
+static void make_parents(const char *path)
+{
+  char dir[WP_MAX];
+  char *s;
+
+  strcpy(dir, path);
+
+  for(s = strchr(dir, '/') ; s ; s = strchr(s + 1, '/')) {
+    *s = '\0';
+    if(mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+      warn("cannot create \"%s\"", dir);
+    *s = '/';
+  }
+}
+
+/* damaged regions are given up when salvaging */
+static void inconsistent(struct sar_file *out)
+{
+  if(out->salvage)
+    longjmp(*out->salvage, 1);
+
+  errx(EXIT_FAILURE, "IO read error or inconsistent archive");
+}
+
+/* the markers read along the nodes agree with the working path,
+   their offsets are noted for the archives modified in place */
+static void read_sync(struct sar_file *out, uint64_t node, size_t idx)
+{
+  unsigned char marker[SYNC_HDR + WP_MAX + sizeof(uint32_t)];
+  uint64_t magik;
+  uint16_t len;
+
+  out->column = COL_STREAM;
+  xstream_read(out, marker + sizeof(uint16_t), SYNC_HDR - sizeof(uint16_t));
+
+  memcpy(&magik, marker + 2, sizeof(magik));
+  memcpy(&len, marker + 20, sizeof(len));
+  len = le16toh(len);
+
+  if(le64toh(magik) != SYNC_MAGIK || len != idx)
+    inconsistent(out);
 
-  /* duplicate link path for displaying
-     it will be freed later by caller */
-  out->link = strdup(path);
-  if(!out->list_only && link(path, out->wp) < 0)
-    warnx("cannot create hardlink \"%s\" to \"%s\"", out->wp, path);
+  xstream_read(out, marker + SYNC_HDR, len + sizeof(uint32_t));
+  if(memcmp(marker + SYNC_HDR, out->wp, len))
+    inconsistent(out);
+
+  if(out->indexing) {
+    if(out->nb_syncs == out->syncs_size) {
+      out->syncs_size = out->syncs_size ? out->syncs_size * 2 : 64;
+      out->syncs      = xrealloc(out->syncs, sizeof(uint64_t) *
+                                             out->syncs_size);
+    }
+
+    out->syncs[out->nb_syncs++] = node;
+  }
 }
 
 static int rec_extract(struct sar_file *out, size_t idx)
 {
   assert(out);
-  assert(out->file);
+  assert(out->file || out->fifo || out->block);
   assert(out->wp);
 
   char name[NODE_MAX + 1];
@@ -1294,40 +5378,102 @@ static int rec_extract(struct sar_file *out, size_t idx)
   mode_t real_mode;
   uint32_t atime_ns = 0;
   uint32_t mtime_ns = 0;
-  uint32_t crc;
+  uint32_t crc = 0;
   uint16_t mode;
   uint8_t size, i;
+  bool list_only = out->list_only;
+  bool skip = false;
+  uint64_t node = out->offset;
 
   /* setup crc and fallback variables we don't
      care if we compute it or not */
   out->crc = 0;
   out->link = NULL;
   out->size = 0;
+  out->mapped = false;
+
+  /* a range of blocks ends on a node boundary */
+  if(out->block && block_done(out->block))
+    return 1;
+
+  /* a range of nodes ends on a marker */
+  if(out->stop && out->offset >= out->stop) {
+    out->synced = true;
+    return 1;
+  }
 
+READ_MODE:
   /* read mode and convert endianess */
+  out->column = COL_MODE;
   xcrc_read(out, &mode, sizeof(mode));
   mode = le16toh(mode);
 
+  /* the extents of a sparse file come before a regular file */
+  if(out->mapped && (mode & M_IFMT) != M_IREG) {
+    if(out->salvage)
+      inconsistent(out);
+    errx(EXIT_FAILURE, "inconsistent sparse file in \"%s\"", out->wp);
+  }
+
   /* switch for control and hardlink */
   switch(mode & M_IFMT) {
   case(M_IHARD):
     goto EXTRACT_NAME;
   case(M_ICTRL):
+    /* the first version knows neither dead nor sparse controls */
+    if(out->version < MAGIK_VERSION &&
+       (M_ISDEAD(mode) || M_ISSPARSE(mode))) {
+      if(out->salvage)
+        inconsistent(out);
+      errx(EXIT_FAILURE, "unexpected control in a version %u archive",
+           out->version);
+    }
+
     switch(mode) {
     case(M_ICTRL | M_C_CHILD):
       out->wp[idx] = '\0';
+      if(out->dst)
+        write_control(out->dst, M_C_CHILD);
       return 1;
     case(M_ICTRL | M_C_IGNORE):
       warnx("ignored \"%s\", not extracted", out->wp);
       break;
+    case(M_ICTRL | M_C_DEAD): {
+      uint32_t dead;
+
+      out->column = COL_STREAM;
+      xstream_read(out, &dead, sizeof(dead));
+      dead = le32toh(dead);
+
+      /* the tombstone stands for the nodes it covers */
+      if(out->indexing) {
+        out->wp[idx] = '\0';
+        add_toc(out, node, mode, DEAD_HDR + dead, 0);
+      }
+
+      xstream_skip(out, dead);
+      return 0;
+    }
+    case(M_ICTRL | M_C_SYNC):
+      read_sync(out, node, idx);
+      return 0;
+    case(M_ICTRL | M_C_SPARSE):
+      out->wp[idx] = '\0';
+      read_extents(out);
+      goto READ_MODE;
+    default:
+      if(out->salvage)
+        inconsistent(out);
     }
     break;
   }
 
   /* read node size class */
+  out->column = COL_CLASS;
   xcrc_read(out, &out->nsclass, sizeof(out->nsclass));
 
   /* read uid/gid */
+  out->column = COL_ID;
   iclass = out->nsclass & N_ID;
   switch(iclass) {
     uint8_t  id_byte;
@@ -1437,40 +5583,45 @@ static int rec_extract(struct sar_file *out, size_t idx)
     break;
   }
 
-  /* read atime/mtime */
+  /* read atime/mtime, columnar archives add the times
+     of the previous node within the size class */
+  out->column = COL_TIME;
   tclass = out->nsclass & N_TIME;
   switch(tclass) {
-    int32_t time_giga;
-    int64_t time_huge;
+    uint32_t time_giga;
+    uint64_t time_huge;
 
   case(N_TS32):
     xcrc_read(out, &time_giga, sizeof(time_giga));
-    time_giga = le32toh(time_giga);
-    atime = time_giga;
-    mtime = time_giga;
+    atime = (int32_t)(le32toh(time_giga) + (uint32_t)out->atime);
+    mtime = atime;
     break;
   case(N_TS64):
     xcrc_read(out, &time_huge, sizeof(time_huge));
-    time_huge = le64toh(time_huge);
-    atime = time_huge;
-    mtime = time_huge;
+    atime = le64toh(time_huge) + (uint64_t)out->atime;
+    mtime = atime;
     break;
   case(N_TB32):
     xcrc_read(out, &time_giga, sizeof(time_giga));
-    atime = le32toh(time_giga);
+    atime = (int32_t)(le32toh(time_giga) + (uint32_t)out->atime);
 
     xcrc_read(out, &time_giga, sizeof(time_giga));
-    mtime = le32toh(time_giga);
+    mtime = (int32_t)(le32toh(time_giga) + (uint32_t)out->mtime);
     break;
   case(N_TB64):
     xcrc_read(out, &time_huge, sizeof(time_huge));
-    atime = le64toh(time_huge);
+    atime = le64toh(time_huge) + (uint64_t)out->atime;
 
     xcrc_read(out, &time_huge, sizeof(time_huge));
-    mtime = le64toh(time_huge);
+    mtime = le64toh(time_huge) + (uint64_t)out->mtime;
     break;
   }
 
+  if(A_HAS_COLUMN(out)) {
+    out->atime = atime;
+    out->mtime = mtime;
+  }
+
   if(A_HAS_NTIME(out)) {
     xcrc_read(out, &atime_ns, sizeof(atime_ns));
     xcrc_read(out, &mtime_ns, sizeof(mtime_ns));
@@ -1481,12 +5632,16 @@ static int rec_extract(struct sar_file *out, size_t idx)
 EXTRACT_NAME:
   /* extract name size, size is one byte so
      we don't do the endianess conversion */
+  out->column = COL_NAME;
   xcrc_read(out, &size, sizeof(size));
   xcrc_read(out, name, size);
 
 #ifndef DISABLE_WP_WIDTH_CHECK
-  if(idx + size >= WP_MAX)
+  if(idx + size >= WP_MAX) {
+    if(out->salvage)
+      inconsistent(out);
     errx(EXIT_FAILURE, "maximum size exceeded for working path");
+  }
 #endif /* WP_WIDTH_CHECK */
 
   /* copy name to working path */
@@ -1494,10 +5649,42 @@ EXTRACT_NAME:
     out->wp[idx + i] = name[i];
   out->wp[idx + size] = '\0';
 
+  out->payload_offset = out->offset;
+
   /* we would like to see the real mode too */
   real_mode = uint162mode(mode);
 
-  switch(mode & M_IFMT) {
+  /* nodes out of the selection are read but neither extracted nor shown */
+  if(out->nb_patterns && !out->inside) {
+    skip = !selected(out, out->wp);
+
+    if(skip)
+      out->list_only = true;
+    else if(!list_only && !out->cat)
+      make_parents(out->wp);
+  }
+
+  /* only the payloads of regular files are written out */
+  if(out->cat && (mode & M_IFMT) != M_IREG)
+    out->list_only = true;
+
+  if(out->dst) {
+    struct stat *st = &out->dst->stat;
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode          = real_mode;
+    st->st_nlink         = 1;
+    st->st_uid           = uid;
+    st->st_gid           = gid;
+    st->st_atim.tv_sec   = atime;
+    st->st_atim.tv_nsec  = atime_ns;
+    st->st_mtim.tv_sec   = mtime;
+    st->st_mtim.tv_nsec  = mtime_ns;
+
+    name[size] = '\0';
+    transcode_node(out, mode, name);
+  }
+  else switch(mode & M_IFMT) {
   case(M_IREG):
     read_regular(out, real_mode);
     break;
@@ -1520,7 +5707,7 @@ EXTRACT_NAME:
   }
 
   /* change attributes of the extracted file */
-  if(!out->list_only) {
+  if(!out->list_only && !out->dst && !out->cat) {
     lchown(out->wp, uid, gid);
 
     /* avoid dereference symbolic links */
@@ -1563,54 +5750,778 @@ EXTRACT_NAME:
 
   /* compute crc */
   if(A_HAS_CRC(out)) {
-    xxiobuf_read(out->file, &crc, sizeof(crc));
+    out->column = COL_CRC;
+    xstream_read(out, &crc, sizeof(crc));
     crc = le32toh(crc);
 
-    if(!out->list_only && crc != out->crc)
+    /* the payload was already written out */
+    if(!out->list_only && crc != out->crc && out->cat)
+      errx(EXIT_FAILURE, "corrupted file \"%s\"", out->wp);
+    else if(!out->list_only && crc != out->crc)
       warnx("corrupted file \"%s\"", out->wp);
   }
 
-  show_file(out, out->wp, out->link, real_mode, mode,
-            uid, gid, out->size, atime, mtime, out->list_only ? crc : out->crc,
-            A_HAS_CRC(out));
+  if(out->indexing)
+    add_toc(out, node, mode, out->size, crc);
+
+  if(!skip && !out->shallow && !out->cat)
+    show_file(out, out->wp, out->link, real_mode, mode,
+              uid, gid, out->size, atime, mtime,
+              out->list_only ? crc : out->crc, A_HAS_CRC(out));
+
+  /* a hard link brings the payload of its target found in the table */
+  if(out->cat && !skip && (mode & M_IFMT) == M_IHARD) {
+    if(!out->toc)
+      errx(EXIT_FAILURE, "cannot write out hard link \"%s\" without "
+           "a table of contents", out->wp);
+    out->cat_link = strdup(out->link);
+  }
+
   if(out->link)
     free(out->link);
 
+  out->list_only = list_only;
+
   /* check for directory and extracts children */
-  if((mode & M_IFMT) == M_IDIR) {
+  if((mode & M_IFMT) == M_IDIR && !out->shallow) {
+    /* the children of a selected directory are selected as well */
+    bool inside = out->nb_patterns && !skip;
+
     out->wp[idx + size]     = '/';
     out->wp[idx + size + 1] = '\0';
+    out->inside += inside;
 
     /* read until we receive a child control stamp */
     while(rec_extract(out, idx + size + 1) != 1);
 
+    out->inside -= inside;
     out->wp[idx + size] = '\0';
   }
 
   return 0;
 }
 
+/* Select the nodes extracted or listed by paths or glob patterns.
+   The archive keeps neither leading nor trailing slashes. */
+void sar_select(struct sar_file *out,
+                char * const *patterns, unsigned int nb_patterns)
+{
+  unsigned int i;
+
+  assert(out);
+
+  if(!nb_patterns)
+    return;
+
+  out->patterns    = xmalloc(sizeof(char *) * nb_patterns);
+  out->matched     = xmalloc(sizeof(bool) * nb_patterns);
+  out->nb_patterns = nb_patterns;
+
+  for(i = 0 ; i < nb_patterns ; i++) {
+    const char *s = patterns[i];
+    size_t len;
+
+    while(*s == '/')
+      s++;
+    for(len = strlen(s) ; len > 1 && s[len - 1] == '/' ; len--);
+
+    out->patterns[i] = strndup(s, len);
+    out->matched[i]  = false;
+  }
+}
+
+/* warn about the patterns matching no node, the exit status tells them */
+static void report_missed(struct sar_file *out)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < out->nb_patterns ; i++)
+    if(!out->matched[i]) {
+      warnx("\"%s\" not found in archive", out->patterns[i]);
+      out->missed = true;
+    }
+}
+
+/* read the node at a plain offset of the archive,
+   the parent directories are already in the working path */
+static void extract_at(struct sar_file *out, const struct sar_toc *entry,
+                       bool shallow)
+{
+  struct block *block = out->block;
+  const char *s       = strrchr(entry->path, '/');
+  size_t idx          = s ? (size_t)(s - entry->path + 1) : 0;
+
+  if(block) {
+    if(entry->node < ARCHIVE_HDR ||
+       !(out->block = block_at(block, entry->node - ARCHIVE_HDR)))
+      errx(EXIT_FAILURE, "inconsistent table of contents");
+  }
+  else if(out->cs) {
+    if(!cstream_seek(out->cs, entry->node))
+      errx(EXIT_FAILURE, "inconsistent table of contents");
+  }
+  else if(iobuf_lseek(out->file, entry->node, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek archive");
+
+  memcpy(out->wp, entry->path, idx);
+  out->wp[idx] = '\0';
+
+  out->shallow = shallow;
+  out->inside++;
+
+  rec_extract(out, idx);
+
+  out->inside--;
+  out->shallow = false;
+
+  if(block) {
+    block_close(out->block);
+    out->block = block;
+  }
+}
+
+static bool is_parent(const char *dir, const char *path)
+{
+  size_t len = strlen(dir);
+
+  return !strncmp(dir, path, len) && path[len] == '/';
+}
+
+/* Only the selected nodes are read through the table of contents.
+   The directories leading to a node are extracted alone before it
+   while a selected directory brings its whole subtree. */
+static void extract_toc(struct sar_file *out)
+{
+  unsigned long *parents = xmalloc(sizeof(unsigned long) * WP_MAX);
+  unsigned int depth = 0, done = 0;
+  unsigned long i;
+
+  for(i = 0 ; i < out->nb_toc ; i++) {
+    const struct sar_toc *entry = &out->toc[i];
+
+    if(M_ISDEAD(entry->mode))
+      continue;
+
+    /* leave the directories this entry is not in */
+    while(depth && !is_parent(out->toc[parents[depth - 1]].path, entry->path))
+      depth--;
+    done = MIN(done, depth);
+
+    if(selected(out, entry->path)) {
+      if(!out->list_only && !out->cat)
+        for(; done < depth ; done++)
+          extract_at(out, &out->toc[parents[done]], true);
+
+      extract_at(out, entry, false);
+
+      /* its subtree was extracted along */
+      if(M_ISDIR(entry->mode))
+        while(i + 1 < out->nb_toc && is_parent(entry->path,
+                                               out->toc[i + 1].path))
+          i++;
+    }
+    else if(M_ISDIR(entry->mode))
+      parents[depth++] = i;
+  }
+
+  free(parents);
+}
+
+/* Write out the selected regular files through the table of contents.
+   A hard link is followed by its target, the last regular entry with
+   this path before the link. */
+static void cat_toc(struct sar_file *out)
+{
+  unsigned long i, j;
+
+  for(i = 0 ; i < out->nb_toc ; i++) {
+    const struct sar_toc *entry = &out->toc[i];
+    const char *target;
+
+    if(M_ISDEAD(entry->mode) || !selected(out, entry->path) ||
+       !(M_ISREG(entry->mode) || M_ISHARD(entry->mode)))
+      continue;
+
+    extract_at(out, entry, false);
+    if(!out->cat_link)
+      continue;
+
+    for(target = out->cat_link ; *target == '/' ; target++);
+    for(j = i ; j > 0 ; j--)
+      if(M_ISREG(out->toc[j - 1].mode) && !strcmp(out->toc[j - 1].path,
+                                                  target))
+        break;
+
+    if(!j)
+      errx(EXIT_FAILURE, "cannot find \"%s\" linked by \"%s\"",
+           out->cat_link, entry->path);
+
+    free(out->cat_link);
+    out->cat_link = NULL;
+
+    extract_at(out, &out->toc[j - 1], false);
+  }
+}
+
+/* check the marker at an offset, its directory is copied to path */
+static bool check_sync(struct sar_file *out, uint64_t pos, char *path)
+{
+  unsigned char marker[SYNC_HDR + WP_MAX + sizeof(uint32_t)];
+  uint64_t offset;
+  uint32_t crc;
+  uint16_t control, depth, len, i;
+
+  if(pread(out->fd, marker, SYNC_HDR, pos) != SYNC_HDR)
+    return false;
+
+  memcpy(&control, marker, sizeof(control));
+  memcpy(&offset, marker + 10, sizeof(offset));
+  memcpy(&depth, marker + 18, sizeof(depth));
+  memcpy(&len, marker + 20, sizeof(len));
+  len = le16toh(len);
+
+  if(le16toh(control) != (M_ICTRL | M_C_SYNC) || le64toh(offset) != pos ||
+     len >= WP_MAX ||
+     pread(out->fd, marker + SYNC_HDR, len + sizeof(crc),
+           pos + SYNC_HDR) != len + sizeof(crc))
+    return false;
+
+  memcpy(&crc, marker + SYNC_HDR + len, sizeof(crc));
+  if(le32toh(crc) != crc32_c(marker, SYNC_HDR + len, 0))
+    return false;
+
+  /* the directory ends with a slash */
+  depth = le16toh(depth);
+  for(i = 0 ; i < len ; i++)
+    if(marker[SYNC_HDR + i] == '/')
+      depth--;
+  if(depth || (len && marker[SYNC_HDR + len - 1] != '/'))
+    return false;
+
+  if(path) {
+    memcpy(path, marker + SYNC_HDR, len);
+    path[len] = '\0';
+  }
+
+  return true;
+}
+
+/* Look for the first marker from an offset of an uncompressed archive.
+   Its magik is only a hint, the same bytes may be found in a payload. */
+static bool find_sync(struct sar_file *out, uint64_t from, uint64_t size,
+                      uint64_t *pos, char *path)
+{
+  unsigned char *buf = xmalloc(IO_SZ);
+  uint64_t magik = htole64(SYNC_MAGIK);
+  uint64_t at = from + sizeof(uint16_t);
+
+  while(at + sizeof(magik) <= size) {
+    ssize_t n = pread(out->fd, buf, IO_SZ, at);
+    size_t i;
+
+    if(n < (ssize_t)sizeof(magik))
+      err(EXIT_FAILURE, "cannot read archive");
+
+    for(i = 0 ; i + sizeof(magik) <= (size_t)n ; i++) {
+      if(memcmp(buf + i, &magik, sizeof(magik)) ||
+         !check_sync(out, at + i - sizeof(uint16_t), path))
+        continue;
+
+      *pos = at + i - sizeof(uint16_t);
+      free(buf);
+      return true;
+    }
+
+    /* a magik may straddle two reads */
+    at += n - sizeof(magik) + 1;
+  }
+
+  free(buf);
+  return false;
+}
+
+/* Read the nodes from the first one or from a marker and its directory
+   up to another marker. Returns false when the nodes end before. */
+static bool read_region(struct sar_file *out, uint64_t pos, uint64_t stop,
+                        const char *dir)
+{
+  size_t idx = 0;
+
+  out->wp[0] = '\0';
+  if(dir) {
+    idx  = n_strncpy(out->wp, dir, WP_MAX);
+    pos += SYNC_HDR + idx + sizeof(uint32_t);
+
+    /* its directories may be extracted by another reader */
+    if(!out->list_only && !out->cat)
+      make_parents(out->wp);
+  }
+
+  if(iobuf_lseek(out->file, pos, SEEK_SET) < 0)
+    err(EXIT_FAILURE, "cannot seek archive");
+
+  out->offset = pos;
+  out->stop   = stop;
+  out->synced = false;
+
+  for(;;) {
+    if(rec_extract(out, idx) != 1)
+      continue;
+
+    /* end of the archive or of the region */
+    if(!idx || out->synced)
+      break;
+
+    /* leave the current directory */
+    for(idx-- ; idx && out->wp[idx - 1] != '/' ; idx--);
+    out->wp[idx] = '\0';
+  }
+
+  out->stop = 0;
+
+  return out->synced;
+}
+
+/* The archive is cut in regions by its markers, a range reads the
+   regions starting within it up to the first marker out of it. */
+static void read_range(struct sar_file *out)
+{
+  char *dir = xmalloc(WP_MAX);
+  uint64_t pos = out->offset, size, stop;
+  bool marker = false;
+
+  if(!plain_size(out, &size))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+
+  /* the first region starts with the nodes */
+  if(pos < out->range_start || pos >= out->range_end) {
+    marker = find_sync(out, MAX(out->range_start, pos), size, &pos, dir);
+    if(!marker || pos >= out->range_end) {
+      free(dir);
+      return;
+    }
+  }
+
+  if(!find_sync(out, MAX(out->range_end, pos + 1), size, &stop, NULL))
+    stop = size;
+
+  read_region(out, pos, stop, marker ? dir : NULL);
+
+  free(dir);
+}
+
+/* whether a region ends where it should, it is read without extracting
+   it and it is given up as soon as it is inconsistent */
+static bool check_region(struct sar_file *out, uint64_t pos, uint64_t stop,
+                         const char *dir, bool last)
+{
+  unsigned int verbose     = out->verbose;
+  unsigned int nb_patterns = out->nb_patterns;
+  bool list_only           = out->list_only;
+  bool whole               = false;
+  jmp_buf salvage;
+
+  out->list_only   = true;
+  out->verbose     = 0;
+  out->nb_patterns = 0;
+  out->salvage     = &salvage;
+
+  /* the last region is the only one which may end the archive */
+  if(!setjmp(salvage))
+    whole = read_region(out, pos, stop, dir) || last;
+
+  out->salvage     = NULL;
+  out->stop        = 0;
+  out->inside      = 0;
+  out->list_only   = list_only;
+  out->verbose     = verbose;
+  out->nb_patterns = nb_patterns;
+
+  return whole;
+}
+
+/* Damaged regions are skipped from one marker to the next while the
+   others are read as usual. A damaged marker merges two regions. */
+static void read_salvage(struct sar_file *out)
+{
+  char *dir  = xmalloc(WP_MAX);
+  char *next = xmalloc(WP_MAX);
+  uint64_t pos = out->offset, size, stop;
+  bool first = true;
+
+  if(!plain_size(out, &size))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+
+  for(;;) {
+    bool found = find_sync(out, pos + 1, size, &stop, next);
+    char *s;
+
+    if(!found)
+      stop = size;
+
+    if(check_region(out, pos, stop, first ? NULL : dir, !found))
+      read_region(out, pos, stop, first ? NULL : dir);
+    else
+      warnx("skipped damaged bytes from %lu to %lu",
+            (unsigned long)pos, (unsigned long)stop);
+
+    if(!found)
+      break;
+
+    s     = dir;
+    dir   = next;
+    next  = s;
+    pos   = stop;
+    first = false;
+  }
+
+  free(dir);
+  free(next);
+}
+
+static void check_sync_reader(struct sar_file *out)
+{
+  if(out->cs || out->fifo || out->parallel || out->block)
+    errx(EXIT_FAILURE, "only uncompressed archives can be read "
+         "from their markers");
+  if(!A_HAS_SYNC(out))
+    errx(EXIT_FAILURE, "archive has no synchronization markers");
+  if(!seekable(out))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+}
+
+/* Only read the nodes of the regions starting within a byte range of
+   the archive, so that consecutive ranges read each node once. */
+void sar_range(struct sar_file *out, uint64_t start, uint64_t end)
+{
+  assert(out);
+  assert(start < end);
+
+  check_sync_reader(out);
+
+  out->ranged      = true;
+  out->range_start = start;
+  out->range_end   = end;
+}
+
+/* skip the damaged regions of the archive instead of giving up */
+void sar_salvage(struct sar_file *out)
+{
+  assert(out);
+
+  check_sync_reader(out);
+
+  out->salvaging = true;
+}
+
+/* write the payloads of the selected regular files to the standard output */
+void sar_cat(struct sar_file *out)
+{
+  assert(out);
+
+  /* hard links are written out through the entry of their target,
+     the nodes of an archive without table are listed once for it */
+  if(!out->ranged && !out->salvaging && !out->cs && !A_HAS_COLUMN(out) &&
+     !read_toc(out) && seekable(out))
+    scan_entries(out);
+
+  out->cat = true;
+  sar_extract(out);
+}
+
 void sar_extract(struct sar_file *out)
 {
   assert(out);
-  assert(out->file);
+  assert(out->file || out->fifo);
   assert(!out->wp);
 
   /* create the working path
      this is the one we will use in the future */
   out->wp     = xmalloc(WP_MAX);
 
-  /* read until we receive a child control stamp */
+  /* seek to the selected nodes instead of reading the whole archive */
+  if(out->ranged)
+    read_range(out);
+  else if(out->salvaging)
+    read_salvage(out);
+  else if(out->nb_patterns && read_toc(out)) {
+    if(out->cat)
+      cat_toc(out);
+    else
+      extract_toc(out);
+  }
+  else {
+    /* decompress the following blocks while extracting */
+    if(out->block)
+      block_readahead(out->block, out->threads);
+
+    /* read until we receive a child control stamp */
+    while(rec_extract(out, 0) != 1);
+  }
+
+  /* the other ranges may hold what was not found */
+  if(!out->ranged)
+    report_missed(out);
+
+  free(out->wp);
+  UNPTR(out->wp);
+}
+
+static void write_cpoint(iofile_t file, const struct cpoint *cp)
+{
+  const struct codec *zlib = codec_find("gzip");
+  unsigned char s_cp[INDEX_CPOINT];
+  unsigned char packed[UINT16_MAX];
+  uint16_t packed_size = 0;
+  uint64_t u64;
+  uint16_t u16;
+
+  /* windows are compressed unless they would not shrink */
+  if(cp->window_size && zlib)
+    packed_size = codec_pack(zlib, 9, cp->window, cp->window_size,
+                             packed, cp->window_size - 1);
+
+  u64 = htole64(cp->packed);
+  memcpy(s_cp, &u64, sizeof(u64));
+  u64 = htole64(cp->plain);
+  memcpy(s_cp + 8, &u64, sizeof(u64));
+  s_cp[16] = cp->bits;
+  u16 = htole16(cp->window_size);
+  memcpy(s_cp + 17, &u16, sizeof(u16));
+  u16 = htole16(packed_size);
+  memcpy(s_cp + 19, &u16, sizeof(u16));
+
+  xiobuf_write(file, s_cp, sizeof(s_cp));
+  if(packed_size)
+    xiobuf_write(file, packed, packed_size);
+  else if(cp->window_size)
+    xiobuf_write(file, cp->window, cp->window_size);
+}
+
+static void write_index(struct sar_file *out)
+{
+  const struct cpoint *cps = NULL;
+  unsigned char header[INDEX_HEADER];
+  unsigned int nb_cps = 0, i;
+  struct stat st;
+  iofile_t file;
+  char *path;
+  uint64_t u64;
+  uint32_t u32;
+  int fd;
+
+  if(out->cs)
+    cps = cstream_checkpoints(out->cs, &nb_cps);
+
+  if(fstat(out->fd, &st) < 0)
+    err(EXIT_FAILURE, "cannot stat archive");
+
+  path = sidecar_name(out->path, INDEX_EXT);
+  fd   = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if(fd < 0)
+    err(EXIT_FAILURE, "could not open file \"%s\"", path);
+
+  file = iobuf_dopen(fd);
+
+  u32 = htole32(INDEX_MAGIK);
+  memcpy(header, &u32, sizeof(u32));
+  u64 = htole64(st.st_size);
+  memcpy(header + 4, &u64, sizeof(u64));
+  u64 = htole64(st.st_mtime);
+  memcpy(header + 12, &u64, sizeof(u64));
+  u32 = htole32(nb_cps);
+  memcpy(header + 20, &u32, sizeof(u32));
+  u32 = htole32(out->nb_toc);
+  memcpy(header + 24, &u32, sizeof(u32));
+
+  xiobuf_write(file, header, sizeof(header));
+
+  for(i = 0 ; i < nb_cps ; i++)
+    write_cpoint(file, &cps[i]);
+
+  for(i = 0 ; i < out->nb_toc ; i++) {
+    const struct sar_toc *entry = &out->toc[i];
+    unsigned char s_entry[TOC_ENTRY];
+    uint16_t len = encode_toc(entry, s_entry);
+
+    xiobuf_write(file, s_entry, sizeof(s_entry));
+    if(len)
+      xiobuf_write(file, entry->path, len);
+  }
+
+  if(iobuf_close(file) < 0)
+    err(EXIT_FAILURE, "cannot write index \"%s\"", path);
+
+  free(path);
+}
+
+/* Read an archive once to write the offset of each node beside it,
+   with checkpoints of the decompressor when it is compressed. Later
+   selections seek through this index instead of reading it all. */
+void sar_index(struct sar_file *out)
+{
+  assert(out);
+  assert(!out->wp);
+
+  if(!out->path)
+    errx(EXIT_FAILURE, "cannot index the standard input");
+  if(A_HAS_TOC(out))
+    errx(EXIT_FAILURE, "archive has a table of contents already");
+  if(A_HAS_COLUMN(out))
+    errx(EXIT_FAILURE, "cannot index columnar archives");
+  if(!seekable(out))
+    errx(EXIT_FAILURE, "cannot seek within this archive");
+
+  if(out->cs)
+    cstream_track(out->cs, INDEX_SPAN);
+  else if(out->block)
+    block_readahead(out->block, out->threads);
+
+  out->list_only = true;
+  out->listed    = true;
+  out->indexing  = true;
+  out->wp        = xmalloc(WP_MAX);
+
   while(rec_extract(out, 0) != 1);
 
   free(out->wp);
   UNPTR(out->wp);
+
+  write_index(out);
+}
+
+/* Rewrite the nodes of an archive into another one which may use
+   other compression or flags. Checksums are verified on the way in
+   and computed again on the way out. */
+void sar_transcode(struct sar_file *in, struct sar_file *out)
+{
+  assert(in);
+  assert(in->file || in->fifo);
+  assert(out);
+  assert(out->file || out->fifo);
+  assert(!in->wp);
+  assert(!out->wp);
+
+  if(in->block)
+    block_readahead(in->block, in->threads);
+
+  in->wp  = xmalloc(WP_MAX);
+  in->dst = out;
+
+  /* the control ending the archive is forwarded as well */
+  while(rec_extract(in, 0) != 1);
+
+  in->dst = NULL;
+  free(in->wp);
+  UNPTR(in->wp);
+}
+
+struct sar_range {
+  struct sar_file *file;   /* reader of the range */
+  pthread_t thread;
+  char *listing;           /* listing of the range */
+  size_t size;
+};
+
+/* list the nodes of a range of blocks,
+   the range starts within the directory given by its first block */
+static void * list_range(void *arg)
+{
+  struct sar_range *range = arg;
+  struct sar_file *out    = range->file;
+  size_t idx = strlen(out->wp);
+
+  if(idx)
+    out->wp[idx++] = '/';
+  out->wp[idx] = '\0';
+
+  while(!block_done(out->block)) {
+    if(rec_extract(out, idx) != 1)
+      continue;
+
+    /* end of the archive or of the range */
+    if(!idx || block_done(out->block))
+      break;
+
+    /* leave the current directory */
+    for(idx-- ; idx && out->wp[idx - 1] != '/' ; idx--);
+    out->wp[idx] = '\0';
+  }
+
+  fclose(out->listing);
+
+  return NULL;
 }
 
+/* Nodes are aligned on blocks in block archives. When the table
+   is available each range of blocks is listed by its own thread
+   and the listings are printed in order. */
 void sar_list(struct sar_file *out)
 {
+  unsigned int *starts = NULL;
+  unsigned int nb_ranges = 0;
+  struct sar_range *ranges;
+  unsigned int i;
+
   out->list_only = true;
-  sar_extract(out);
+  out->listed    = true;
+
+  /* a selection is listed on a single thread */
+  if(out->block && out->threads > 1 && !A_HAS_COLUMN(out) &&
+     !out->nb_patterns &&
+     block_table(out->block)) {
+    starts    = xmalloc(sizeof(unsigned int) * (out->threads + 1));
+    nb_ranges = block_split(out->block, out->threads, starts);
+  }
+
+  if(nb_ranges < 2) {
+    free(starts);
+    sar_extract(out);
+    return;
+  }
+
+  ranges = xmalloc(sizeof(struct sar_range) * nb_ranges);
+
+  for(i = 0 ; i < nb_ranges ; i++) {
+    struct sar_file *file = create_sar_file();
+    int n;
+
+    file->flags     = out->flags;
+    file->version   = out->version;
+    file->verbose   = out->verbose;
+    file->f_crc     = out->f_crc;
+    file->list_only = true;
+    file->wp        = xmalloc(WP_MAX + 2);
+    file->block     = block_range(out->block, starts[i], starts[i + 1],
+                                  file->wp);
+    file->listing   = open_memstream(&ranges[i].listing, &ranges[i].size);
+
+    if(!file->listing)
+      err(EXIT_FAILURE, "cannot open listing");
+
+    ranges[i].file = file;
+
+    n = pthread_create(&ranges[i].thread, NULL, list_range, &ranges[i]);
+    if(n) {
+      errno = n;
+      err(EXIT_FAILURE, "cannot create thread");
+    }
+  }
+
+  for(i = 0 ; i < nb_ranges ; i++) {
+    pthread_join(ranges[i].thread, NULL);
+
+    fwrite(ranges[i].listing, 1, ranges[i].size, stdout);
+
+    block_close(ranges[i].file->block);
+    free(ranges[i].listing);
+    free(ranges[i].file->wp);
+    free(ranges[i].file);
+  }
+
+  free(ranges);
+  free(starts);
 }
 
 void sar_info(struct sar_file *out)
@@ -1619,9 +6530,33 @@ void sar_info(struct sar_file *out)
          "\tVersion          : %d\n"
          "\tHas CRC          : %s\n"
          "\tHas nano time    : %s\n"
-         "\tHas CRC32-C      : %s\n",
+         "\tHas CRC32-C      : %s\n"
+         "\tHas dictionary   : %s\n"
+         "\tHas columns      : %s\n"
+         "\tHas sync markers : %s\n",
          out->version,
          S_BOOLEAN(A_HAS_CRC(out)),
          S_BOOLEAN(A_HAS_NTIME(out)),
-         S_BOOLEAN(A_HAS_CRC32_C(out)));
+         S_BOOLEAN(A_HAS_CRC32_C(out)),
+         S_BOOLEAN(out->dict),
+         S_BOOLEAN(A_HAS_COLUMN(out)),
+         S_BOOLEAN(A_HAS_SYNC(out)));
+
+  if(read_toc(out))
+    printf("\tContents         : %lu entries\n", out->nb_toc);
+
+  if(out->block) {
+    struct block_stat stat;
+
+    block_stat(out->block, &stat);
+
+    printf("\tBlock codec      : %s\n"
+           "\tBlock size       : %lu\n"
+           "\tBlocks           : %u\n"
+           "\tCompression ratio: %.2f\n",
+           codec_name(stat.codec),
+           (unsigned long)stat.block_size,
+           stat.nb_blocks,
+           stat.packed ? (double)stat.plain / stat.packed : 1.);
+  }
 }
@@ -33,6 +33,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <gawen/htable.h>
 #include <gawen/iobuf.h>
@@ -50,11 +55,20 @@
 # define PACKAGE_VERSION VERSION " (commit:" PARTIAL_COMMIT ")" /* add git commit */
 #endif /* COMMIT */
 
-#define MAGIK_VERSION 0          /* simple archive file format version
+#define MAGIK_VERSION 1          /* simple archive file format version
                                     (up to 255) */
+#define MAGIK_BASE    0          /* version of archives without dead nor
+                                    sparse controls */
 #define MAGIK_FMT_VER 0xff000000 /* bit mask for archive file format bits fields
                                     in magik number */
-#define MAGIK      (0x00524153 | MAGIK_VERSION)
+#define MAGIK      0x00524153
+#define MAGIK_OF(v) (MAGIK | (uint32_t)(v) << 24)
+#define TOC_MAGIK  0x54524153    /* "SART" ends the table of contents */
+#define INDEX_MAGIK 0x49524153   /* "SARI" starts a sidecar index */
+#define INDEX_EXT  ".sari"       /* extension of sidecar indexes */
+#define JOURNAL_MAGIK 0x4a524153 /* "SARJ" starts a compaction journal */
+#define JOURNAL_EXT ".sarj"      /* extension of compaction journals */
+#define SYNC_MAGIK 0xa5434e5953524153ULL /* "SARSYNC\xa5" starts a marker */
 
 #ifndef S_IFMT
 /* File type */
@@ -69,14 +83,35 @@
 # define S_ISVTX         0001000
 #endif /* S_IFMT */
 
+/* columns of the metadata section */
+enum column { COL_STREAM, /* archive stream itself */
+              COL_MODE,   /* modes and controls */
+              COL_CLASS,  /* node size classes */
+              COL_ID,     /* uid/gid */
+              COL_TIME,   /* times as differences with the previous node */
+              COL_NAME,   /* names and their size */
+              COL_SIZE,   /* sizes and devices */
+              COL_LINK,   /* link targets */
+              COL_CRC,    /* checksums */
+              COL_DATA    /* payloads following the metadata */ };
+
+struct sar_column {
+  unsigned char *buf;      /* content of the column */
+  size_t size;
+  size_t alloc;            /* allocated size */
+  size_t pos;              /* read position */
+};
+
 struct sar_file {
   int fd;                  /* file descriptor of the archive */
+  char *path;              /* absolute path of the archive read */
   iofile_t file;           /* file stream of the archive */
   uint8_t flags;           /* flags of this archive */
   uint8_t version;         /* version of sar archive */
 
   unsigned int verbose;    /* verbose level */
   bool list_only;          /* do not extract file skip them instead */
+  bool listed;             /* archive listed and not extracted */
 
   char *wp;                /* working path */
   size_t wp_sz;            /* working path size */
@@ -90,15 +125,180 @@ struct sar_file {
                     uint32_t crc); /* update crc */
   char *link;              /* symlink or hardlink destination */
   off_t size;              /* size of a node */
+  bool raw;                /* payload stored without compression */
+  struct dict *dict;       /* dictionary for small files */
+  struct dict_ctx *dctx;   /* dictionary context of this file */
+  int dict_level;          /* dictionary compression level */
+  bool group;              /* group similar files in directories */
 
   htable_t hl_tbl;         /* hard link table */
+  pid_t pid;               /* compressor child */
+  struct parallel *parallel; /* parallel compressor children */
+  struct cstream *cs;      /* in-process codec stream */
+  struct fifo *fifo;       /* pipe to the compressor child */
+  struct block *block;     /* block archive container */
+  unsigned int threads;    /* block decompression threads */
+  FILE *listing;           /* listing output instead of stdout */
+  struct sar_copy *copy;   /* copy mode destination */
+
+  /* transcoding */
+  struct sar_file *dst;    /* archive receiving the nodes read */
+  struct sar_file *src;    /* archive providing the payloads written */
+  const unsigned char *payload; /* small file already decompressed */
+  off_t left;              /* payload left to transcode */
+
+  /* columnar archive */
+  struct sar_column columns[COL_DATA]; /* metadata held apart */
+  enum column column;      /* column of the bytes written or read */
+  iofile_t spool;          /* payloads written after the metadata */
+  int spool_fd;
+  off_t spool_size;
+  off_t *runs;             /* spool offsets where raw payloads toggle */
+  unsigned int nb_runs;
+  unsigned int runs_size;
+  time_t atime;            /* times of the previous node */
+  time_t mtime;
+
+  /* table of contents */
+  bool creat;              /* archive being written */
+  uint64_t offset;         /* plain offset of the archive stream */
+  uint64_t payload_offset; /* plain offset of the current payload */
+  struct sar_toc *toc;     /* entry of each node */
+  unsigned long nb_toc;
+  unsigned long toc_size;
+  bool indexing;           /* entries recorded while reading */
+
+  /* modified in place */
+  bool inplace;            /* archive written again after its nodes */
+  struct sar_hardlink *seeds; /* files of the archive with other links */
+  unsigned int nb_seeds;
+  char *journal;           /* journal of the compaction */
+
+  /* synchronization markers */
+  uint64_t sync_span;      /* plain data between markers written */
+  uint64_t next_sync;      /* offset from which a marker is written */
+  uint64_t *syncs;         /* offsets of the markers read */
+  unsigned long nb_syncs;
+  unsigned long syncs_size;
+  bool ranged;             /* nodes read from the markers of a range */
+  uint64_t range_start;    /* bytes of the archive holding these markers */
+  uint64_t range_end;
+  bool salvaging;          /* damaged regions skipped */
+  jmp_buf *salvage;        /* region given up when damaged */
+  uint64_t stop;           /* nodes read up to this marker (0 for all) */
+  bool synced;             /* reading stopped on it */
+
+  uint32_t align;          /* payloads of large files aligned on it */
+
+  /* sparse files */
+  bool sparse;             /* files written without their holes */
+  size_t zero_block;       /* blocks of zeros taken for holes (0 for none) */
+  bool mapped;             /* current file stored as its data extents */
+  struct sar_extent *extents;
+  unsigned long nb_extents;
+  unsigned long extents_size;
+
+  /* selection */
+  char **patterns;         /* paths or globs of the nodes selected */
+  unsigned int nb_patterns;
+  bool *matched;           /* patterns matched by a node */
+  bool missed;             /* some pattern matched nothing */
+  unsigned int inside;     /* depth within a selected directory */
+  bool shallow;            /* directory extracted without its children */
+  bool cat;                /* payloads written to the standard output */
+  char *cat_link;          /* target of the hard link written out */
+
+  /* sharded archive */
+  struct sar_file **shards;     /* archive of each shard */
+  unsigned int nb_shards;       /* number of shards */
+};
+
+struct sar_toc {
+  char *path;              /* path as extracted */
+  uint64_t node;           /* plain offset of the node header */
+  uint64_t payload;        /* plain offset of the payload */
+  uint64_t size;           /* size of the node */
+  uint32_t crc;            /* checksum of the node */
+  uint16_t mode;           /* archive mode of the node */
+};
+
+struct sar_extent {
+  uint64_t offset;         /* offset of the data in the file */
+  uint64_t size;           /* size of the data */
+};
+
+struct sar_entry {
+  char *name;              /* entry name */
+  const char *ext;         /* extension within the name */
+  off_t size;              /* size of the entry */
+  bool dir;                /* directory */
+};
+
+struct sar_unit {
+  char *path;              /* subtree archived as a whole */
+  off_t size;              /* payload size of the subtree */
+  unsigned long seq;       /* walk order of its first node */
+};
+
+struct sar_walk {
+  pthread_t thread;        /* thread walking the units of a shard */
+  struct sar_file *shard;  /* archive of the shard */
+  struct sar_unit *units;  /* units of the shard in walk order */
+  unsigned long nb_units;
+};
+
+struct sar_compress {
+  const char *program;     /* external compressor */
+  const struct codec *codec; /* in-process codec replacing the program */
+  unsigned int jobs;       /* compressor children run at once */
+  int level;               /* compression level or LEVEL_DEFAULT */
+  unsigned int threads;    /* codec threads */
+  bool long_window;        /* long range matching */
+  bool automatic;          /* choose the codec by sampling the sources */
+  unsigned int target;     /* speed of automatic compression in MiB/s */
+  bool adapt;              /* adapt the level of blocks to the output */
+  int adapt_min;           /* adaptive levels (LEVEL_DEFAULT for bounds) */
+  int adapt_max;
+  size_t block_size;       /* plain size of independent blocks */
+  bool dictionary;         /* compress small files with a dictionary */
+  bool group;              /* group similar files in directories */
+  bool columns;            /* write metadata apart from payloads */
+  bool toc;                /* append a table of contents */
+  unsigned int sync;       /* MiB between synchronization markers */
+  unsigned int align;      /* KiB on which large payloads are aligned */
+  bool sparse;             /* store the data extents of sparse files */
+  unsigned int zero_block; /* KiB of zeros taken for holes (0 for none) */
+};
+
+struct sar_spool {
+  pthread_t thread;        /* thread walking this root */
+  pthread_t drainer;       /* thread draining the pipe meanwhile */
+  const char *path;        /* source root */
+  struct sar_file *file;   /* archive state for this root */
+  int fd;                  /* read end of the spool pipe */
+
+  /* drained so far, in memory then on disk */
+  char *buf;
+  size_t size;
+  int tmp;                 /* temporary file (-1 for none) */
+
+  pthread_mutex_t lock;
+  bool taken;              /* the archive reads the pipe itself */
+};
+
+struct sar_journal {
+  uint64_t w;              /* end of the nodes moved */
+  uint64_t r;              /* start of the nodes left to move */
+  uint64_t target;         /* node boundary the nodes are moved up to */
+  uint64_t end;            /* end of the nodes */
 };
 
 struct sar_hardlink {
-  ino_t inode;      /* inode number */
-  dev_t device;     /* device id */
-  nlink_t links;    /* number of hard links */
-  char *path;       /* path to the file */
+  ino_t inode;       /* inode number */
+  dev_t device;      /* device id */
+  nlink_t links;     /* number of hard links */
+  char *path;        /* path to the file */
+  unsigned long seq; /* walk order when splitting shards */
 };
 
 /* mode related flags */
@@ -114,7 +314,7 @@ enum mformat { M_IREG  = 0x0, /* regular file */
                M_ICTRL = 0x7, /* control node */ };
 
 /* permission flags */
-#define M_IPERM        0xfff8 /* bit maks for permission type bit fields */
+#define M_IPERM        0x7ff8 /* bit maks for permission type bit fields */
 enum mperm { M_ISUID = 0x8,    /* set UID bit */
              M_ISGID = 0x10,   /* set-group-ID bit */
              M_ISVTX = 0x20,   /* sticky bit */
@@ -128,9 +328,15 @@ enum mperm { M_ISUID = 0x8,    /* set UID bit */
              M_IWOTH = 0x2000, /* other has write permission */
              M_IXOTH = 0x4000, /* other has execute permission */ };
 
+/* payload mode flags */
+enum mflag { M_IRAW = 0x8000, /* regular file stored without compression */ };
+
 /* control mode flags */
 enum mctrl { M_C_CHILD  = 0x0, /* end of children */
-             M_C_IGNORE = 0x8, /* unsupported file type or dummy */ };
+             M_C_IGNORE = 0x8, /* unsupported file type or dummy */
+             M_C_DEAD   = 0x10, /* deleted nodes, their size (4) first */
+             M_C_SYNC   = 0x18, /* synchronization marker */
+             M_C_SPARSE = 0x20, /* extents of the next regular file */ };
 
 /* file types macro */
 #define M_IS(m, t) ((m & M_IFMT) == M_I ## t)
@@ -142,16 +348,30 @@ enum mctrl { M_C_CHILD  = 0x0, /* end of children */
 #define M_ISCHR(m)  M_IS(m, CHR)
 #define M_ISHARD(m) M_IS(m, HARD)
 #define M_ISCTRL(m) M_IS(m, CTRL)
+#define M_ISDEAD(m) (m == (M_ICTRL | M_C_DEAD))
+#define M_ISSYNC(m) (m == (M_ICTRL | M_C_SYNC))
+#define M_ISSPARSE(m) (m == (M_ICTRL | M_C_SPARSE))
 
 /* archive flags */
 #define A_ICRC     0x1 /* use a checksum for each file */
 #define A_INTIME   0x2 /* use nanosecond timestamp */
 #define A_ICRC32_C 0x4 /* use CRC32-C instead of CRC32-legacy */
-#define A_IMASK   (A_ICRC | A_INTIME | A_ICRC32_C) /* flags mask */
+#define A_IBLOCK   0x8 /* node stream compressed in independent blocks */
+#define A_IDICT    0x10 /* small files compressed alone with a dictionary */
+#define A_ICOLUMN  0x20 /* node metadata in columns before the payloads */
+#define A_ITOC     0x40 /* table of contents after the nodes */
+#define A_ISYNC    0x80 /* synchronization markers between the nodes */
+#define A_IMASK   (A_ICRC | A_INTIME | A_ICRC32_C | A_IBLOCK | \
+                   A_IDICT | A_ICOLUMN | A_ITOC | A_ISYNC) /* flags mask */
 #define A_HAS(a, t)    ((a->flags) & A_I ## t)
 #define A_HAS_CRC(a)     A_HAS(a, CRC)
 #define A_HAS_NTIME(a)   A_HAS(a, NTIME)
 #define A_HAS_CRC32_C(a) A_HAS(a, CRC32_C)
+#define A_HAS_BLOCK(a)   A_HAS(a, BLOCK)
+#define A_HAS_DICT(a)    A_HAS(a, DICT)
+#define A_HAS_COLUMN(a)  A_HAS(a, COLUMN)
+#define A_HAS_TOC(a)     A_HAS(a, TOC)
+#define A_HAS_SYNC(a)    A_HAS(a, SYNC)
 
 /* node size class related flags */
 /* file size class flags */
@@ -191,24 +411,74 @@ enum tsclass { N_TS32 = 0x0,  /* same 32bits time size class (4 Bytes) */
 enum max     { WP_MAX = 4095,
                NODE_MAX = 255,
                DATE_MAX = 255 };
-enum size    { HL_TBL_SZ = 256,
-               IO_SZ     = 1024 * 1024 };
+enum size    { HL_TBL_SZ     = 256,
+               ARCHIVE_HDR   = 5,                /* magik and flags */
+               IO_SZ         = 1024 * 1024,
+               SAMPLE_SZ     = 16 * 1024,        /* sample checked for compression */
+               SAMPLE_MIN    = 64 * 1024,        /* smaller files are not sampled */
+               DICT_FILE_MAX = 64 * 1024 - 1,    /* largest file using the dictionary */
+               DICT_SAMPLES  = 8 * 1024 * 1024,  /* dictionary training set */
+               DICT_SZ_MAX   = 16 * 1024 * 1024, /* stored dictionary */
+               AUTO_SAMPLES  = 128 * 1024 * 1024, /* sample of automatic compression */
+               AUTO_CHUNK    = 1024 * 1024,      /* plain size of a sample chunk */
+               AUTO_LEVELS   = 4,                /* steps across the levels of a codec */
+               AUTO_TARGET   = 50,               /* default speed in MiB/s */
+               TOC_ENTRY     = 32,               /* entry without its path */
+               TOC_FOOTER    = 16,
+               INDEX_HEADER  = 28,
+               INDEX_CPOINT  = 21,               /* checkpoint without its window */
+               INDEX_SPAN    = 4 * 1024 * 1024, /* plain data between checkpoints */
+               DEAD_HDR      = 6,                /* control and size of dead bytes */
+               JOURNAL_HDR   = 40,
+               COMPACT_CHUNK = 16 * 1024 * 1024, /* nodes moved between journal steps */
+               SYNC_HDR      = 22,               /* marker without its path and crc */
+               SYNC_SPAN     = 4 * 1024 * 1024, /* default plain data between markers */
+               ALIGN_SIZE    = 4 * 1024,         /* default alignment of payloads */
+               ALIGN_MIN     = 64 * 1024,        /* smaller payloads are not aligned */
+               ALIGN_MAX     = 1024 * 1024,
+               SPOOL_SZ      = 16 * 1024 * 1024 }; /* spool of a root kept in memory */
+
+/* time spent on each level of automatic compression in seconds */
+#define AUTO_TIME 0.5
 
 /* misc. */
 #define DATE_FORMAT "%d %b %Y %H:%M"
 
 struct sar_file * sar_creat(const char *path,
-                            const char *compress,
+                            const struct sar_compress *compress,
                             bool use_crc,
                             bool use_ntime,
                             unsigned int verbose);
+struct sar_file * sar_creat_shards(const char *path,
+                                   unsigned int nb_shards,
+                                   const struct sar_compress *compress,
+                                   bool use_crc,
+                                   bool use_ntime,
+                                   unsigned int verbose);
+struct sar_file * sar_copy(const char *dst, unsigned int verbose);
 struct sar_file * sar_read(const char *path,
-                           const char *compress,
+                           const struct sar_compress *compress,
                            unsigned int verbose);
-void sar_add(struct sar_file *out, const char *path);
+struct sar_file * sar_append(const char *path,
+                             const struct sar_compress *compress,
+                             unsigned int verbose);
+struct sar_file * sar_rewrite(const char *path, unsigned int verbose);
+void sar_auto(struct sar_compress *compress,
+              char * const *paths, unsigned int nb_paths);
+void sar_add(struct sar_file *out, char * const *paths, unsigned int nb_paths);
+void sar_select(struct sar_file *out,
+                char * const *patterns, unsigned int nb_patterns);
+void sar_range(struct sar_file *out, uint64_t start, uint64_t end);
+void sar_salvage(struct sar_file *out);
 void sar_extract(struct sar_file *out);
+void sar_cat(struct sar_file *out);
+void sar_delete(struct sar_file *out);
+void sar_compact(struct sar_file *out, uint64_t budget);
+void sar_transcode(struct sar_file *in, struct sar_file *out);
 void sar_list(struct sar_file *out);
+void sar_index(struct sar_file *out);
 void sar_info(struct sar_file *out);
+bool sar_failed(const struct sar_file *file);
 void sar_close(struct sar_file *file);
 
 #endif /* _SAR_H_ */